@@ -0,0 +1,604 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "util.h"
+#include "tinyoslib.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+
+/*
+	Kernel microbenchmarks.
+
+	Each benchmark is a boot test, which times BENCH_ROUNDS rounds of
+	some operation, and reports the mean ns/op and ops/s, and percentiles
+	of the ns/op of the rounds. Run them on several numbers of cores by
+	@verbatim
+	$ ./bench -c 1,2,4 bench_mutex_contention
+	@endverbatim
+
+	If the environment variable BENCH_CSV names a file, a CSV line is
+	appended to it for each measurement, so that results of different
+	runs can be compared.
+ */
+
+
+/** @brief The number of timed rounds of each measurement */
+#define BENCH_ROUNDS 64
+
+static unsigned long now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000000000ul + t.tv_nsec;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x>y) - (x<y);
+}
+
+/* The p-th percentile of n sorted values */
+static double percentile(const double* v, unsigned int n, double p)
+{
+	unsigned int i = (unsigned int)(p*(n-1)/100.0 + 0.5);
+	return v[i];
+}
+
+
+/*
+	Report a measurement.
+	- ops: the total number of operations
+	- bytes: the total number of bytes transferred, or 0
+	- wall: the total time in nsec
+	- samples: the ns/op of each round (they are sorted)
+ */
+static void bench_report(const char* name, const char* param, unsigned long ops,
+	unsigned long bytes, unsigned long wall, double* samples, unsigned int n)
+{
+	qsort(samples, n, sizeof(double), cmp_double);
+	double nsop = (double)wall / ops;
+	double opss = ops * 1e9 / wall;
+	double p50 = percentile(samples, n, 50), p90 = percentile(samples, n, 90);
+	double p99 = percentile(samples, n, 99), max = samples[n-1];
+
+	if(bytes)
+		MSG("%-12s %8.1f ns/op %12.0f ops/s %9.1f MB/s  p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+			param, nsop, opss, bytes*1e3/wall, p50, p90, p99, max);
+	else
+		MSG("%-12s %8.1f ns/op %12.0f ops/s  p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+			param, nsop, opss, p50, p90, p99, max);
+
+	const char* csvname = getenv("BENCH_CSV");
+	if(csvname == NULL) return;
+	FILE* csv = fopen(csvname, "a");
+	if(csv == NULL) return;
+	if(ftell(csv) == 0)
+		fprintf(csv, "bench,param,cores,ops,bytes,ns_per_op,ops_per_sec,p50,p90,p99,max\n");
+	fprintf(csv, "%s,%s,%u,%lu,%lu,%.2f,%.0f,%.2f,%.2f,%.2f,%.2f\n",
+		name, param, cpu_cores(), ops, bytes, nsop, opss, p50, p90, p99, max);
+	fclose(csv);
+}
+
+
+/* A timer for rounds of a measurement */
+typedef struct bench_timer {
+	unsigned long start, round_start;
+	unsigned int rounds;
+	double samples[BENCH_ROUNDS];
+} bench_timer;
+
+static void timer_start(bench_timer* t)
+{
+	t->rounds = 0;
+	t->start = t->round_start = now_ns();
+}
+
+/* End a round of n operations */
+static void timer_round(bench_timer* t, unsigned long n)
+{
+	unsigned long now = now_ns();
+	t->samples[t->rounds++] = (double)(now - t->round_start) / n;
+	t->round_start = now;
+}
+
+static unsigned long timer_wall(bench_timer* t)
+{
+	return t->round_start - t->start;
+}
+
+
+static int null_task(int argl, void* args)
+{
+	return argl;
+}
+
+
+
+/*********************************************
+ *
+ *  Scheduling and synchronization
+ *
+ *********************************************/
+
+static volatile int yield_stop;
+
+static int yield_partner(int argl, void* args)
+{
+	while(! yield_stop)
+		yield(SCHED_USER);
+	return 0;
+}
+
+BOOT_TEST(bench_yield,
+	"Context switch: two threads yield to each other. On one core,\n"
+	"every yield is a context switch."
+	)
+{
+	const unsigned int N = 2000;
+	bench_timer t;
+
+	yield_stop = 0;
+	Tid_t partner = CreateThread(yield_partner, 0, NULL);
+	ASSERT(partner != NOTHREAD);
+
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(unsigned int i=0; i<N; i++)
+			yield(SCHED_USER);
+		timer_round(&t, N);
+	}
+	yield_stop = 1;
+	ThreadJoin(partner, NULL);
+
+	bench_report("yield", "pingpong", BENCH_ROUNDS*N, 0, timer_wall(&t), t.samples, t.rounds);
+	return 0;
+}
+
+
+
+#define MUTEX_MAX_THREADS 16
+
+struct mutex_bench {
+	Mutex mx;
+	volatile unsigned long counter;
+	unsigned int iters;
+	barrier B;
+	unsigned int nthreads;
+	bench_timer timers[MUTEX_MAX_THREADS];
+};
+
+static int mutex_contender(int argl, void* args)
+{
+	struct mutex_bench* mb = args;
+	bench_timer* t = &mb->timers[argl];
+
+	BarrierSync(&mb->B, mb->nthreads);
+	timer_start(t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(unsigned int i=0; i<mb->iters; i++) {
+			Mutex_Lock(&mb->mx);
+			mb->counter++;
+			Mutex_Unlock(&mb->mx);
+		}
+		timer_round(t, mb->iters);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_contention,
+	"Mutex_Lock/Mutex_Unlock of a shared mutex by 1 to 16 threads. Run\n"
+	"on several numbers of cores, to measure contention.",
+	.timeout = 60
+	)
+{
+	static struct mutex_bench mb;
+	static double samples[MUTEX_MAX_THREADS*BENCH_ROUNDS];
+
+	for(unsigned int T=1; T<=MUTEX_MAX_THREADS; T*=2) {
+		mb.mx = MUTEX_INIT;
+		mb.counter = 0;
+		mb.iters = 20000/T;
+		mb.B = BARRIER_INIT;
+		mb.nthreads = T;
+
+		Tid_t tids[MUTEX_MAX_THREADS];
+		unsigned long start = now_ns();
+		for(unsigned int i=0; i<T; i++)
+			tids[i] = CreateThread(mutex_contender, i, &mb);
+		for(unsigned int i=0; i<T; i++)
+			ThreadJoin(tids[i], NULL);
+		unsigned long wall = now_ns() - start;
+
+		unsigned long ops = (unsigned long)T*BENCH_ROUNDS*mb.iters;
+		ASSERT(mb.counter == ops);
+
+		unsigned int n = 0;
+		for(unsigned int i=0; i<T; i++)
+			for(unsigned int r=0; r<mb.timers[i].rounds; r++)
+				samples[n++] = mb.timers[i].samples[r];
+
+		char param[32];
+		sprintf(param, "threads=%u", T);
+		bench_report("mutex", param, ops, 0, wall, samples, n);
+	}
+	return 0;
+}
+
+
+
+struct condvar_bench {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+	int stop;
+};
+
+static int condvar_partner(int argl, void* args)
+{
+	struct condvar_bench* cb = args;
+	Mutex_Lock(&cb->mx);
+	while(1) {
+		while(cb->turn == 0 && !cb->stop)
+			Cond_Wait(&cb->mx, &cb->cv);
+		if(cb->stop) break;
+		cb->turn = 0;
+		Cond_Signal(&cb->cv);
+	}
+	Mutex_Unlock(&cb->mx);
+	return 0;
+}
+
+BOOT_TEST(bench_condvar_roundtrip,
+	"CondVar round-trip: a thread signals another and waits to be signalled back."
+	)
+{
+	const unsigned int N = 1000;
+	struct condvar_bench cb = { MUTEX_INIT, COND_INIT, 0, 0 };
+	bench_timer t;
+
+	Tid_t partner = CreateThread(condvar_partner, 0, &cb);
+	ASSERT(partner != NOTHREAD);
+
+	Mutex_Lock(&cb.mx);
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(unsigned int i=0; i<N; i++) {
+			cb.turn = 1;
+			Cond_Signal(&cb.cv);
+			while(cb.turn == 1)
+				Cond_Wait(&cb.mx, &cb.cv);
+		}
+		timer_round(&t, N);
+	}
+	cb.stop = 1;
+	Cond_Broadcast(&cb.cv);
+	Mutex_Unlock(&cb.mx);
+	ThreadJoin(partner, NULL);
+
+	bench_report("condvar", "roundtrip", BENCH_ROUNDS*N, 0, timer_wall(&t), t.samples, t.rounds);
+	return 0;
+}
+
+
+
+/*********************************************
+ *
+ *  Processes and threads
+ *
+ *********************************************/
+
+BOOT_TEST(bench_exec_wait,
+	"Exec of a process that returns immediately, followed by WaitChild."
+	)
+{
+	const unsigned int N = 200;
+	bench_timer t;
+
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(unsigned int i=0; i<N; i++) {
+			Pid_t pid = Exec(null_task, 0, NULL);
+			ASSERT(WaitChild(pid, NULL) == pid);
+		}
+		timer_round(&t, N);
+	}
+
+	bench_report("exec_wait", "-", BENCH_ROUNDS*N, 0, timer_wall(&t), t.samples, t.rounds);
+	return 0;
+}
+
+
+BOOT_TEST(bench_thread_create_join,
+	"CreateThread of a thread that returns immediately, followed by ThreadJoin."
+	)
+{
+	const unsigned int N = 500;
+	bench_timer t;
+
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(unsigned int i=0; i<N; i++) {
+			Tid_t tid = CreateThread(null_task, 0, NULL);
+			ASSERT(ThreadJoin(tid, NULL) == 0);
+		}
+		timer_round(&t, N);
+	}
+
+	bench_report("thread", "create_join", BENCH_ROUNDS*N, 0, timer_wall(&t), t.samples, t.rounds);
+	return 0;
+}
+
+
+
+/*********************************************
+ *
+ *  Streams
+ *
+ *********************************************/
+
+/* The buffer sizes of the stream benchmarks */
+static const unsigned int stream_chunks[] = { 64, 512, 4096, 65536 };
+#define STREAM_CHUNKS (sizeof(stream_chunks)/sizeof(unsigned int))
+
+/* The data transferred by a stream benchmark, per buffer size */
+#define STREAM_BYTES (BENCH_ROUNDS << 18)
+
+struct stream_writer {
+	Fid_t fid;
+	unsigned int chunk;
+};
+
+static int stream_writer_task(int argl, void* args)
+{
+	struct stream_writer* sw = args;
+	char* buf = xmalloc(sw->chunk);
+	memset(buf, 'x', sw->chunk);
+
+	unsigned long total = 0;
+	while(total < STREAM_BYTES) {
+		int rc = Write(sw->fid, buf, sw->chunk);
+		if(rc <= 0) break;
+		total += rc;
+	}
+	free(buf);
+	Close(sw->fid);
+	return 0;
+}
+
+/*
+	Read STREAM_BYTES from fid, written by a thread into wfid in chunks,
+	and report it. The fids are closed.
+ */
+static void stream_bench(const char* name, Fid_t rfid, Fid_t wfid, unsigned int chunk)
+{
+	struct stream_writer sw = { wfid, chunk };
+	char* buf = xmalloc(chunk);
+	bench_timer t;
+
+	Tid_t writer = CreateThread(stream_writer_task, 0, &sw);
+
+	unsigned long total = 0, reads = 0, reads0 = 0;
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		unsigned long target = (unsigned long)(r+1)*(STREAM_BYTES/BENCH_ROUNDS);
+		while(total < target) {
+			int rc = Read(rfid, buf, chunk);
+			if(rc <= 0) break;
+			total += rc;
+			reads++;
+		}
+		timer_round(&t, reads - reads0 ? reads - reads0 : 1);
+		reads0 = reads;
+	}
+	ThreadJoin(writer, NULL);
+	Close(rfid);
+	free(buf);
+
+	ASSERT(total == STREAM_BYTES);
+
+	char param[32];
+	sprintf(param, "chunk=%u", chunk);
+	bench_report(name, param, reads, total, timer_wall(&t), t.samples, t.rounds);
+}
+
+
+BOOT_TEST(bench_pipe_throughput,
+	"Pipe throughput, between two threads, for several buffer sizes.",
+	.timeout = 60
+	)
+{
+	for(unsigned int c=0; c<STREAM_CHUNKS; c++) {
+		pipe_t p;
+		ASSERT(Pipe(&p) == 0);
+		stream_bench("pipe", p.read, p.write, stream_chunks[c]);
+	}
+	return 0;
+}
+
+
+static int socket_connector(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, argl, 1000) == 0);
+	*(Fid_t*)args = sock;
+	return 0;
+}
+
+BOOT_TEST(bench_socket_throughput,
+	"Socket throughput, between two threads, for several buffer sizes.",
+	.timeout = 60
+	)
+{
+	const port_t port = 100;
+	Fid_t lsock = Socket(port);
+	ASSERT(Listen(lsock) == 0);
+
+	for(unsigned int c=0; c<STREAM_CHUNKS; c++) {
+		Fid_t client;
+		Tid_t t = CreateThread(socket_connector, port, &client);
+		Fid_t server = Accept(lsock);
+		ASSERT(server != NOFILE);
+		ThreadJoin(t, NULL);
+
+		stream_bench("socket", server, client, stream_chunks[c]);
+	}
+	return 0;
+}
+
+
+/* The small writes of a ring benchmark round */
+#define RING_WRITES 4096
+
+BOOT_TEST(bench_ring_writes,
+	"Small writes to the null device, by Write() and by I/O ring batches of several sizes."
+	)
+{
+	static const unsigned int batches[] = { 1, 8, 32, 128 };
+	static io_sqe sq[128];
+	static io_cqe cq[128];
+	io_ring ring = { .entries = 128, .sq = sq, .cq = cq };
+	char buf[64];
+	bench_timer t;
+
+	Fid_t fid = OpenNull();
+	ASSERT(fid != NOFILE);
+	memset(buf, 'x', sizeof(buf));
+
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		for(int i=0; i<RING_WRITES; i++)
+			Write(fid, buf, sizeof(buf));
+		timer_round(&t, RING_WRITES);
+	}
+	bench_report("ring_writes", "Write", BENCH_ROUNDS*RING_WRITES, 0, timer_wall(&t), t.samples, t.rounds);
+
+	ASSERT(RingSetup(&ring) == 0);
+	for(unsigned int b=0; b<sizeof(batches)/sizeof(unsigned int); b++) {
+		unsigned int batch = batches[b];
+		timer_start(&t);
+		for(int r=0; r<BENCH_ROUNDS; r++) {
+			for(int i=0; i<RING_WRITES; i+=batch) {
+				for(unsigned int j=0; j<batch; j++) {
+					io_sqe* sqe = &sq[ring.sq_tail++ & 127];
+					sqe->op = IO_WRITE;
+					sqe->fd = fid;
+					sqe->buf = buf;
+					sqe->size = sizeof(buf);
+					sqe->user_data = j;
+				}
+				ASSERT(Submit(batch, batch) == batch);
+				/* Reap the completions */
+				__atomic_store_n(&ring.cq_head, __atomic_load_n(&ring.cq_tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+			}
+			timer_round(&t, RING_WRITES);
+		}
+		char param[32];
+		sprintf(param, "batch=%u", batch);
+		bench_report("ring_writes", param, BENCH_ROUNDS*RING_WRITES, 0, timer_wall(&t), t.samples, t.rounds);
+	}
+	ASSERT(RingSetup(NULL) == 0);
+
+	Close(fid);
+	return 0;
+}
+
+
+/* The characters of a stdio benchmark round */
+#define STDIO_CHARS 16384
+
+BOOT_TEST(bench_stdio_putc,
+	"Single-character writes by fputc to a fidopen stream on the null device, "
+	"unbuffered and with the default buffering."
+	)
+{
+	static const char* modes[] = { "unbuffered", "buffered" };
+	bench_timer t;
+
+	Fid_t fid = OpenNull();
+	ASSERT(fid != NOFILE);
+
+	for(int m=0; m<2; m++) {
+		FILE* f = fidopen(fid, "w");
+		ASSERT(f != NULL);
+		if(m == 0)
+			ASSERT(setvbuf(f, NULL, _IONBF, 0) == 0);
+
+		timer_start(&t);
+		for(int r=0; r<BENCH_ROUNDS; r++) {
+			for(int i=0; i<STDIO_CHARS; i++)
+				fputc('x', f);
+			fflush(f);
+			timer_round(&t, STDIO_CHARS);
+		}
+		fclose(f);
+		bench_report("stdio_putc", modes[m], BENCH_ROUNDS*STDIO_CHARS, STDIO_CHARS*BENCH_ROUNDS,
+			timer_wall(&t), t.samples, t.rounds);
+	}
+
+	Close(fid);
+	return 0;
+}
+
+
+BOOT_TEST(bench_serial_write,
+	"Serial throughput, writing 1 Mbyte to terminal 0 in 16 kbyte buffers.",
+	.minimum_terminals = 1, .timeout = 60
+	)
+{
+	const unsigned int chunk = 16384, N = 1;
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm != NOFILE);
+
+	char buffer[16384+1];
+	FUDGE(buffer);
+	buffer[chunk] = '\0';
+	for(int i=0; i<BENCH_ROUNDS; i++)
+		expect(0, buffer);
+
+	bench_timer t;
+	timer_start(&t);
+	for(int r=0; r<BENCH_ROUNDS; r++) {
+		unsigned int count = 0;
+		while(count < chunk) {
+			int rc = Write(fterm, buffer+count, chunk-count);
+			if(rc <= 0) break;
+			count += rc;
+		}
+		timer_round(&t, N);
+	}
+	Close(fterm);
+
+	bench_report("serial", "write", BENCH_ROUNDS*N, BENCH_ROUNDS*chunk, timer_wall(&t),
+		t.samples, t.rounds);
+	return 0;
+}
+
+
+
+TEST_SUITE(all_benchmarks,
+	"All the kernel benchmarks."
+	)
+{
+	&bench_yield,
+	&bench_mutex_contention,
+	&bench_condvar_roundtrip,
+	&bench_exec_wait,
+	&bench_thread_create_join,
+	&bench_pipe_throughput,
+	&bench_socket_throughput,
+	&bench_ring_writes,
+	&bench_stdio_putc,
+	&bench_serial_write,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
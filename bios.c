@@ -5,15 +5,23 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 #include "util.h"
 #include "bios.h"
@@ -28,6 +36,9 @@
 	- Core threads mask all signals except for USR1.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
+	- Interrupts are disabled in software, by a per-core flag. The USR1 
+	handler leaves interrupts pending while the flag is set, and they
+	are dispatched when interrupts are re-enabled.
 
  */
 
@@ -36,6 +47,22 @@
 #define CORE_STATISTICS
 #endif
 
+/*
+	Halted cores sleep on a futex, and are woken up with FUTEX_WAKE.
+	Disable to make them sleep in sigwaitinfo(), and be woken up by SIGUSR1.
+ */
+#if 1
+#define CORE_FUTEX_HALT
+#endif
+
+/*
+	Define BIOS_TSC_CLOCK to make bios_clock() read the TSC, as 
+	bios_fast_clock() does.
+ */
+#if 0
+#define BIOS_TSC_CLOCK
+#endif
+
 
 /*
 	Per-core data.
@@ -48,8 +75,13 @@ typedef struct core
 
 	struct sigevent timer_sigevent;
 	timer_t timer_id;
+	TimerDuration timer_deadline;  /* When the ALARM is due, or 0 */
+	TimerDuration timer_armed;     /* When the POSIX timer is armed to fire, or 0 */
 
 	volatile uint32_t intr_pending;
+	volatile uint32_t doorbell;     /* Futex word of a halted core */
+	volatile uint32_t serial_pending[2];  /* Ready serial ports, per io_direction */
+	volatile sig_atomic_t intr_disabled;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
 
@@ -112,6 +144,11 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 /* PIC daemon statistics */
 static unsigned long PIC_loops;
 
+#if defined(KERNEL_TRACE)
+/* Called before each interrupt dispatch (see cpu_interrupt_trace) */
+static interrupt_trace_hook* volatile intr_trace_hook;
+#endif
+
 /* Physical cores (needed for some heuristics) */
 static unsigned int physical_cores;
 
@@ -120,10 +157,16 @@ static unsigned int physical_cores;
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
 static void initialize()
 {
-	physical_cores = get_nprocs();
+	/* The host processors that the process may run on */
+	cpu_set_t avail;
+	if(sched_getaffinity(0, sizeof(avail), &avail) == 0)
+		physical_cores = CPU_COUNT(&avail);
+	else
+		physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* The handler is reentrant, since interrupts are masked by intr_disabled */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -157,20 +200,24 @@ static inline Core* curr_core() {
 }
 
 
+/* The eventfd used to wake up the PIC daemon (see below) */
+static int pic_wakeup_fd;
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	the PIC daemon to check its state.
  */
 static inline void interrupt_pic_thread()
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
+	uint64_t one = 1;
+	while(write(pic_wakeup_fd, &one, sizeof(one))==-1 && errno==EINTR);
 }
 
 
 
+/* Forward decl. (see Host CPU placement) */
+static void pin_core_thread(Core* core);
+
 /*
 	Helper pthread-startable function to launch a core thread.
 */
@@ -180,6 +227,11 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->doorbell = 0;
+	core->serial_pending[0] = core->serial_pending[1] = 0;
+	core->intr_disabled = 0;
+	core->timer_deadline = 0;
+	core->timer_armed = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -187,8 +239,14 @@ static void* core_thread(void* _core)
 
 	cpu_core_id = core->id;
 
-	/* Set core signal mask */
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
+	/* Pin to the host CPU of the core, if needed */
+	pin_core_thread(core);
+
+	/* 
+		Set core signal mask. SIGUSR1 must be unblocked, since interrupts 
+		are disabled in software.
+	 */
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &core_signal_set, NULL));
 
 	/* create a thread-specific timer */
 	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
@@ -288,11 +346,22 @@ static inline void interrupt_core(Core* core)
 }
 
 
+/*
+	Wake up a core sleeping in cpu_core_halt(), by ringing its doorbell.
+ */
+static inline void ring_doorbell(Core* core)
+{
+	__atomic_fetch_add(& core->doorbell, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, & core->doorbell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
 /*
 	Raise an interrupt to a core.
 
 	Adds intno as pending for the core and causes a signal to
-	be delivered.
+	be delivered. A halted core is woken up by its doorbell instead,
+	if CORE_FUTEX_HALT is defined.
  */
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
@@ -302,6 +371,14 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 		core->irq_raised[intno] ++;
 #endif
 
+#if defined(CORE_FUTEX_HALT)
+		/* Pairs with the fence in cpu_core_halt() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(halt_vector & (1u << core->id)) {
+			ring_doorbell(core);
+			return;
+		}
+#endif
 		interrupt_core(core);
 	}
 }
@@ -309,6 +386,73 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 
 
 
+/*
+	The core timer.
+
+	The POSIX timer of a core is programmed lazily. Each core keeps the 
+	time at which an ALARM is due (timer_deadline), and the time at which 
+	the POSIX timer is armed (timer_armed). The POSIX timer is only reprogrammed 
+	when it would fire too late. When it fires early (or after the timer was 
+	cancelled), the ALARM is not delivered and, if needed, the timer is re-armed.
+	Thus, cancelling a timer and setting it to a later time does not make a 
+	system call.
+
+	Times are absolute values of CLOCK_MONOTONIC (the clock of the POSIX timer),
+	in microseconds.
+ */
+
+/* An ALARM this close to its deadline is delivered */
+#define TIMER_SLACK 50
+
+static inline TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
+static inline uint64_t get_monotonic_nsec()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ull;
+}
+
+/*
+	Arm the POSIX timer of the core to fire at the absolute time 'deadline',
+	or disarm it if 'deadline' is 0.
+ */
+static void program_timer(Core* core, TimerDuration deadline)
+{
+	struct itimerspec newtime = {
+		.it_value = {.tv_sec= deadline / 1000000, .tv_nsec= (deadline % 1000000) * 1000ull},
+		.it_interval = {.tv_sec=0, .tv_nsec=0}
+	};
+	CHECK(timer_settime(core->timer_id, TIMER_ABSTIME, &newtime, NULL));
+	core->timer_armed = deadline;
+}
+
+/*
+	Called when the POSIX timer has fired. Return 1 if the ALARM is due,
+	else re-arm the timer as needed and return 0.
+	This must be called with interrupts disabled.
+ */
+static int alarm_due(Core* core)
+{
+	core->timer_armed = 0;
+
+	if(core->timer_deadline == 0) return 0;
+
+	if(get_monotonic_time() + TIMER_SLACK < core->timer_deadline) {
+		program_timer(core, core->timer_deadline);
+		return 0;
+	}
+
+	core->timer_deadline = 0;
+	return 1;
+}
+
+
 /*
 	Dispatch any pending interrupts, lowest first.
 	Cease if an interrupt causes core change.
@@ -323,8 +467,16 @@ static inline void dispatch_interrupts(Core* core)
 		if(! intr_fetch_lowest(core, &irq)) break;
 	
 		assert(0 <= irq  && irq < maximum_interrupt_no);
+
+		/* Ignore ALARM interrupts that are not due (see bios_set_timer) */
+		if(irq == ALARM && ! alarm_due(core)) continue;
+
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
+#endif
+#if defined(KERNEL_TRACE)
+		interrupt_trace_hook* hook = intr_trace_hook;
+		if(hook != NULL) hook(irq);
 #endif
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
@@ -342,8 +494,22 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Set the interrupt-disabled flag of a core. The signal fence keeps the
+	compiler from moving memory accesses across the change, with respect
+	to the USR1 handler.
+ */
+static inline void set_intr_disabled(Core* core, sig_atomic_t flag)
+{
+	core->intr_disabled = flag;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
+	If interrupts are disabled, they are left pending, to be dispatched by 
+	cpu_enable_interrupts().
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
@@ -353,7 +519,12 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	if(core->intr_disabled) return;
+
+	/* Dispatch with interrupts disabled, then re-enable (and replay) */
+	set_intr_disabled(core, 1);
 	dispatch_interrupts(core);
+	cpu_enable_interrupts();
 }
 
 
@@ -366,16 +537,89 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 static TimerDuration get_coarse_time()
 {
 	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME_COARSE, &curtime));
+	CHECK(clock_gettime(CLOCK_MONOTONIC_COARSE, &curtime));
 	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }
 
 
+/*
+	The TSC clock.
+
+	On x86-64 processors with an invariant TSC, CLOCK_MONOTONIC can be
+	extrapolated from the time stamp counter, without a system call. The TSC
+	rate is calibrated against CLOCK_MONOTONIC once, the first time it is
+	needed, over TSC_CALIBRATION usec. Without an invariant TSC, the TSC
+	clock is just CLOCK_MONOTONIC.
+ */
+#define TSC_CALIBRATION 5000
+
+static pthread_once_t tsc_control = PTHREAD_ONCE_INIT;
+static int tsc_usable;
+static uint64_t tsc_base;
+static TimerDuration tsc_base_time;
+static double tsc_usec_per_tick;
+static double tsc_nsec_per_tick;
+
+#if defined(__x86_64__)
+
+static void tsc_calibrate()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if(! __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u<<8)))
+		return;
+
+	TimerDuration t0 = get_monotonic_time();
+	uint64_t c0 = __rdtsc();
+	TimerDuration t1;
+	uint64_t c1;
+	do {
+		t1 = get_monotonic_time();
+		c1 = __rdtsc();
+	} while(t1 - t0 < TSC_CALIBRATION);
+
+	if(c1 <= c0) return;
+
+	tsc_base = c0;
+	tsc_base_time = t0;
+	tsc_usec_per_tick = (double)(t1 - t0) / (double)(c1 - c0);
+	tsc_nsec_per_tick = 1000.0 * tsc_usec_per_tick;
+	tsc_usable = 1;
+}
+
+static inline TimerDuration get_tsc_time()
+{
+	pthread_once(&tsc_control, tsc_calibrate);
+	if(! tsc_usable) return get_monotonic_time();
+	return tsc_base_time + (TimerDuration)((double)(__rdtsc() - tsc_base) * tsc_usec_per_tick);
+}
+
+static inline uint64_t get_tsc_nsec()
+{
+	pthread_once(&tsc_control, tsc_calibrate);
+	if(! tsc_usable) return get_monotonic_nsec();
+	return 1000*tsc_base_time + (uint64_t)((double)(__rdtsc() - tsc_base) * tsc_nsec_per_tick);
+}
+
+#else
+
+static inline TimerDuration get_tsc_time()
+{
+	return get_monotonic_time();
+}
+
+static inline uint64_t get_tsc_nsec()
+{
+	return get_monotonic_nsec();
+}
+
+#endif
+
+
 
 /*
 	An io_device handles a file descriptor that is connected to some
 	'peripheral' in stream (byte-oriented) mode. The file descriptor must be
-	'select-able' (i.e. not a disk file) and support non-blocking mode.
+	'epoll-able' (i.e. not a disk file) and support non-blocking mode.
 
 	Model outline:
 
@@ -386,13 +630,10 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
-
-	A not-ready device is made ready when select() returns it as such.
-
-	A ready device is made not-ready on each failed attempt to do an I/O transfer.
-
-	When a not-ready device becomes ready, an interrupt is raised.
+	The fd of an io_device is registered with the PIC epoll set once, in edge-triggered
+	mode, when the device is initialized. Each time the device may have become ready
+	(e.g., data arrived, or space was freed), epoll reports it to the PIC daemon, and
+	an interrupt is raised. Failed transfers do not need to notify the PIC daemon.
  */
 
 typedef enum io_direction
@@ -410,57 +651,39 @@ typedef struct io_device
 {
 	int fd;              		/* file descriptor */
 	io_direction iodir;  		/* device direction */
+	uint serial;                /* serial port of the device */
 
 	Core* volatile int_core;	/* core to receive interrupts */
-	volatile int ready;  		/* ready flag */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
 } io_device;
 
 
-/*
-	Determine device readiness without blocking
- */
-static int io_device_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
-}
-
-
-/*
-	Check that the a device is connected and in a good state.
- */
-static int io_device_check(io_device* dev)
-{
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	do {
-		rc=poll(&fds, 1, 0);
-	} while( rc == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
-}
+/* The PIC epoll set */
+static int pic_epfd = -1;
 
+/* The signalfd for SIGALRM, read by the PIC daemon */
+static int pic_alarm_fd = -1;
 
 
 /*
 	Initialize device
  */
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint serial)
 {
 	this->fd = fd;
 	this->iodir = iodir;
+	this->serial = serial;
 	this->int_core = &CORE[0];
-	this->ready = io_device_ready(fd, iodir);
 	this->last_int = get_coarse_time();
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
+
+	/* Register with the PIC */
+	struct epoll_event ev;
+	ev.events = EPOLLET | ((iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT);
+	ev.data.ptr = this;
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
 /*
@@ -468,6 +691,8 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
  */
 static int io_device_destroy(io_device* this)
 {
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_DEL, this->fd, NULL));
+
 	int rc;
 	while((rc = close(this->fd))==-1 && errno==EINTR);
 	if(rc==-1) perror("io_device_destroy: ");
@@ -475,47 +700,82 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+static int io_device_write(io_device* this, char value)
 {
-	assert(this->iodir == IODIR_RX);
+	assert(this->iodir == IODIR_TX);
+
+	/* Try to write */
 	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
-	if(!ok) perror("io_device_read:");
+	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	}
 	return rc==1;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Write as much of 'buf' as the fd accepts, in one write().
+ */
+static unsigned int io_device_write_block(io_device* this, const char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_TX);
 
-	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	ssize_t rc;
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
-	if(! ok) perror("io_device_write:");
+	int ok = rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	if(! ok) perror("io_device_write_block:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	return (rc>0) ? rc : 0;
+}
 
-	return rc==1;
+
+/*
+	Raise the interrupt of a device, recording the ready serial port.
+ */
+static void io_device_raise(io_device* dev, TimerDuration now)
+{
+	dev->last_int = now;
+	Core* core = (Core*) dev->int_core;
+	__atomic_fetch_or(& core->serial_pending[dev->iodir], 1u<<dev->serial, __ATOMIC_RELEASE);
+	raise_interrupt(core, (dev->iodir==IODIR_RX) ? SERIAL_RX_READY : SERIAL_TX_READY);
 }
 
 
 
 
+/*
+	The receive ring of a terminal.
+
+	Keyboard input is not read from the fd by the cores. Instead, the PIC daemon
+	fills the ring with bulk read()s whenever epoll reports the kbd fd readable;
+	the cores drain it by copying whole spans. Positions are free-running counters:
+	the PIC daemon is the only writer of 'head', and the cores, serialized by
+	'lock', are the only writers of 'tail'.
+
+	Since the kbd fd is edge-triggered, the PIC daemon reads it until EAGAIN. If it
+	has to stop because the ring is full, it sets 'stalled', and the next core
+	to consume data asks the PIC daemon to resume, via 'pic_refill'.
+ */
+#define RX_RING_SIZE 4096
+
+typedef struct rx_ring
+{
+	size_t head;			/* bytes received from the fd */
+	size_t tail;			/* bytes consumed by the cores */
+	int stalled;			/* the PIC stopped reading on a full ring */
+	char lock;				/* consumer spinlock */
+	char buffer[RX_RING_SIZE];
+} rx_ring;
+
+
+/* Bitmap of terminals whose receive ring must be refilled by the PIC */
+static uint32_t pic_refill;
+
 
 /*
 	A terminal encapsulates two io_devices: a console and a keyboard
@@ -523,6 +783,7 @@ static int io_device_write(io_device* this, char value)
 typedef struct terminal
 {
 	io_device con, kbd;            /* fds for terminal fifos */
+	rx_ring rx;                    /* keyboard input received by the PIC */
 } terminal;
 
 /* The terminal table */
@@ -534,10 +795,91 @@ static uint nterm = 0;
 /*
 	Init the devices for this terminal
  */
-static void terminal_init(terminal* this, int fdin, int fdout)
+static void terminal_init(terminal* this, uint serial, int fdin, int fdout)
 {
-	io_device_init(& this->kbd, fdin, IODIR_RX);
-	io_device_init(& this->con, fdout, IODIR_TX);
+	this->rx.head = this->rx.tail = 0;
+	this->rx.stalled = 0;
+	this->rx.lock = 0;
+	io_device_init(& this->kbd, fdin, IODIR_RX, serial);
+	io_device_init(& this->con, fdout, IODIR_TX, serial);
+}
+
+
+/*
+	Called by the PIC daemon when the kbd fd may be readable: read until 
+	EAGAIN, or until the ring is full, one contiguous span per read().
+	Return the number of bytes received.
+ */
+static size_t terminal_fill_rx(terminal* this)
+{
+	rx_ring* rx = & this->rx;
+	size_t start = rx->head;
+	size_t head = start;
+
+	for(;;) {
+		size_t tail = __atomic_load_n(& rx->tail, __ATOMIC_ACQUIRE);
+
+		if(head - tail == RX_RING_SIZE) {
+			/* Stall, unless a consumer freed space in the meantime */
+			__atomic_store_n(& rx->stalled, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(& rx->tail, __ATOMIC_SEQ_CST) == tail) break;
+			__atomic_store_n(& rx->stalled, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		size_t off = head & (RX_RING_SIZE-1);
+		size_t span = RX_RING_SIZE - (head - tail);
+		if(span > RX_RING_SIZE - off) span = RX_RING_SIZE - off;
+
+		ssize_t rc;
+		while((rc = read(this->kbd.fd, rx->buffer+off, span))==-1 && errno == EINTR);
+
+		int ok = rc>=0 || errno==EAGAIN || errno==EWOULDBLOCK;
+		if(!ok) perror("terminal_fill_rx:");
+		assert(ok);
+		if(rc<=0) break;
+
+		head += rc;
+		__atomic_store_n(& rx->head, head, __ATOMIC_RELEASE);
+	}
+
+	return head - start;
+}
+
+
+/*
+	Copy up to 'size' bytes out of the ring.
+ */
+static unsigned int terminal_read_rx(terminal* this, char* buf, unsigned int size)
+{
+	rx_ring* rx = & this->rx;
+
+	while(__atomic_test_and_set(& rx->lock, __ATOMIC_ACQUIRE));
+
+	size_t tail = rx->tail;
+	size_t head = __atomic_load_n(& rx->head, __ATOMIC_ACQUIRE);
+	size_t avail = head - tail;
+	unsigned int count = (avail < size) ? avail : size;
+
+	for(unsigned int done = 0; done < count; ) {
+		size_t off = (tail+done) & (RX_RING_SIZE-1);
+		size_t span = RX_RING_SIZE - off;
+		if(span > count-done) span = count-done;
+		memcpy(buf+done, rx->buffer+off, span);
+		done += span;
+	}
+	__atomic_store_n(& rx->tail, tail+count, __ATOMIC_SEQ_CST);
+
+	__atomic_clear(& rx->lock, __ATOMIC_RELEASE);
+
+	/* Let the PIC resume reading, if it stopped on a full ring */
+	if(count>0 && __atomic_load_n(& rx->stalled, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(& rx->stalled, 0, __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_or(& pic_refill, 1u<<this->kbd.serial, __ATOMIC_RELEASE);
+		interrupt_pic_thread();
+	}
+
+	return count;
 }
 
 /*
@@ -563,21 +905,22 @@ static int terminal_destroy(terminal* this)
 		io_device becomes ready.
 
 	Implementation:
-	- Use Linux signal file descriptors to receive signals. Currently,
-	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
+	- All fds are monitored by an epoll set. Device fds are registered
+	  once, edge-triggered, by io_device_init(). The PIC also monitors:
 
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
+	  * an eventfd, written by interrupt_pic_thread(), which wakes up the 
+	    PIC daemon, to stop it or to refill some receive rings.
+
+	  * a signalfd for SIGALRM, which is sent to indicate that some core 
+	    timer has expired. This results to an interrupt on the core.
 
-	- Monitor these fds together with the fds of the terminals.
-	
 	- At each loop dispatch interrupts as needed:
 	  * ALARM interrupts to those cores whose timer has expired
 	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
+	    an io_device which is now READY.
+
+	- About every SERIAL_TIMEOUT/2, the devices are swept, and the interrupts
+	  of inactive devices are raised.
  */
 
 
@@ -623,97 +966,78 @@ static void close_signalfd(int sfd)
 
 /********************************
 
-	PIC loop state and helpers
+	PIC loop helpers
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
+/* Max. number of events returned by one epoll_wait() */
+#define PIC_EVENTS 32
 
 
-static void pic_selector_reset(pic_selector* ps)
+/*
+	Create the epoll set and the wakeup eventfd. This is called before the 
+	devices are initialized.
+ */
+static void pic_open()
 {
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
+	pic_epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(pic_epfd);
+	pic_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(pic_wakeup_fd);
+	pic_refill = 0;
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &pic_wakeup_fd };
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_ADD, pic_wakeup_fd, &ev));
 }
 
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static void pic_close()
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	CHECK(close(pic_wakeup_fd));
+	CHECK(close(pic_epfd));
+	pic_wakeup_fd = pic_epfd = -1;
 }
 
 
-
-static int pic_select(pic_selector* ps)
+/* Handle a wakeup of the PIC */
+static void pic_wakeup(TimerDuration now)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	uint64_t val;
+	while(read(pic_wakeup_fd, &val, sizeof(val))==-1 && errno==EINTR);
+
+	uint32_t refill = __atomic_exchange_n(& pic_refill, 0, __ATOMIC_ACQUIRE);
+	while(refill) {
+		terminal* term = & TERM[__builtin_ctz(refill)];
+		refill &= refill-1;
+		if(terminal_fill_rx(term) > 0)
+			io_device_raise(& term->kbd, now);
 	}
-	return selcode;
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+/* Handle an epoll event of a device */
+static void pic_device_event(io_device* dev, TimerDuration now)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
-}
-
-
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
-{
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
-}
-
-
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
-{
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	if(dev->iodir == IODIR_RX) {
+		if(terminal_fill_rx(& TERM[dev->serial]) == 0) return;
 	}
+	io_device_raise(dev, now);
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+/* Raise the interrupts of devices that have been inactive for too long */
+static void pic_sweep(TimerDuration now)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	for(uint i=0; i<nterm; i++) {
+		terminal* term = & TERM[i];
+		if(now - term->con.last_int > SERIAL_TIMEOUT)
+			io_device_raise(& term->con, now);
+		if(now - term->kbd.last_int > SERIAL_TIMEOUT)
+			io_device_raise(& term->kbd, now);
 	}
 }
 
 
-
-
 static void PIC_daemon(void)
 {
 
@@ -722,9 +1046,10 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
-	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
+	/* Open the signal queue */
+	pic_alarm_fd = open_signalfd(&sigalrm_set);
+	struct epoll_event alarm_ev = { .events = EPOLLIN, .data.ptr = &pic_alarm_fd };
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_ADD, pic_alarm_fd, &alarm_ev));
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
@@ -732,57 +1057,57 @@ static void PIC_daemon(void)
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
-	
-	/* The PIC multiplexing loop */
-	while(PIC_active) {
 
-		pic_selector ps;
+	TimerDuration next_sweep = get_coarse_time() + SERIAL_TIMEOUT/2;
 
-		pic_selector_reset(&ps);
+	/* The PIC multiplexing loop */
+	while(PIC_active) {
 
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
+		struct epoll_event events[PIC_EVENTS];
 
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+		TimerDuration now = get_coarse_time();
+		int timeout = (next_sweep > now) ? (next_sweep - now + 999)/1000 : 0;
 
-		if(pic_select(&ps) == -1)
+		int nev = epoll_wait(pic_epfd, events, PIC_EVENTS, timeout);
+		if(nev == -1) {
+			if(errno != EINTR) perror("PIC_daemon: ");
 			continue;
+		}
 
 		PIC_loops++ ;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
+		now = get_coarse_time();
 
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
+		for(int e=0; e<nev; e++) {
+			void* src = events[e].data.ptr;
 
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+			if(src == &pic_alarm_fd) {
+				struct signalfd_siginfo sfdinfo;
+				while(read_signalfd(pic_alarm_fd, &sfdinfo) != -1) {
+					Core* core = & CORE[sfdinfo.ssi_int];
+					raise_interrupt(core, ALARM);
+				}
+			}
+			else if(src == &pic_wakeup_fd)
+				pic_wakeup(now);
+			else
+				pic_device_event((io_device*) src, now);
 		}
 
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+		if(now >= next_sweep) {
+			pic_sweep(now);
+			next_sweep = now + SERIAL_TIMEOUT/2;
 		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
-	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
+	/* Close signal fd */
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_DEL, pic_alarm_fd, NULL));
+	close_signalfd(pic_alarm_fd);
+	pic_alarm_fd = -1;
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -794,6 +1119,153 @@ static void PIC_daemon(void)
 
 
 
+/*****************************************
+	Host CPU placement
+ *****************************************/
+
+/* The topology of a host CPU */
+typedef struct host_cpu
+{
+	int cpu;		/* host CPU number */
+	int package;	/* physical package (socket) */
+	int core;		/* physical core, within the package */
+	int rank;		/* 0 for the first SMT thread of the physical core, 1 for the next etc. */
+} host_cpu;
+
+/* Host placement of the cores, or -1 when the cores are not pinned */
+static host_cpu core_host[MAX_CORES];
+static int cores_pinned;
+
+/* Saved affinity of the PIC thread */
+static cpu_set_t pic_saved_affinity;
+static int pic_pinned;
+
+
+/* Read an integer from a sysfs topology file of a CPU, or return -1 */
+static int read_cpu_topology(int cpu, const char* name)
+{
+	char fname[128];
+	snprintf(fname, sizeof(fname), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	FILE* f = fopen(fname, "r");
+	if(f == NULL) return -1;
+	int val;
+	if(fscanf(f, "%d", &val) != 1) val = -1;
+	fclose(f);
+	return val;
+}
+
+
+static void host_cpu_init(host_cpu* hc, int cpu)
+{
+	hc->cpu = cpu;
+	hc->package = read_cpu_topology(cpu, "physical_package_id");
+	hc->core = read_cpu_topology(cpu, "core_id");
+	if(hc->package < 0) hc->package = 0;
+	if(hc->core < 0) hc->core = cpu;
+	hc->rank = 0;
+}
+
+
+/* Order for VM_AFFINITY_AUTO: SMT rank first, then package, then physical core */
+static int host_cpu_cmp(const void* a, const void* b)
+{
+	const host_cpu* x = a;
+	const host_cpu* y = b;
+	if(x->rank != y->rank) return x->rank - y->rank;
+	if(x->package != y->package) return x->package - y->package;
+	if(x->core != y->core) return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+
+
+/* 
+	Compute the host CPUs of the core threads and of the PIC, according to
+	the VM configuration. Return 1 if the VM threads are pinned.
+ */
+static int vm_place_cores(vm_config* vmc, int* pic_cpu)
+{
+	*pic_cpu = vmc->pic_cpu;
+
+	if(vmc->affinity == VM_AFFINITY_LIST) {
+		for(uint c=0; c<vmc->cores; c++) {
+			CHECK_CONDITION(vmc->core_cpu[c] >= 0 && vmc->core_cpu[c] < CPU_SETSIZE);
+			host_cpu_init(& core_host[c], vmc->core_cpu[c]);
+		}
+		return 1;
+	}
+
+	if(vmc->affinity != VM_AFFINITY_AUTO) 
+		return 0;
+
+	/* The CPUs available to the process */
+	cpu_set_t avail;
+	CHECK(sched_getaffinity(0, sizeof(avail), &avail));
+
+	static host_cpu hosts[CPU_SETSIZE];
+	int nhosts = 0;
+	for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(! CPU_ISSET(cpu, &avail)) continue;
+		host_cpu_init(& hosts[nhosts], cpu);
+		for(int i=0; i<nhosts; i++)
+			if(hosts[i].package==hosts[nhosts].package && hosts[i].core==hosts[nhosts].core)
+				hosts[nhosts].rank++;
+		nhosts++;
+	}
+	if(nhosts == 0) return 0;
+
+	qsort(hosts, nhosts, sizeof(host_cpu), host_cpu_cmp);
+
+	for(uint c=0; c<vmc->cores; c++)
+		core_host[c] = hosts[c % nhosts];
+	if(*pic_cpu < 0)
+		*pic_cpu = hosts[vmc->cores % nhosts].cpu;
+	return 1;
+}
+
+
+/* Pin the current thread to a host CPU, and allocate its memory locally */
+static void pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+
+	/* This may fail, e.g., in containers. It is only an optimization. */
+	syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+}
+
+
+/* Called by a core thread at startup */
+static void pin_core_thread(Core* core)
+{
+	if(cores_pinned)
+		pin_current_thread(core_host[core->id].cpu);
+}
+
+
+int cpu_core_host_cpu(uint core)
+{
+	if(!(core < ncores) || !cores_pinned) return -1;
+	return core_host[core].cpu;
+}
+
+
+int cpu_core_distance(uint core1, uint core2)
+{
+	if(core1 == core2) return 0;
+	if(!(core1 < ncores && core2 < ncores) || !cores_pinned) return 2;
+
+	host_cpu* h1 = & core_host[core1];
+	host_cpu* h2 = & core_host[core2];
+	if(h1->package != h2->package) return 3;
+	if(h1->core != h2->core) return 2;
+	return 1;
+}
+
+
+
+
 /*****************************************
 	Public API
  *****************************************/
@@ -856,6 +1328,8 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	vmc->affinity = VM_AFFINITY_NONE;
+	vmc->pic_cpu = -1;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
@@ -887,10 +1361,11 @@ void vm_run(vm_config* vmc)
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
-	/* Initialize terminals */
+	/* Initialize the PIC and the terminals */
+	pic_open();
 	nterm = vmc->serialno;
 	for(uint i=0; i<nterm; i++)
-		terminal_init(& TERM[i], vmc->serial_in[i], vmc->serial_out[i]);
+		terminal_init(& TERM[i], i, vmc->serial_in[i], vmc->serial_out[i]);
 
 	/* Init the cores */
 	ncores = vmc->cores;
@@ -902,6 +1377,10 @@ void vm_run(vm_config* vmc)
 	/* Initialize the halted vector */
 	halt_vector = 0;
 
+	/* Place the VM threads on host CPUs */
+	int pic_cpu;
+	cores_pinned = vm_place_cores(vmc, &pic_cpu);
+
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
 		/* Initialize Core */
@@ -929,6 +1408,14 @@ void vm_run(vm_config* vmc)
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
 
+	/* Pin this thread, after the core threads have been created with its affinity */
+	pic_pinned = 0;
+	if(pic_cpu >= 0 && pic_cpu < CPU_SETSIZE) {
+		CHECKRC(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &pic_saved_affinity));
+		pin_current_thread(pic_cpu);
+		pic_pinned = 1;
+	}
+
 	/* Initialize PIC statistics */
 	PIC_loops = 0;
 
@@ -946,6 +1433,12 @@ void vm_run(vm_config* vmc)
 
 	/* Delete the Core table */
 	ncores = 0;
+	cores_pinned = 0;
+
+	/* Restore the affinity of this thread */
+	if(pic_pinned)
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pic_saved_affinity));
+	pic_pinned = 0;
 
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
@@ -955,6 +1448,7 @@ void vm_run(vm_config* vmc)
 	for(uint i=0; i<nterm; i++)
 		CHECK(terminal_destroy(& TERM[i]));
 	nterm = 0;
+	pic_close();
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
@@ -992,6 +1486,11 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
 
 
 void cpu_core_halt()
@@ -1006,44 +1505,73 @@ void cpu_core_halt()
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
+#if defined(CORE_FUTEX_HALT)
+	/* 
+		Sleep until an interrupt is pending, or the core is restarted.
+		Both ring the doorbell after their change, so reading the doorbell
+		first avoids missing the wakeup.
+	 */
+	for(;;) {
+		uint32_t bell = __atomic_load_n(& core->doorbell, __ATOMIC_SEQ_CST);
+		if(core->intr_pending != 0 
+			|| (__atomic_load_n(& halt_vector, __ATOMIC_SEQ_CST) & cmask) == 0)
+			break;
+		int rc = syscall(SYS_futex, & core->doorbell, FUTEX_WAIT_PRIVATE, bell, NULL, NULL, 0);
+		assert(rc==0 || (errno == EINTR || errno == EAGAIN));
+		(void)rc;
+	}
+#else
 	siginfo_t info;
 
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* 
+		Do not sleep if an interrupt is already pending, since its signal 
+		may have been consumed while interrupts were disabled.
+	 */
+	int rc = 1;
+	if(core->intr_pending == 0) {
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		rc = sigwaitinfo(&sigusr1_set, &info);
 	}
 
+	assert(rc>0 || (errno == EINTR || errno == EAGAIN));
+#endif
+
 #if defined(CORE_STATISTICS)
 	/* Unset halt bit */
 	core->hlt_time += get_coarse_time()-stime0;
 #endif
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	/* 
+		Got signal, dispatch. This is done by the replay of pending 
+		interrupts in cpu_enable_interrupts(), if interrupts are enabled.
+	 */
+	if(cpu_disable_interrupts()) 
+		cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 	if( prevhv & cmask ) {
+#if defined(CORE_FUTEX_HALT)
+		ring_doorbell(CORE+c);
+#else
 		interrupt_core(CORE+c);
+#endif
 #if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
 #endif
@@ -1092,31 +1620,178 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
+}
+
+void cpu_interrupt_trace(interrupt_trace_hook* hook)
+{
+#if defined(KERNEL_TRACE)
+	intr_trace_hook = hook;
+#endif
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! curr_core()->intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	Core* core = curr_core();
+	int enabled = ! core->intr_disabled;
+	set_intr_disabled(core, 1);
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	/* 
+		Replay the interrupts that arrived while interrupts were disabled. 
+		Note that the core may change after a dispatch.
+	 */
+	while(1) {
+		Core* core = curr_core();
+		set_intr_disabled(core, 0);
+		if(core->intr_pending == 0) break;
+		set_intr_disabled(core, 1);
+		dispatch_interrupts(core);
+	}
+}
+
+
+#ifdef CPU_CONTEXT_ASM
+
+/*
+	Save the callee-saved registers on the current stack, store the stack
+	pointer into *oldsp, load newsp and restore the registers saved there.
+	The layout of the saved registers must agree with cpu_initialize_context().
+ */
+void __cpu_switch_stack(void** oldsp, void* newsp);
+
+#if defined(__x86_64__)
+
+/*
+	Saved frame, from the saved stack pointer upwards:
+	mxcsr and x87 control word (8 bytes), r15, r14, r13, r12, rbx, rbp, return address.
+ */
+#define CTX_FRAME_WORDS 7
+
+__asm__(
+	".text\n"
+	".globl __cpu_switch_stack\n"
+	".type __cpu_switch_stack, @function\n"
+	"__cpu_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size __cpu_switch_stack, .-__cpu_switch_stack\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, 16-byte aligned */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+
+	/* 
+		A null return address for ctx_func, below it the entry point for 'ret',
+		and below it the saved registers. After the 'ret', the stack
+		is aligned as if ctx_func had been called.
+	 */
+	uint64_t* frame = (uint64_t*)(top - 16) - CTX_FRAME_WORDS;
+	memset(frame, 0, (CTX_FRAME_WORDS + 2) * sizeof(uint64_t));
+
+	uint32_t mxcsr;  uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+	((uint32_t*)frame)[0] = mxcsr;
+	((uint16_t*)frame)[2] = fpucw;
+
+	frame[CTX_FRAME_WORDS] = (uint64_t)ctx_func;
+	ctx->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+/*
+	Saved frame, from the saved stack pointer upwards:
+	x19-x28, x29 (fp), x30 (lr), d8-d15.
+ */
+#define CTX_FRAME_WORDS 20
+
+__asm__(
+	".text\n"
+	".globl __cpu_switch_stack\n"
+	".type __cpu_switch_stack, %function\n"
+	"__cpu_switch_stack:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size __cpu_switch_stack, .-__cpu_switch_stack\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, 16-byte aligned */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+
+	/* The saved registers, with lr pointing at ctx_func and a null frame pointer */
+	uint64_t* frame = (uint64_t*)top - CTX_FRAME_WORDS;
+	memset(frame, 0, CTX_FRAME_WORDS * sizeof(uint64_t));
+	frame[11] = (uint64_t)ctx_func;
+	ctx->sp = frame;
+}
+
+#endif
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	__cpu_switch_stack(&oldctx->sp, newctx->sp);
 }
 
+#else
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
@@ -1129,8 +1804,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* SIGUSR1 stays unblocked, since interrupts are disabled in software */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1815,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1149,20 +1826,24 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
-	time_t sec = usec / 1000000;
-	long nsec = (usec % 1000000) * 1000ull;
-	
-	struct itimerspec newtime = {
-		.it_value = {.tv_sec=sec, .tv_nsec=nsec},
-		.it_interval = {.tv_sec=0, .tv_nsec=0}
-	};
+	int enabled = cpu_disable_interrupts();
 
-	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+	Core* core = curr_core();
+	TimerDuration curtime = get_monotonic_time();
+
+	TimerDuration remaining = 0;
+	if(core->timer_deadline > curtime)
+		remaining = core->timer_deadline - curtime;
+
+	core->timer_deadline = (usec == 0) ? 0 : curtime + usec;
+
+	/* Only reprogram the POSIX timer if it would fire too late */
+	if(core->timer_deadline != 0 &&
+		(core->timer_armed == 0 || core->timer_armed > core->timer_deadline))
+		program_timer(core, core->timer_deadline);
 
-	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
-	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
+	if(enabled) cpu_enable_interrupts();
+	return remaining;
 }
 
 TimerDuration bios_cancel_timer()
@@ -1173,10 +1854,26 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+#if defined(BIOS_TSC_CLOCK)
+	return get_tsc_time();
+#else
+	return get_monotonic_time();
+#endif
 }	
 
 
+TimerDuration bios_fast_clock()
+{
+	return get_tsc_time();
+}
+
+
+uint64_t bios_fast_clock_nsec()
+{
+	return get_tsc_nsec();
+}
+
+
 
 uint bios_serial_ports()
 {
@@ -1203,13 +1900,46 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the bitmap of serial ports for which interrupt 'intno'
+	was raised on the current core.
+ */
+uint32_t bios_serial_ready(Interrupt intno)
+{
+	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return 0;
+	io_direction dir = (intno==SERIAL_RX_READY) ? IODIR_RX : IODIR_TX;
+	return __atomic_exchange_n(& curr_core()->serial_pending[dir], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return terminal_read_rx(& TERM[serial], ptr, 1);
+}
+
+
+/*
+	Copy up to 'size' bytes received by serial port 'serial' into 'buf'.
+	Return the number of bytes copied.
+ */
+unsigned int bios_read_serial_block(uint serial, char* buf, unsigned int size)
+{
+	return terminal_read_rx(& TERM[serial], buf, size);
+}
+
+
+/*
+	Return the number of bytes received by serial port 'serial' and not yet read.
+ */
+unsigned int bios_serial_rx_pending(uint serial)
+{
+	terminal* term = & TERM[serial];
+	return __atomic_load_n(& term->rx.head, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(& term->rx.tail, __ATOMIC_ACQUIRE);
 }
 
 
@@ -1223,3 +1953,13 @@ int bios_write_serial(uint serial, char value)
 }
 
 
+/*
+	Try to write the 'size' bytes of 'buf' to serial port 'serial'. Return
+	the number of bytes written.
+ */
+unsigned int bios_write_serial_block(uint serial, const char* buf, unsigned int size)
+{
+	return io_device_write_block(& TERM[serial].con, buf, size);
+}
+
+
@@ -68,7 +68,8 @@
 
 	Each serial port/terminal can support reading and writing of single bytes.
 	The reads return keyboard input, whereas the writes send characters to display
-	on the screen.
+	on the screen. Keyboard input is received into a buffer by the VM, and can
+	also be read in blocks. Similarly, blocks of bytes can be written.
 
 	Terminals are numbered from 0, up to @c MAX_TERMINALS-1. 
 
@@ -128,14 +129,37 @@ typedef enum Interrupt
 } Interrupt;
 
 
+/**
+	@brief The signature type of an interrupt trace hook.
+	@see cpu_interrupt_trace
+ */
+typedef void interrupt_trace_hook(Interrupt intno);
+
+
 /** @brief Maximum number of cores for a virtual machine. */
 #define MAX_CORES 32
 
-/** @brief Maximum number of terminals for a virtual machine. */
+/** @brief Maximum number of terminals for a virtual machine. 
+
+	This cannot exceed 32 (see @ref bios_serial_ready).
+ */
 #define MAX_TERMINALS 4
 
 
 
+/**
+	@brief Host CPU affinity policies for the threads of a virtual machine.
+
+	@see vm_config
+ */
+typedef enum vm_affinity {
+	VM_AFFINITY_NONE,	/**< The threads are not pinned to host CPUs (the default) */
+	VM_AFFINITY_AUTO,	/**< Pin the core threads to the host CPUs of the process,
+						   one per physical core first, then to SMT siblings */
+	VM_AFFINITY_LIST	/**< Pin each core thread to the host CPU in @c core_cpu */
+} vm_affinity;
+
+
 /**
 	@brief Virtual machine configuration
 
@@ -154,6 +178,9 @@ typedef enum Interrupt
 	  (@c serial_out) file descriptor will be written to. These file descriptors
 	  should correspond to some pipe-like Linux stream (e.g., pipe, FIFO or socket).
 
+	- The placement of the VM threads on host CPUs, stored in @c affinity,
+	  @c core_cpu and @c pic_cpu.
+
  */
 typedef struct vm_config {
 
@@ -198,6 +225,24 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The host CPU affinity policy of the core threads.
+
+		Pinned core threads do not migrate between host CPUs, and allocate memory
+		(e.g., their stacks) from the NUMA node of their CPU. The resulting
+		placement is reported by @ref cpu_core_host_cpu and @ref cpu_core_distance.
+	 */
+	vm_affinity affinity;
+
+	/** @brief The host CPU of each core, for @c VM_AFFINITY_LIST. */
+	int core_cpu[MAX_CORES];
+
+	/** @brief The host CPU of the thread running the PIC, or -1. 
+
+		With @c VM_AFFINITY_AUTO, a value of -1 places the PIC on the
+		host CPU that would be used by the next core.
+	 */
+	int pic_cpu;
 } vm_config;
 
 
@@ -302,6 +347,32 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of host processors available to the VM.
+
+	Cores beyond this number cannot really run in parallel to the others.
+	This is useful for scheduling heuristics.
+ */
+uint cpu_physical_cores();
+
+/**
+	@brief Returns the host CPU that a core is pinned to, or -1 if it is not pinned.
+
+	@see vm_config
+ */
+int cpu_core_host_cpu(uint core);
+
+/**
+	@brief Returns the distance of two cores on the host.
+
+	The distance is 0 for the same core, 1 for cores pinned to the same physical
+	core of the host (e.g., SMT siblings), 2 for cores in the same host package,
+	and 3 for cores in different packages. Cores that are not pinned are at 
+	distance 2 from the other cores.
+	This is useful for scheduling heuristics, e.g., to prefer nearby cores.
+ */
+int cpu_core_distance(uint core1, uint core2);
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -338,13 +409,29 @@ void cpu_ici(uint core);
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 
 
+/**
+	@brief Observe interrupt dispatch on all cores.
+
+	When the BIOS is compiled with @c KERNEL_TRACE defined, the hook is
+	called on the dispatching core, right before the handler of each
+	interrupt. It runs with interrupts disabled, so it must not block.
+	Passing NULL removes the hook. Without @c KERNEL_TRACE, this call has 
+	no effect.
+
+	@param hook the hook to call, or NULL
+*/
+void cpu_interrupt_trace(interrupt_trace_hook* hook);
+
+
 /**
 	@brief Disable interrupts for this core.
 
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupts are disabled by a per-core flag in memory, so this call 
+	is cheap (it does not make a system call).
+
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -405,11 +492,42 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Select the context switching backend.
+
+	On x86-64 and aarch64, contexts are switched by a few lines of 
+	assembly, which save only the callee-saved registers and the stack pointer.
+	In particular, the signal mask is not saved or restored, which 
+	saves a system call per context switch. This is correct because 
+	contexts are only switched with interrupts disabled, so the signal 
+	mask is the same on both sides of every switch.
+
+	On other architectures, or when @c CPU_CONTEXT_UCONTEXT is defined at build time,
+	the portable (but slower) ucontext backend is used.
+*/
+#if !defined(CPU_CONTEXT_UCONTEXT) && (defined(__x86_64__) || defined(__aarch64__))
+#define CPU_CONTEXT_ASM
+#endif
+
+#ifdef CPU_CONTEXT_ASM
+
+/**
+	@brief A type for saving CPU context into.
+
+	The callee-saved registers are saved on the stack of the 
+	context, and only the stack pointer is stored here.
+*/
+typedef struct { void* sp; } cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -453,6 +571,9 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 
 	If @c usec is specified as 0, any existing timer count is canceled.
 
+	The hardware timer is programmed lazily: cancelling the timer, or 
+	resetting it to a later time, is cheap (it does not make a system call).
+
 	@param usec the timer countdown interval in microseconds
 	@returns the time remaining interval since the last call
 	@see bios_cancel_timer
@@ -473,17 +594,36 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
-
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	This function returns a monotonic clock value, in usec, measured from
+	some unspecified point in the past. The clock is not affected by changes
+	to the host's wall-clock time, and its resolution is about 1 usec. It is
+	the clock of the core timers, so a timer set to fire in @c t usec fires at
+	@c bios_clock()+t.
  */
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from the hardware clock, without a system call.
+
+	This returns the same clock as @ref bios_clock, but it may be faster to read:
+	when the host processor has an invariant time stamp counter, the clock is 
+	computed from it, without a system call. The rate of the counter is calibrated
+	the first time the clock is read, which takes a few msec. The value may thus 
+	drift from @ref bios_clock by a small fraction over long intervals.
+ */
+TimerDuration bios_fast_clock();
+
+
+/**
+	@brief Get the time of @ref bios_fast_clock, in nsec.
+
+	This is meant for measuring short intervals, such as the duration of
+	a system call, which are below the resolution of @ref bios_fast_clock.
+ */
+uint64_t bios_fast_clock_nsec();
+
+
 
 
 /**
@@ -512,6 +652,22 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return the serial ports that raised an interrupt on this core.
+
+	When a @c SERIAL_RX_READY or @c SERIAL_TX_READY interrupt is raised, bit @c i
+	of a per-core bitmap is set for serial port @c i. A call to this function
+	returns the bitmap of the current core for interrupt @c intno, and clears it.
+	It is meant to be called by interrupt handlers, so that only the ready devices
+	need to be serviced. Since interrupts are coalesced, the bitmap may contain 
+	several ports.
+
+	@param intno one of @c SERIAL_RX_READY and @c SERIAL_TX_READY
+	@return the bitmap of ready serial ports, or 0 if @c intno is another interrupt
+ */
+uint32_t bios_serial_ready(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -530,6 +686,36 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 int bios_read_serial(uint serial, char* ptr);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Copy up to @c size bytes that have been received by serial port @c serial into
+	@c buf. This is equivalent to calling @ref bios_read_serial repeatedly, until it
+	fails or @c size bytes have been read, but much faster.
+
+	If this operation does not fill @c buf, a @c SERIAL_RX_READY interrupt will be
+	raised when more data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the read bytes
+	@param size the size of @c buf
+	@return the number of bytes read
+ */
+unsigned int bios_read_serial_block(uint serial, char* buf, unsigned int size);
+
+
+/**
+	@brief Return the number of bytes that can be read from a serial port.
+
+	This call does not consume any data. If it returns 0, a @c SERIAL_RX_READY
+	interrupt will be raised when data is ready to be received.
+
+	@param serial the serial device to check
+	@return the number of bytes that a read would return without failing
+ */
+unsigned int bios_serial_rx_pending(uint serial);
+
+
 /**
 	@brief Write a byte to a serial port.
 
@@ -546,4 +732,22 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write the @c size bytes of @c buf to serial port @c serial. This is
+	equivalent to calling @ref bios_write_serial for each byte, until it fails,
+	but much faster.
+
+	If this operation does not write all of @c buf, a @c SERIAL_TX_READY interrupt 
+	will be raised when the device is ready to accept more data.
+
+	@param serial the serial device to write to
+	@param buf the data to send to the serial device
+	@param size the number of bytes in @c buf
+	@return the number of bytes written
+ */
+unsigned int bios_write_serial_block(uint serial, const char* buf, unsigned int size);
+
+
 #endif
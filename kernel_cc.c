@@ -23,8 +23,16 @@
  	Pre-emption aware mutex.
  	-------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	The value of a mutex is 0 when it is unlocked. Else, it is the TCB of the 
+ 	owner (or MUTEX_ANON, for code running outside of a thread), with the 
+ 	MUTEX_WAITERS bit set when some thread may be parked on the mutex.
+
+ 	This mutex will act as a spinlock if preemption is off. If preemption is 
+ 	on, a thread spins only while the owner is running on some core, and for 
+ 	at most MUTEX_SPINS rounds. Then, it parks: it is put to sleep on a 
+ 	waiter list of the parking lot (a small hash table, keyed by the mutex 
+ 	address). Mutex_Unlock() hands the mutex directly to the first waiter, 
+ 	which returns from Mutex_Lock() without competing for it.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -32,34 +40,192 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
+#define MUTEX_WAITERS ((Mutex)1)
+#define MUTEX_ANON ((Mutex)2)
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+/* The number of waiter lists in the parking lot (a power of 2) */
+#define MUTEX_PARK_BUCKETS 64
+
+/** \cond HELPER Helper structures for parked threads. */
+typedef struct __mutex_waiter {
+	Mutex* lock;                   /* the mutex waited for */
+	TCB* thread;                   /* the parked thread */
+	int handed;                    /* set when the mutex is handed to the thread */
+	struct __mutex_waiter* next;   /* next waiter in the bucket */
+} __mutex_waiter;
+
+typedef struct {
+	Mutex spinlock;                /* only locked with preemption off */
+	__mutex_waiter* waiters;       /* FIFO list */
+} __mutex_bucket;
+/** \endcond */
+
+static __mutex_bucket parking_lot[MUTEX_PARK_BUCKETS];
+
+static inline __mutex_bucket* mutex_bucket(Mutex* lock)
+{
+	uint64_t h = (uintptr_t)lock * 0x9E3779B97F4A7C15ull;
+	return &parking_lot[h >> (64 - __builtin_ctz(MUTEX_PARK_BUCKETS))];
+}
+
+static inline Mutex mutex_self()
+{
+	TCB* tcb = cur_thread();
+	return (tcb == NULL) ? MUTEX_ANON : (Mutex)tcb;
+}
+
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+}
+
+/*
+  Return 1 if the owner of a mutex with value w is running, or unknown.
+ */
+static int mutex_owner_running(Mutex w)
+{
+	TCB* owner = (TCB*)(w & ~MUTEX_WAITERS);
+	if (owner == (TCB*)MUTEX_ANON)
+		return 1;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].current_thread == owner)
+			return 1;
+	return 0;
+}
+
+/*
+  Park the current thread, until the mutex is handed to it.
+  Return 0, without parking, if the mutex is found unlocked.
+ */
+static int mutex_park(Mutex* lock)
+{
+	__mutex_bucket* bucket = mutex_bucket(lock);
+	__mutex_waiter waiter = { .lock = lock, .thread = cur_thread(), .handed = 0, .next = NULL };
+
+	int preempt = preempt_off;
+	Mutex_Lock(&bucket->spinlock);
+
+	/* Tell the owner that we are waiting, unless it has already left */
+	Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while (w != 0 && !(w & MUTEX_WAITERS)
+		&& !__atomic_compare_exchange_n(lock, &w, w | MUTEX_WAITERS, 0, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	if (w == 0) {
+		Mutex_Unlock(&bucket->spinlock);
+		if (preempt)
+			preempt_on;
+		return 0;
+	}
+
+	/* Append to the bucket and sleep */
+	__mutex_waiter** p = &bucket->waiters;
+	while (*p != NULL)
+		p = &(*p)->next;
+	*p = &waiter;
+
+	sleep_releasing(STOPPED, &bucket->spinlock, SCHED_MUTEX, NO_TIMEOUT);
+	assert(waiter.handed);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (preempt)
+		preempt_on;
+	return 1;
+}
+
+/*
+  Hand the mutex to the first parked waiter, or unlock it if there is none.
+ */
+static void mutex_unpark(Mutex* lock)
+{
+	__mutex_bucket* bucket = mutex_bucket(lock);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&bucket->spinlock);
+
+	__mutex_waiter** p = &bucket->waiters;
+	while (*p != NULL && (*p)->lock != lock)
+		p = &(*p)->next;
+
+	__mutex_waiter* waiter = *p;
+	if (waiter != NULL) {
+		*p = waiter->next;
+
+		/* Are there more waiters? */
+		__mutex_waiter* more = waiter->next;
+		while (more != NULL && more->lock != lock)
+			more = more->next;
+
+		/* The waiter vanishes once it is woken up */
+		TCB* thread = waiter->thread;
+		__atomic_store_n(lock, (Mutex)thread | (more ? MUTEX_WAITERS : 0), __ATOMIC_RELEASE);
+		waiter->handed = 1;
+		wakeup(thread);
+	} else {
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+	}
+
+	Mutex_Unlock(&bucket->spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+void Mutex_Lock(Mutex* lock)
+{
+	Mutex self = mutex_self();
+	Mutex w = 0;
+
+	/* Fast path */
+	if (__atomic_compare_exchange_n(lock, &w, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	int spin = MUTEX_SPINS;
+	while (1) {
+		w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		if (w == 0) {
+			if (__atomic_compare_exchange_n(lock, &w, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+		} 
+		else if (!cpu_interrupts_enabled() || cur_thread() == NULL) {
+			/* Non-preemptive domain: pure spinlock */
+			cpu_relax();
+		}
+		else if (spin > 0 && mutex_owner_running(w)) {
+			spin--;
+			cpu_relax();
+		}
+		else {
+			if (mutex_park(lock))
+				return;
+			spin = MUTEX_SPINS;
+		}
+	}
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+	Mutex w = 0;
+	return __atomic_compare_exchange_n(lock, &w, mutex_self(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while (!(w & MUTEX_WAITERS))
+		if (__atomic_compare_exchange_n(lock, &w, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	mutex_unpark(lock);
 }
 
+#undef MUTEX_SPINS
+
 
 /*
 	Condition variables.	
@@ -73,9 +239,16 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex released by the thread */
+	sig_atomic_t morphed;		/* this is set if the thread was moved to the 
+								   waiters of mutex (see cv_morph) */
+	__mutex_waiter mwaiter;	/* used when the thread is morphed */
 } __cv_waiter;
 /** \endcond */
 
+/* The size of the batches of threads woken up by Cond_Broadcast */
+#define COND_WAKEUP_BATCH 32
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -121,7 +294,9 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.mutex = mutex, .morphed = 0,
+		.mwaiter = { .lock = mutex, .thread = cur_thread(), .handed = 0, .next = NULL } };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
@@ -147,7 +322,12 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	/* A morphed thread was handed the mutex by Mutex_Unlock */
+	if(waiter.morphed) {
+		assert(waiter.mwaiter.handed);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
@@ -174,6 +354,97 @@ static inline void cv_signal(CondVar* cv)
 
 
 
+/**
+  @internal
+  Helper for Cond_Broadcast. If the mutex of a waiter is locked, move
+  the waiter directly to the waiters of the mutex, so that it is woken 
+  up when the mutex is handed to it. Return 1 on success, and 0 if the 
+  mutex is unlocked, or the thread is no longer sleeping.
+ */
+static int cv_morph(__cv_waiter* waiter)
+{
+	__mutex_bucket* bucket = mutex_bucket(waiter->mutex);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&bucket->spinlock);
+
+	/* Tell the owner of the mutex about the new waiter */
+	Mutex w = __atomic_load_n(waiter->mutex, __ATOMIC_RELAXED);
+	while (w != 0 && !(w & MUTEX_WAITERS)
+		&& !__atomic_compare_exchange_n(waiter->mutex, &w, w | MUTEX_WAITERS, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	/* The thread must not be woken up by its timeout from now on */
+	int morphed = (w != 0) && sched_cancel_timeout(waiter->thread);
+	if (morphed) {
+		__mutex_waiter** p = &bucket->waiters;
+		while (*p != NULL)
+			p = &(*p)->next;
+		*p = &waiter->mwaiter;
+		waiter->morphed = 1;
+	}
+
+	Mutex_Unlock(&bucket->spinlock);
+	if (preempt)
+		preempt_on;
+	return morphed;
+}
+
+
+/**
+  @internal
+  Helper for Cond_Broadcast. Wake up a batch of removed waiters, and mark as
+  signalled those that were still sleeping. A waiter whose timeout has 
+  already expired is not signalled.
+ */
+static void cv_wakeup_batch(__cv_waiter** waiters, size_t n)
+{
+	TCB* batch[COND_WAKEUP_BATCH];
+	for(size_t i=0; i<n; i++)
+		batch[i] = waiters[i]->thread;
+
+	wakeup_many(batch, n);
+
+	/* The threads cannot leave cv_wait while we hold cv->waitset_lock */
+	for(size_t i=0; i<n; i++)
+		if(batch[i] != NULL)
+			waiters[i]->signalled = 1;
+}
+
+
+/**
+  @internal
+  Helper for Cond_Broadcast. Remove all waiters, and either morph them 
+  (if @c COND_WAIT_MORPHING is set) or wake them up in batches.
+ */
+static void cv_broadcast(CondVar* cv)
+{
+	__cv_waiter* batch[COND_WAKEUP_BATCH];
+	size_t n = 0;
+
+	while(cv->waitset) {
+		__cv_waiter* waiter = cv->waitset;
+		remove_from_ring(cv, waiter);
+		waiter->removed = 1;
+
+		if(COND_WAIT_MORPHING && cv_morph(waiter)) {
+			waiter->signalled = 1;
+			continue;
+		}
+
+		batch[n++] = waiter;
+		if(n == COND_WAKEUP_BATCH) {
+			cv_wakeup_batch(batch, n);
+			n = 0;
+		}
+	}
+
+	if(n > 0)
+		cv_wakeup_batch(batch, n);
+}
+
+
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
 	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
@@ -197,7 +468,7 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_broadcast(cv);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -207,65 +478,14 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * Kernel monitors
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
- */
-
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +498,8 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
 }
 
-
-
-
@@ -32,37 +32,56 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+/**
+	@brief Enable wait-morphing in @c Cond_Broadcast.
+
+	When this is non-zero, the threads waiting on a condition variable 
+	whose mutex is locked are not woken up by a broadcast. Instead, they 
+	are moved to the waiters of the mutex, and each is woken up when the 
+	mutex is handed to it. Thus, they do not all compete for the mutex.
  */
+#ifndef COND_WAIT_MORPHING
+#define COND_WAIT_MORPHING 1
+#endif
 
 /**
-	@brief Lock the kernel.
+	@brief Try to lock a mutex without waiting.
+
+	This call never spins or yields, therefore it can be used to
+	break lock-order cycles in the non-preemptive domain.
+
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked.
  */
-void kernel_lock();
+int Mutex_TryLock(Mutex* lock);
 
-/**
-	@brief Unlock the kernel.
+
+/*
+ * Kernel monitors.
+ *
+ * There is no global kernel lock. Each kernel subsystem protects its 
+ * data by its own Mutex (e.g., the process table, the file table, the 
+ * file id table of each process, each device), and system calls wait on 
+ * condition variables associated with it.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, unlocking a kernel mutex.
+
+	The mutex is unlocked while the thread sleeps, and it is locked
+	again before this call returns.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
-
-	This call must be made 
   */
 void kernel_signal(CondVar* cv);
 
@@ -73,12 +92,11 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, unlocking a kernel mutex.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The mutex is not locked again when the thread is woken up.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
 
 
 
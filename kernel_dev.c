@@ -66,16 +66,47 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* The size of the transmit queue of a serial device (a power of two) */
+#define SERIAL_TX_BUFFER 4096
+
+/*
+  The spinlock of a serial device is only held with preemption off, 
+  since it is also locked by the interrupt handler.
+ */
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex spinlock;     /* Protects the device and the fields below */
   CondVar rx_ready;
+  int tx_busy;        /* Set while a thread is writing to the device */
+  CondVar tx_ready;
+  char tx_buf[SERIAL_TX_BUFFER];  /* Transmit queue */
+  size_t tx_head;     /* Bytes queued so far */
+  size_t tx_tail;     /* Bytes sent to the device so far */
+  CondVar tx_space;   /* Signalled when the transmit queue is drained */
+  poll_queue pollq;   /* Threads polling the device */
+  uint rx_core;       /* The core that SERIAL_RX_READY is sent to */
+  uint tx_core;       /* The core that SERIAL_TX_READY is sent to */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 
 
+/*
+  Send an interrupt of the device to the core chosen by the scheduler for
+  the current thread, which is about to wait for it (see sched_irq_core()).
+  Call with the spinlock held.
+ */
+static void serial_route(serial_dcb_t* dcb, Interrupt intno, uint* int_core)
+{
+  uint core = sched_irq_core(cur_thread());
+  if(*int_core != core) {
+    *int_core = core;
+    bios_serial_interrupt_core(dcb->devno, intno, core);
+  }
+}
+
+
 /*
   Interrupt-driven driver for serial-device reads.
  */
@@ -84,41 +115,44 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
-    serial_dcb_t* dcb = &serial_dcb[i];
+  /* Signal only the terminals that are ready */
+  uint32_t ready = bios_serial_ready(SERIAL_RX_READY);
+  while(ready) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ready)];
+    ready &= ready-1;
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
+    poll_queue_notify(&dcb->pollq);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device, sleeping if needed (unless non-blocking).
  */
 int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
-  uint count =  0;
+  int count =  0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
+  /* Take whole spans from the receive buffer of the device */
+  while(size>0) {
+    count = bios_read_serial_block(dcb->devno, buf, size);
+    if(count>0) break;
+    serial_route(dcb, SERIAL_RX_READY, &dcb->rx_core);
+    if(io_nonblocking()) {
+      count = IO_WOULDBLOCK;
       break;
+    }
+    kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -126,44 +160,141 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+
+  Writers copy their data into the transmit queue. The queue is drained
+  to the device in whole spans, by the writers themselves while the device
+  accepts data, and then by the SERIAL_TX_READY interrupt.
+ */
+
+/* Send as much of the transmit queue as the device accepts. Call with the spinlock held. */
+static void serial_tx_drain(serial_dcb_t* dcb)
+{
+  size_t drained = dcb->tx_tail;
+
+  while(dcb->tx_tail != dcb->tx_head) {
+    size_t off = dcb->tx_tail & (SERIAL_TX_BUFFER-1);
+    size_t span = dcb->tx_head - dcb->tx_tail;
+    if(span > SERIAL_TX_BUFFER - off) span = SERIAL_TX_BUFFER - off;
+
+    unsigned int sent = bios_write_serial_block(dcb->devno, dcb->tx_buf+off, span);
+    dcb->tx_tail += sent;
+    if(sent < span) break;
+  }
+
+  if(dcb->tx_tail != drained)
+    Cond_Broadcast(&dcb->tx_space);
+}
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint32_t ready = bios_serial_ready(SERIAL_TX_READY);
+  while(ready) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ready)];
+    ready &= ready-1;
+    Mutex_Lock(&dcb->spinlock);
+    serial_tx_drain(dcb);
+    Mutex_Unlock(&dcb->spinlock);
+    poll_queue_notify(&dcb->pollq);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
   Write call 
-  This is currently a polling driver.
+  Queue all the data, sleeping while the queue is full. In non-blocking
+  mode, queue what fits.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  /* Writers take turns, so that their output is not interleaved */
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  while(dcb->tx_busy) {
+    if(io_nonblocking()) {
+      Mutex_Unlock(&dcb->spinlock);
+      if(pre) preempt_on;
+      return IO_WOULDBLOCK;
+    }
+    kernel_wait(&dcb->spinlock, &dcb->tx_ready, SCHED_IO);
+  }
+  dcb->tx_busy = 1;
+
   unsigned int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
+    size_t space = SERIAL_TX_BUFFER - (dcb->tx_head - dcb->tx_tail);
+    if(space == 0) {
+      serial_route(dcb, SERIAL_TX_READY, &dcb->tx_core);
+      if(io_nonblocking()) break;
+      kernel_wait(&dcb->spinlock, &dcb->tx_space, SCHED_IO);
+      continue;
     }
-    else
-      break;
+
+    size_t off = dcb->tx_head & (SERIAL_TX_BUFFER-1);
+    size_t span = SERIAL_TX_BUFFER - off;
+    if(span > space) span = space;
+    if(span > size-count) span = size-count;
+
+    memcpy(dcb->tx_buf+off, buf+count, span);
+    dcb->tx_head += span;
+    count += span;
+
+    serial_tx_drain(dcb);
   }
 
+  dcb->tx_busy = 0;
+  Cond_Signal(&dcb->tx_ready);
+  Mutex_Unlock(&dcb->spinlock);
+  poll_queue_notify(&dcb->pollq);
+  if(pre) preempt_on;
+
+  if(count == 0 && size > 0) return IO_WOULDBLOCK;
   return count;  
 }
 
 
+/*
+  Poll call
+ */
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  poll_wait(pt, &dcb->pollq);
+
+  int events = 0;
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  if(bios_serial_rx_pending(dcb->devno) > 0)
+    events |= POLL_READ;
+  if(! dcb->tx_busy && dcb->tx_head - dcb->tx_tail < SERIAL_TX_BUFFER)
+    events |= POLL_WRITE;
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return events;
+}
+
+
+/*
+  Close call
+  Wait until the queued output has been sent to the device.
+ */
 int serial_close(void* dev) 
 {
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  while(dcb->tx_tail != dcb->tx_head)
+    kernel_wait(&dcb->spinlock, &dcb->tx_space, SCHED_IO);
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
   return 0;
 }
 
@@ -180,7 +311,9 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll,
+  .Terminal = 1
 };
 
 
@@ -211,6 +344,12 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_busy = 0;
+    serial_dcb[i].tx_ready = COND_INIT;
+    serial_dcb[i].tx_head = serial_dcb[i].tx_tail = 0;
+    serial_dcb[i].rx_core = serial_dcb[i].tx_core = 0;
+    serial_dcb[i].tx_space = COND_INIT;
+    poll_queue_init(&serial_dcb[i].pollq);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
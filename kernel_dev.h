@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -45,6 +46,17 @@
   field of the FCB.
   @see FCB
  */
+/**
+  @brief The type of a stream's write method.
+
+  This is the signature of @c file_ops.Write; it is used by 
+  @c file_ops.Splice to pass data to another stream.
+ */
+typedef int (*stream_sink)(void* this, const char* buf, unsigned int size);
+
+/* Defined in kernel_streams.h */
+typedef struct poll_table poll_table;
+
 typedef struct file_operations {
 
 	/**
@@ -62,6 +74,8 @@ typedef struct file_operations {
     The Read function should return the number of bytes copied into buf, 
     or -1 on error. The call may return fewer bytes than 'size', 
     but at least 1. A value of 0 indicates "end of data".
+    Streams that may block should return @c IO_WOULDBLOCK instead, if 
+    @c io_nonblocking() is true (see @c FCB_try_io).
 
     Possible errors are:
     - There was a I/O runtime problem.
@@ -74,7 +88,8 @@ typedef struct file_operations {
     If it is not possible to write any data (e.g., a buffer is full),
     the thread will block. 
     The write function should return the number of bytes copied from buf, 
-    or -1 on error. 
+    or -1 on error. As with Read, a stream returns @c IO_WOULDBLOCK instead
+    of blocking, if @c io_nonblocking() is true.
 
     Possible errors are:
     - There was a I/O runtime problem.
@@ -92,6 +107,51 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Splice operation (optional).
+
+      Pass up to 'size' bytes from stream 'this' to the write method
+      'sink' of stream object 'sinkobj', directly from the stream's own 
+      buffer, without copying through an intermediate buffer.
+      If 'consume' is 0, the data is left in the stream (so that it
+      will also be returned by subsequent reads).
+      If no data is available, the thread will block, as in Read.
+
+      The function should return the number of bytes accepted by the sink,
+      0 for "end of data", or -1 on error.
+      Streams without this method are spliced by Read and Write on 
+      a kernel buffer, and cannot be used with Tee.
+     */
+    int (*Splice)(void* this, stream_sink sink, void* sinkobj, 
+                  unsigned int size, int consume);
+
+    /** @brief Vectored read operation (optional).
+
+      Read into the 'iovcnt' buffers of 'iov', in order, with the 
+      semantics of Read for a buffer of their total size. Streams without
+      this method are read by calling Read for each buffer in turn.
+     */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+    /** @brief Vectored write operation (optional).
+
+      Write the 'iovcnt' buffers of 'iov', in order, with the semantics 
+      of Write for a buffer holding all of them. Streams without this 
+      method are written by calling Write for each buffer in turn.
+     */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+    /** @brief Readiness query (optional).
+
+      Return the POLL_* events that are currently true for stream 'this'.
+      Before checking its state, the stream must call @c poll_wait(pt,q) 
+      for each poll queue @c q that it notifies when its state changes.
+      Streams without this method are always ready for reading and writing.
+     */
+    int (*Poll)(void* this, poll_table* pt);
+
+    /** @brief Set for interactive streams, such as terminals (see @c IsTerminal). */
+    int Terminal;
 } file_ops;
 
 
@@ -9,6 +9,9 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_socket.h"
+#include "kernel_sys.h"
+#include "kernel_trace.h"
 
 
 
@@ -26,6 +29,8 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  struct { Task task; core_mask cores; } reserved[MAX_CORES];
+  uint nreserved;
 } boot_rec;
 
 
@@ -34,11 +39,19 @@ void boot_tinyos_kernel()
 {
 
   if(cpu_core_id==0) {
+#if defined(KERNEL_TRACE)
+    initialize_trace();
+#endif
+
     /* Initialize the kenrel data structures */
+    initialize_syscalls();
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_sockets();
     initialize_scheduler();
+    for(uint i = 0; i < boot_rec.nreserved; i++)
+      sched_reserve_cores(boot_rec.reserved[i].task, boot_rec.reserved[i].cores);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -55,6 +68,9 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+#if defined(KERNEL_TRACE)
+    finalize_trace();
+#endif
   }
 }
 
@@ -66,6 +82,18 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.args = args;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+  boot_rec.nreserved = 0;
+}
+
+
+int boot_reserve_cores(Task task, core_mask cores)
+{
+  if(boot_rec.nreserved == MAX_CORES)
+    return -1;
+  boot_rec.reserved[boot_rec.nreserved].task = task;
+  boot_rec.reserved[boot_rec.nreserved].cores = cores;
+  boot_rec.nreserved++;
+  return 0;
 }
 
 
@@ -1,9 +1,445 @@
 
+#include <string.h>
+
 #include "tinyos.h"
+#include "kernel_pipe.h"
+
+
+/*
+  The ring is indexed by the free-running counters r_pos and w_pos;
+  the number of bytes in the buffer is w_pos - r_pos.
+
+  Only the side that blocks touches pipe->mx. Before sleeping, a side
+  raises its wait flag and re-checks the other side's counter; after
+  moving data, a side publishes its counter and then checks the other
+  side's flag. The two seq-cst fences make sure that at least one of
+  them sees the other, so a wakeup is never lost.
+ */
+
+
+pipe_cb* pipe_create(unsigned int size)
+{
+  if(size == 0) size = PIPE_BUFFER_SIZE;
+  if(size < PIPE_MIN_BUFFER) size = PIPE_MIN_BUFFER;
+  if(size > PIPE_MAX_BUFFER) size = PIPE_MAX_BUFFER;
+
+  size_t cap = PIPE_MIN_BUFFER;
+  while(cap < size) cap <<= 1;
+
+  pipe_cb* pipe = xmalloc(sizeof(pipe_cb));
+  pipe->buffer = xmalloc(cap);
+  pipe->mask = cap - 1;
+  pipe->r_pos = pipe->w_pos = 0;
+  pipe->reader_open = pipe->writer_open = 1;
+  pipe->r_wait = pipe->w_wait = 0;
+  pipe->ends = 2;
+  pipe->read_mx = MUTEX_INIT;
+  pipe->write_mx = MUTEX_INIT;
+  pipe->mx = MUTEX_INIT;
+  pipe->has_data = COND_INIT;
+  pipe->has_space = COND_INIT;
+  poll_queue_init(&pipe->pollq);
+  return pipe;
+}
+
+
+static void pipe_decref(pipe_cb* pipe)
+{
+  if(__atomic_sub_fetch(&pipe->ends, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(pipe->buffer);
+    free(pipe);
+  }
+}
+
+
+/* Wake up the other side if it has raised its wait flag, and any pollers */
+static void pipe_notify(pipe_cb* pipe, int* flag, CondVar* cv)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(flag, __ATOMIC_RELAXED)) {
+    Mutex_Lock(&pipe->mx);
+    kernel_signal(cv);
+    Mutex_Unlock(&pipe->mx);
+  }
+  poll_queue_notify(&pipe->pollq);
+}
+
+
+/* Lock read_mx or write_mx. In non-blocking mode, return 0 if it is taken. */
+static int pipe_lock(Mutex* mx)
+{
+  if(io_nonblocking()) return Mutex_TryLock(mx);
+  Mutex_Lock(mx);
+  return 1;
+}
+
+
+/*
+  Wait until the pipe has data after position r, or no more data can
+  arrive. Stores the number of bytes available in *avail. Returns 0 if
+  the call would wait in non-blocking mode. Called with read_mx held.
+ */
+static int pipe_wait_data(pipe_cb* pipe, size_t r, size_t* pavail)
+{
+  size_t avail;
+
+  while((avail = __atomic_load_n(&pipe->w_pos, __ATOMIC_ACQUIRE) - r) == 0) {
+    Mutex_Lock(&pipe->mx);
+    int eof = !pipe->writer_open || !pipe->reader_open;
+    if(!eof && io_nonblocking()) {
+      Mutex_Unlock(&pipe->mx);
+      return 0;
+    }
+    __atomic_store_n(&pipe->r_wait, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!eof && __atomic_load_n(&pipe->w_pos, __ATOMIC_RELAXED) == r)
+      kernel_wait(&pipe->mx, &pipe->has_data, SCHED_PIPE);
+    __atomic_store_n(&pipe->r_wait, 0, __ATOMIC_RELAXED);
+    Mutex_Unlock(&pipe->mx);
+
+    if(eof) {
+      /* Whatever the writer left before closing is now visible */
+      avail = __atomic_load_n(&pipe->w_pos, __ATOMIC_ACQUIRE) - r;
+      break;
+    }
+  }
+  *pavail = avail;
+  return 1;
+}
+
+
+/* Copy n bytes out of the ring, starting at position r, in at most two spans */
+static void ring_copy_out(pipe_cb* pipe, size_t r, char* buf, size_t n)
+{
+  size_t off = r & pipe->mask;
+  size_t span = pipe->mask + 1 - off;
+  if(span > n) span = n;
+  memcpy(buf, pipe->buffer + off, span);
+  memcpy(buf + span, pipe->buffer, n - span);
+}
+
+/* Copy n bytes into the ring, starting at position w, in at most two spans */
+static void ring_copy_in(pipe_cb* pipe, size_t w, const char* buf, size_t n)
+{
+  size_t off = w & pipe->mask;
+  size_t span = pipe->mask + 1 - off;
+  if(span > n) span = n;
+  memcpy(pipe->buffer + off, buf, span);
+  memcpy(pipe->buffer, buf + span, n - span);
+}
+
+
+static size_t iov_total(const iovec_t* iov, unsigned int iovcnt)
+{
+  size_t total = 0;
+  for(unsigned int i=0; i<iovcnt; i++)
+    total += iov[i].len;
+  return total;
+}
+
+
+int pipe_readv(pipe_cb* pipe, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(! pipe_lock(&pipe->read_mx)) return IO_WOULDBLOCK;
+
+  size_t r = pipe->r_pos;
+  size_t avail;
+  if(! pipe_wait_data(pipe, r, &avail)) {
+    Mutex_Unlock(&pipe->read_mx);
+    return IO_WOULDBLOCK;
+  }
+  size_t total = iov_total(iov, iovcnt);
+  size_t n = (avail < total) ? avail : total;
+
+  if(n > 0) {
+    size_t done = 0;
+    for(unsigned int i=0; done < n; i++) {
+      size_t m = (iov[i].len < n - done) ? iov[i].len : n - done;
+      ring_copy_out(pipe, r + done, iov[i].base, m);
+      done += m;
+    }
+
+    __atomic_store_n(&pipe->r_pos, r + n, __ATOMIC_RELEASE);
+    pipe_notify(pipe, &pipe->w_wait, &pipe->has_space);
+  }
+
+  Mutex_Unlock(&pipe->read_mx);
+  return n;
+}
+
+
+int pipe_read(pipe_cb* pipe, char* buf, unsigned int size)
+{
+  iovec_t iov = { .base = buf, .len = size };
+  return pipe_readv(pipe, &iov, 1);
+}
+
+
+int pipe_splice(pipe_cb* pipe, stream_sink sink, void* sinkobj, 
+  unsigned int size, int consume)
+{
+  /* Splicing a pipe into itself would wait for itself */
+  if(sinkobj == pipe) return -1;
+
+  if(! pipe_lock(&pipe->read_mx)) return IO_WOULDBLOCK;
+
+  size_t r = pipe->r_pos;
+  size_t avail;
+  if(! pipe_wait_data(pipe, r, &avail)) {
+    Mutex_Unlock(&pipe->read_mx);
+    return IO_WOULDBLOCK;
+  }
+  size_t n = (avail < size) ? avail : size;
+
+  /* Hand the contiguous spans of the ring to the sink */
+  size_t done = 0;
+  int retcode = 0;
+  while(done < n) {
+    size_t off = (r + done) & pipe->mask;
+    size_t span = pipe->mask + 1 - off;
+    if(span > n - done) span = n - done;
+    int rc = sink(sinkobj, pipe->buffer + off, span);
+    if(rc <= 0) {
+      retcode = rc;
+      break;
+    }
+    done += rc;
+  }
+
+  if(consume && done > 0) {
+    __atomic_store_n(&pipe->r_pos, r + done, __ATOMIC_RELEASE);
+    pipe_notify(pipe, &pipe->w_wait, &pipe->has_space);
+  }
+
+  Mutex_Unlock(&pipe->read_mx);
+  return (done > 0) ? (int)done : retcode;
+}
+
+
+int pipe_writev(pipe_cb* pipe, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(! pipe_lock(&pipe->write_mx)) return IO_WOULDBLOCK;
+
+  size_t cap = pipe->mask + 1;
+  size_t w = pipe->w_pos;
+  size_t total = iov_total(iov, iovcnt);
+  size_t space;
+  int retcode = -1;
+
+  for(;;) {
+    if(! __atomic_load_n(&pipe->reader_open, __ATOMIC_ACQUIRE)
+        || ! __atomic_load_n(&pipe->writer_open, __ATOMIC_ACQUIRE))
+      goto finish;
+
+    space = cap - (w - __atomic_load_n(&pipe->r_pos, __ATOMIC_ACQUIRE));
+    if(space > 0 || total == 0) break;
+    if(io_nonblocking()) {
+      retcode = IO_WOULDBLOCK;
+      goto finish;
+    }
+
+    Mutex_Lock(&pipe->mx);
+    __atomic_store_n(&pipe->w_wait, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(pipe->reader_open && pipe->writer_open
+        && w - __atomic_load_n(&pipe->r_pos, __ATOMIC_RELAXED) == cap)
+      kernel_wait(&pipe->mx, &pipe->has_space, SCHED_PIPE);
+    __atomic_store_n(&pipe->w_wait, 0, __ATOMIC_RELAXED);
+    Mutex_Unlock(&pipe->mx);
+  }
+
+  size_t n = (space < total) ? space : total;
+  if(n > 0) {
+    size_t done = 0;
+    for(unsigned int i=0; done < n; i++) {
+      size_t m = (iov[i].len < n - done) ? iov[i].len : n - done;
+      ring_copy_in(pipe, w + done, iov[i].base, m);
+      done += m;
+    }
+
+    __atomic_store_n(&pipe->w_pos, w + n, __ATOMIC_RELEASE);
+    pipe_notify(pipe, &pipe->r_wait, &pipe->has_data);
+  }
+  retcode = n;
+
+finish:
+  Mutex_Unlock(&pipe->write_mx);
+  return retcode;
+}
+
+
+int pipe_write(pipe_cb* pipe, const char* buf, unsigned int size)
+{
+  iovec_t iov = { .base = (char*) buf, .len = size };
+  return pipe_writev(pipe, &iov, 1);
+}
+
+
+void pipe_reader_shutdown(pipe_cb* pipe)
+{
+  Mutex_Lock(&pipe->mx);
+  __atomic_store_n(&pipe->reader_open, 0, __ATOMIC_RELEASE);
+  kernel_broadcast(&pipe->has_space);
+  kernel_broadcast(&pipe->has_data);
+  Mutex_Unlock(&pipe->mx);
+  poll_queue_notify(&pipe->pollq);
+}
+
+
+void pipe_writer_shutdown(pipe_cb* pipe)
+{
+  Mutex_Lock(&pipe->mx);
+  __atomic_store_n(&pipe->writer_open, 0, __ATOMIC_RELEASE);
+  kernel_broadcast(&pipe->has_data);
+  kernel_broadcast(&pipe->has_space);
+  Mutex_Unlock(&pipe->mx);
+  poll_queue_notify(&pipe->pollq);
+}
+
+
+int pipe_reader_poll(pipe_cb* pipe, poll_table* pt)
+{
+  poll_wait(pt, &pipe->pollq);
+
+  int events = 0;
+  if(__atomic_load_n(&pipe->w_pos, __ATOMIC_ACQUIRE) 
+      != __atomic_load_n(&pipe->r_pos, __ATOMIC_RELAXED))
+    events |= POLL_READ;
+  if(! __atomic_load_n(&pipe->writer_open, __ATOMIC_ACQUIRE)
+      || ! __atomic_load_n(&pipe->reader_open, __ATOMIC_ACQUIRE))
+    events |= POLL_READ | POLL_HANGUP;
+  return events;
+}
+
+
+int pipe_writer_poll(pipe_cb* pipe, poll_table* pt)
+{
+  poll_wait(pt, &pipe->pollq);
+
+  int events = 0;
+  if(! __atomic_load_n(&pipe->reader_open, __ATOMIC_ACQUIRE)
+      || ! __atomic_load_n(&pipe->writer_open, __ATOMIC_ACQUIRE))
+    events |= POLL_WRITE | POLL_ERROR | POLL_HANGUP;
+  else if(__atomic_load_n(&pipe->w_pos, __ATOMIC_RELAXED) 
+      - __atomic_load_n(&pipe->r_pos, __ATOMIC_ACQUIRE) < pipe->mask + 1)
+    events |= POLL_WRITE;
+  return events;
+}
+
+
+int pipe_reader_close(pipe_cb* pipe)
+{
+  pipe_reader_shutdown(pipe);
+  pipe_decref(pipe);
+  return 0;
+}
+
+
+int pipe_writer_close(pipe_cb* pipe)
+{
+  pipe_writer_shutdown(pipe);
+  pipe_decref(pipe);
+  return 0;
+}
+
+
+/*
+  Stream operations
+ */
+
+static int pipe_reader_read(void* this, char* buf, unsigned int size)
+{
+  return pipe_read((pipe_cb*) this, buf, size);
+}
+
+static int pipe_reader_readv(void* this, const iovec_t* iov, unsigned int iovcnt)
+{
+  return pipe_readv((pipe_cb*) this, iov, iovcnt);
+}
+
+static int pipe_writer_writev(void* this, const iovec_t* iov, unsigned int iovcnt)
+{
+  return pipe_writev((pipe_cb*) this, iov, iovcnt);
+}
+
+static int pipe_reader_splice(void* this, stream_sink sink, void* sinkobj,
+  unsigned int size, int consume)
+{
+  return pipe_splice((pipe_cb*) this, sink, sinkobj, size, consume);
+}
+
+static int pipe_reader_poll_op(void* this, poll_table* pt)
+{
+  return pipe_reader_poll((pipe_cb*) this, pt);
+}
+
+static int pipe_writer_poll_op(void* this, poll_table* pt)
+{
+  return pipe_writer_poll((pipe_cb*) this, pt);
+}
+
+static int pipe_writer_write(void* this, const char* buf, unsigned int size)
+{
+  return pipe_write((pipe_cb*) this, buf, size);
+}
+
+static int pipe_reader_close_op(void* this)
+{
+  return pipe_reader_close((pipe_cb*) this);
+}
+
+static int pipe_writer_close_op(void* this)
+{
+  return pipe_writer_close((pipe_cb*) this);
+}
+
+file_ops pipe_reader_ops = {
+  .Open = NULL,
+  .Read = pipe_reader_read,
+  .Write = NULL,
+  .Close = pipe_reader_close_op,
+  .Splice = pipe_reader_splice,
+  .ReadV = pipe_reader_readv,
+  .Poll = pipe_reader_poll_op
+};
+
+file_ops pipe_writer_ops = {
+  .Open = NULL,
+  .Read = NULL,
+  .Write = pipe_writer_write,
+  .Close = pipe_writer_close_op,
+  .WriteV = pipe_writer_writev,
+  .Poll = pipe_writer_poll_op
+};
+
+
+static int open_pipe(pipe_t* pipe, unsigned int size)
+{
+  Fid_t fid[2];
+  FCB* fcb[2];
+
+  if(! FCB_reserve(2, fid, fcb))
+    return -1;
+
+  pipe_cb* p = pipe_create(size);
+  fcb[0]->streamobj = p;
+  fcb[0]->streamfunc = &pipe_reader_ops;
+  fcb[1]->streamobj = p;
+  fcb[1]->streamfunc = &pipe_writer_ops;
+
+  pipe->read = fid[0];
+  pipe->write = fid[1];
+  return 0;
+}
 
 
 int sys_Pipe(pipe_t* pipe)
 {
-	return -1;
+  return open_pipe(pipe, PIPE_BUFFER_SIZE);
 }
 
+
+int sys_PipeSized(pipe_t* pipe, unsigned int size)
+{
+  return open_pipe(pipe, size);
+}
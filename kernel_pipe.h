@@ -0,0 +1,153 @@
+#ifndef __KERNEL_PIPE_H
+#define __KERNEL_PIPE_H
+
+/**
+  @file kernel_pipe.h
+  @brief Pipes.
+
+  @defgroup pipes Pipes
+  @ingroup kernel
+  @brief Pipes.
+
+  A pipe is a ring buffer of a power-of-two size, with one read end
+  and one write end. Data is moved in and out of the ring by bulk copies
+  of whole contiguous spans.
+
+  The ring indices are updated without locks: the reader owns @c r_pos
+  and the writer owns @c w_pos. Concurrent readers (resp. writers) of the
+  same end are serialized by a per-end mutex, so that in the common case
+  of a single reader and a single writer, the two sides never contend
+  for a lock. The pipe mutex and its condition variables are only used
+  when a side has to block, i.e., at the empty and full transitions.
+
+  The pipe API of this file is also used to build other streams
+  (e.g., sockets).
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+
+/** @brief Default buffer size of a pipe, in bytes. */
+#define PIPE_BUFFER_SIZE 16384
+
+/** @brief Smallest acceptable pipe buffer size. */
+#define PIPE_MIN_BUFFER 256
+
+/** @brief Largest acceptable pipe buffer size. */
+#define PIPE_MAX_BUFFER (1u<<20)
+
+
+/** @brief The pipe control block. */
+typedef struct pipe_control_block
+{
+  char* buffer;           /**< @brief The ring buffer */
+  size_t mask;            /**< @brief The size of the buffer minus 1 */
+
+  size_t r_pos;           /**< @brief Bytes read so far (owned by the reader) */
+  size_t w_pos;           /**< @brief Bytes written so far (owned by the writer) */
+
+  int reader_open;        /**< @brief The read end is open */
+  int writer_open;        /**< @brief The write end is open */
+  int r_wait;             /**< @brief A reader may sleep on @c has_data */
+  int w_wait;             /**< @brief A writer may sleep on @c has_space */
+  int ends;               /**< @brief Open ends; the pipe is freed at 0 */
+
+  Mutex read_mx;          /**< @brief Serializes readers */
+  Mutex write_mx;         /**< @brief Serializes writers */
+
+  Mutex mx;               /**< @brief Protects blocking and closing */
+  CondVar has_data;       /**< @brief Signalled when the pipe becomes non-empty */
+  CondVar has_space;      /**< @brief Signalled when the pipe becomes non-full */
+  poll_queue pollq;       /**< @brief Threads polling either end */
+} pipe_cb;
+
+
+/** @brief Stream operations of the read end of a pipe. */
+extern file_ops pipe_reader_ops;
+
+/** @brief Stream operations of the write end of a pipe. */
+extern file_ops pipe_writer_ops;
+
+
+/**
+  @brief Create a new pipe.
+
+  The buffer size is rounded up to a power of two, and clamped to
+  the range [@ref PIPE_MIN_BUFFER, @ref PIPE_MAX_BUFFER]. A size of 0
+  selects @ref PIPE_BUFFER_SIZE. Both ends are open.
+ */
+pipe_cb* pipe_create(unsigned int size);
+
+/**
+  @brief Read from a pipe.
+
+  Block until data is available, or no more data can arrive because
+  either end has been shut down. The data left in the buffer can still
+  be read after that.
+  @returns the number of bytes read, or 0 at end of data. In non-blocking
+    mode (see @ref FCB_try_io), @c IO_WOULDBLOCK instead of blocking.
+ */
+int pipe_read(pipe_cb* pipe, char* buf, unsigned int size);
+
+/**
+  @brief Write to a pipe.
+
+  Block until there is space in the buffer, and copy as much as fits.
+  @returns the number of bytes written, or -1 if either end is closed.
+    In non-blocking mode, @c IO_WOULDBLOCK instead of blocking.
+ */
+int pipe_write(pipe_cb* pipe, const char* buf, unsigned int size);
+
+/** @brief Read from a pipe into a vector of buffers, as @ref pipe_read. */
+int pipe_readv(pipe_cb* pipe, const iovec_t* iov, unsigned int iovcnt);
+
+/** @brief Write to a pipe from a vector of buffers, as @ref pipe_write. */
+int pipe_writev(pipe_cb* pipe, const iovec_t* iov, unsigned int iovcnt);
+
+/**
+  @brief Pass data from a pipe to the write method of another stream.
+
+  This is the @c Splice method of the read end. Block as in
+  @ref pipe_read, then hand up to @c size bytes from the ring buffer
+  directly to @c sink. If @c consume is 0, the data is left in the pipe.
+  @returns the number of bytes accepted by the sink, 0 at end of data,
+    or -1 on error.
+ */
+int pipe_splice(pipe_cb* pipe, stream_sink sink, void* sinkobj, 
+  unsigned int size, int consume);
+
+/**
+  @brief Shut down the read end of a pipe, without releasing it.
+
+  Blocked writers return -1, and so do subsequent writes. The end must
+  still be released by @ref pipe_reader_close.
+ */
+void pipe_reader_shutdown(pipe_cb* pipe);
+
+/**
+  @brief Shut down the write end of a pipe, without releasing it.
+
+  Readers drain the buffer, then get 0. The end must still be released 
+  by @ref pipe_writer_close.
+ */
+void pipe_writer_shutdown(pipe_cb* pipe);
+
+/** @brief The @c Poll method of the read end of a pipe. */
+int pipe_reader_poll(pipe_cb* pipe, poll_table* pt);
+
+/** @brief The @c Poll method of the write end of a pipe. */
+int pipe_writer_poll(pipe_cb* pipe, poll_table* pt);
+
+/** @brief Close the read end of a pipe. Blocked writers return -1. */
+int pipe_reader_close(pipe_cb* pipe);
+
+/** @brief Close the write end of a pipe. Readers drain the buffer, then get 0. */
+int pipe_writer_close(pipe_cb* pipe);
+
+/** @} */
+
+#endif
@@ -3,6 +3,9 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_ring.h"
+#include "kernel_shm.h"
+#include "kernel_sys.h"
 
 
 /* 
@@ -12,60 +15,83 @@
  - WaitPid
  - GetPid
  - GetPPid
+ - OpenInfo
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table. It is allocated in chunks of PT_CHUNK PCBs, on first 
+  use. The chunks are kept from one boot to the next.
+ */
+static PCB* PT[MAX_PROC/PT_CHUNK];
 unsigned int process_count;
 
+/* PCBs with pid < pt_top have been initialized since boot */
+static Pid_t pt_top;
+
+/* A stack of the free pids below pt_top */
+static Pid_t pt_free[MAX_PROC];
+static unsigned int pt_free_count;
+
+/* Bitmap of the pids that are not FREE, for scanning the table quickly */
+static uint64_t pt_used[MAX_PROC/64];
+
+/* 
+  Protects PT, pt_top, pt_free, pt_used and process_count, as well as the 
+  process tree, i.e., the pstate, parent, children and exited lists of all 
+  PCBs, and the arguments of all PCBs.
+ */
+static Mutex PT_mutex = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0 || pid >= pt_top) return NULL;
+  PCB* pcb = &PT[pid/PT_CHUNK][pid%PT_CHUNK];
+  return pcb->pstate==FREE ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
-static inline void initialize_PCB(PCB* pcb)
+static inline void initialize_PCB(PCB* pcb, Pid_t pid)
 {
   pcb->pstate = FREE;
+  pcb->pid = pid;
   pcb->argl = 0;
   pcb->args = NULL;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  FIDT_init(pcb);
+  pcb->FIDT_mutex = MUTEX_INIT;
+
+  tids_init(pcb);
+  pcb->threads_mutex = MUTEX_INIT;
+
+  pcb->ring = NULL;
+  rlnode_init(& pcb->shm_list, NULL);
+  pcb->exit_hook_count = 0;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
+  pcb->children_link = NULL;
   pcb->child_exit = COND_INIT;
+  pcb->exited = COND_INIT;
 }
 
 
-static PCB* pcb_freelist;
-
 void initialize_processes()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
-  }
-
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
-  }
+  /* The PCBs are initialized on demand, by acquire_PCB() */
+  memset(pt_used, 0, ((pt_top+63)/64)*sizeof(uint64_t));
+  pt_top = 0;
+  pt_free_count = 0;
 
   process_count = 0;
+  PT_mutex = MUTEX_INIT;
 
   /* Execute a null "idle" process */
   if(Exec(NULL,0,NULL)!=0)
@@ -74,30 +100,82 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Drop a reference to a parent link. Must be called with PT_mutex held
+*/
+static void put_parent_link(parent_link* link)
+{
+  if(--link->refcount == 0)
+    free(link);
+}
+
+/*
+  Make pcb a child of parent. Must be called with PT_mutex held
+*/
+static void set_parent(PCB* pcb, PCB* parent)
+{
+  if(parent->children_link == NULL) {
+    parent->children_link = xmalloc(sizeof(parent_link));
+    parent->children_link->pcb = parent;
+    parent->children_link->refcount = 1;
+  }
+  pcb->parent = parent->children_link;
+  pcb->parent->refcount++;
+  rlist_push_front(& parent->children_list, & pcb->children_node);
+}
+
+
+/*
+  Take a free PCB. It stays FREE, and thus invisible to get_pcb() and 
+  OpenInfo, until it is published. Must be called with PT_mutex held
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
-  if(pcb_freelist != NULL) {
-    pcb = pcb_freelist;
-    pcb->pstate = ALIVE;
-    pcb_freelist = pcb_freelist->parent;
-    process_count++;
+  if(pt_free_count > 0) {
+    Pid_t pid = pt_free[--pt_free_count];
+    pcb = &PT[pid/PT_CHUNK][pid%PT_CHUNK];
+  }
+  else if(pt_top < MAX_PROC) {
+    Pid_t pid = pt_top++;
+    if(PT[pid/PT_CHUNK] == NULL)
+      PT[pid/PT_CHUNK] = xmalloc(PT_CHUNK*sizeof(PCB));
+    pcb = &PT[pid/PT_CHUNK][pid%PT_CHUNK];
+    initialize_PCB(pcb, pid);
   }
 
   return pcb;
 }
 
 /*
-  Must be called with kernel_mutex held
+  Make an acquired PCB ALIVE. Must be called with PT_mutex held
+*/
+static void publish_PCB(PCB* pcb)
+{
+  pcb->pstate = ALIVE;
+  pt_used[pcb->pid/64] |= 1ull << (pcb->pid%64);
+  process_count++;
+}
+
+/*
+  Return an acquired PCB that was never published. Must be called with PT_mutex held
+*/
+static void unacquire_PCB(PCB* pcb)
+{
+  pt_free[pt_free_count++] = pcb->pid;
+}
+
+/*
+  Must be called with PT_mutex held
 */
 void release_PCB(PCB* pcb)
 {
+  if(pcb->parent)
+    put_parent_link(pcb->parent);
+  pcb->parent = NULL;
   pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
+  pt_used[pcb->pid/64] &= ~(1ull << (pcb->pid%64));
+  pt_free[pt_free_count++] = pcb->pid;
   process_count--;
 }
 
@@ -114,63 +192,78 @@ void release_PCB(PCB* pcb)
 */
 void start_main_thread()
 {
-  int exitval;
-
-  Task call =  CURPROC->main_task;
-  int argl = CURPROC->argl;
-  void* args = CURPROC->args;
-
-  exitval = call(argl,args);
+  PTCB* ptcb = cur_thread()->ptcb;
+  int exitval = ptcb->task(ptcb->argl, ptcb->args);
   Exit(exitval);
 }
 
 
 /*
-	System call to create a new process.
+  Create a new process. The file table is inherited from the parent,
+  after applying the given actions.
  */
-Pid_t sys_Exec(Task call, int argl, void* args)
+static Pid_t spawn_process(Task call, int argl, void* args, const fd_action* actions, uint n)
 {
-  PCB *curproc, *newproc;
-  
-  /* The new process PCB */
-  newproc = acquire_PCB();
+  PCB *curproc = NULL, *newproc;
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(n > 0 && actions == NULL)
+    return NOPROC;
 
-  if(get_pid(newproc)<=1) {
-    /* Processes with pid<=1 (the scheduler and the init process) 
-       are parentless and are treated specially. */
-    newproc->parent = NULL;
+  /* Long arguments are copied before taking the lock */
+  void* args_copy = NULL;
+  if(args != NULL && argl > PCB_ARGS_SIZE) {
+    args_copy = xmalloc(argl);
+    memcpy(args_copy, args, argl);
   }
-  else
-  {
-    /* Inherit parent */
-    curproc = CURPROC;
-
-    /* Add new process to the parent's child list */
-    newproc->parent = curproc;
-    rlist_push_front(& curproc->children_list, & newproc->children_node);
+  
+  Mutex_Lock(& PT_mutex);
+  newproc = acquire_PCB();
+  Mutex_Unlock(& PT_mutex);
 
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+  if(newproc == NULL) {
+    /* We have run out of PIDs! */
+    free(args_copy);
+    goto finish;
   }
 
-
-  /* Set the main thread's function */
+  /* Set the main thread's function and the arguments, owned by the new 
+     process. No lock is needed, since the PCB is not published yet. */
   newproc->main_task = call;
-
-  /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
-  if(args!=NULL) {
-    newproc->args = malloc(argl);
+  if(args_copy != NULL)
+    newproc->args = args_copy;
+  else if(args != NULL) {
+    newproc->args = newproc->args_local;
     memcpy(newproc->args, args, argl);
   }
   else
-    newproc->args=NULL;
+    newproc->args = NULL;
+
+  /* Processes with pid<=1 (the scheduler and the init process) 
+     are parentless and are treated specially. */
+  if(get_pid(newproc) > 1)
+    curproc = CURPROC;
+
+  /* Inherit file streams from parent. This is done before the new process
+     is published, so that bad actions leave no trace. */
+  if(curproc != NULL && FIDT_inherit(newproc, curproc, actions, n) != 0) {
+    newproc->args = NULL;
+    free(args_copy);
+    Mutex_Lock(& PT_mutex);
+    unacquire_PCB(newproc);
+    Mutex_Unlock(& PT_mutex);
+    newproc = NULL;
+    goto finish;
+  }
+
+  Mutex_Lock(& PT_mutex);
+  publish_PCB(newproc);
+  if(curproc != NULL)
+    /* Inherit parent, and add new process to the parent's child list */
+    set_parent(newproc, curproc);
+  else
+    newproc->parent = NULL;
+  Mutex_Unlock(& PT_mutex);
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -178,8 +271,9 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
-    wakeup(newproc->main_thread);
+    PTCB* ptcb = spawn_process_thread(newproc, call, argl, newproc->args, start_main_thread);
+    ptcb->tcb->affinity = sched_task_affinity(call, ptcb->tcb->affinity);
+    wakeup(ptcb->tcb);
   }
 
 
@@ -188,7 +282,22 @@ finish:
 }
 
 
-/* System call */
+/*
+	System call to create a new process.
+ */
+Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return spawn_process(call, argl, args, NULL, 0);
+}
+
+
+Pid_t sys_Spawn(Task call, int argl, void* args, const fd_action* actions, unsigned int n)
+{
+  return spawn_process(call, argl, args, actions, n);
+}
+
+
+/* System call. This needs no lock. */
 Pid_t sys_GetPid()
 {
   return get_pid(CURPROC);
@@ -197,18 +306,26 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  return get_pid(get_parent(CURPROC));
 }
 
 
+/*
+  Must be called with PT_mutex held
+*/
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
     *status = pcb->exitval;
 
+  PCB* parent = get_parent(pcb);
   rlist_remove(& pcb->children_node);
   rlist_remove(& pcb->exited_node);
 
+  /* Waiters for any child must return if there are no more children */
+  if(is_rlist_empty(& parent->children_list))
+    kernel_broadcast(& parent->child_exit);
+
   release_PCB(pcb);
 }
 
@@ -222,20 +339,24 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
     goto finish;
   }
 
+  Mutex_Lock(& PT_mutex);
+
   PCB* parent = CURPROC;
   PCB* child = get_pcb(cpid);
-  if( child == NULL || child->parent != parent)
+  if( child == NULL || get_parent(child) != parent)
   {
     cpid = NOPROC;
-    goto finish;
+    goto unlock;
   }
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& PT_mutex, & child->exited, SCHED_USER);
   
   cleanup_zombie(child, status);
-  
+
+unlock:
+  Mutex_Unlock(& PT_mutex);
 finish:
   return cpid;
 }
@@ -247,6 +368,8 @@ static Pid_t wait_for_any_child(int* status)
 
   PCB* parent = CURPROC;
 
+  Mutex_Lock(& PT_mutex);
+
   /* Make sure I have children! */
   int no_children, has_exited;
   while(1) {
@@ -256,17 +379,19 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(& PT_mutex, & parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
-    return NOPROC;
-
-  PCB* child = parent->exited_list.next->pcb;
-  assert(child->pstate == ZOMBIE);
-  cpid = get_pid(child);
-  cleanup_zombie(child, status);
+  if(no_children) {
+    cpid = NOPROC;
+  } else {
+    PCB* child = parent->exited_list.next->pcb;
+    assert(child->pstate == ZOMBIE);
+    cpid = get_pid(child);
+    cleanup_zombie(child, status);
+  }
 
+  Mutex_Unlock(& PT_mutex);
   return cpid;
 }
 
@@ -298,18 +423,73 @@ void sys_Exit(int exitval)
     If we are, we must wait until all child processes exit. 
    */
   if(get_pid(curproc)==1) {
-
     while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
+  }
 
-  } else {
+  /* The process terminates when its last thread exits */
+  sys_ThreadExit(exitval);
+}
+
+
+int sys_AtExit(void (*hook)(void))
+{
+  PCB* curproc = CURPROC;
+
+  /* Only threads of the process touch the hooks, and they are run by the last one */
+  Mutex_Lock(& curproc->threads_mutex);
+  int ok = (hook != NULL && curproc->exit_hook_count < MAX_EXIT_HOOKS);
+  if(ok)
+    curproc->exit_hooks[curproc->exit_hook_count++] = hook;
+  Mutex_Unlock(& curproc->threads_mutex);
+
+  return ok ? 0 : -1;
+}
+
+
+void exit_process()
+{
+  PCB *curproc = CURPROC;  /* cache for efficiency */
+
+  /* 
+    Do all the other cleanup we want here, close files etc. 
+   */
+
+  /* Run the exit hooks, while the process can still use its streams */
+  while(curproc->exit_hook_count > 0)
+    curproc->exit_hooks[--curproc->exit_hook_count]();
+
+  /* Cancel the requests of the I/O ring, which use the memory of the process */
+  ring_release(curproc);
+
+  /* Release the PTCBs of the threads that were not joined */
+  tids_release(curproc);
+
+  /* Clean up FIDT. The streams are closed without holding FIDT_mutex. */
+  FIDT_close_all(curproc);
+
+  /* Detach the shared memory segments */
+  shm_detach_all(curproc);
+
+  Mutex_Lock(& PT_mutex);
+
+  /* Release the args data */
+  if(curproc->args) {
+    if(curproc->args != curproc->args_local)
+      free(curproc->args);
+    curproc->args = NULL;
+  }
+
+  if(get_pid(curproc)!=1) {
 
     /* Reparent any children of the exiting process to the 
-       initial task */
+       initial task, by redirecting their link */
     PCB* initpcb = get_pcb(1);
-    while(!is_rlist_empty(& curproc->children_list)) {
-      rlnode* child = rlist_pop_front(& curproc->children_list);
-      child->pcb->parent = initpcb;
-      rlist_push_front(& initpcb->children_list, child);
+    parent_link* link = curproc->children_link;
+    if(link != NULL) {
+      link->pcb = initpcb;
+      rlist_append(& initpcb->children_list, & curproc->children_list);
+      curproc->children_link = NULL;
+      put_parent_link(link);
     }
 
     /* Add exited children to the initial task's exited list 
@@ -319,48 +499,158 @@ void sys_Exit(int exitval)
       kernel_broadcast(& initpcb->child_exit);
     }
 
-    /* Put me into my parent's exited list */
-    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    kernel_broadcast(& curproc->parent->child_exit);
+    /* Put me into my parent's exited list, and wake up one waiter for any child */
+    PCB* parent = get_parent(curproc);
+    rlist_push_back(& parent->exited_list, &curproc->exited_node);
+    kernel_signal(& parent->child_exit);
+    kernel_broadcast(& curproc->exited);
 
   }
 
   assert(is_rlist_empty(& curproc->children_list));
   assert(is_rlist_empty(& curproc->exited_list));
 
+  /* Now, mark the process as exited. */
+  curproc->pstate = ZOMBIE;
+
+  /* Bye-bye cruel world */
+  kernel_sleep(& PT_mutex, EXITED, SCHED_USER);
+}
 
-  /* 
-    Do all the other cleanup we want here, close files etc. 
-   */
 
-  /* Release the args data */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
+
+/*
+ *
+ * Process information streams
+ *
+ */
+
+/* The number of records collected each time PT_mutex is taken */
+#define PROCINFO_BATCH 16
+
+/* 
+  The stream object of OpenInfo. The records are collected in batches
+  into buf, and the scan of the process table resumes from cursor.
+ */
+typedef struct procinfo_cb {
+  Mutex mx;                 /* Serializes readers of the stream */
+  Pid_t cursor;             /* The next pid to examine */
+  unsigned int pos, len;    /* The bytes of buf already read, and the bytes in buf */
+  procinfo buf[PROCINFO_BATCH];
+} procinfo_cb;
+
+
+/*
+  Return the first used pid not smaller than pid, or NOPROC.
+  Must be called with PT_mutex held
+*/
+static Pid_t pt_next_used(Pid_t pid)
+{
+  if(pid >= pt_top) return NOPROC;
+
+  unsigned int w = pid/64;
+  uint64_t word = pt_used[w] & (~0ull << (pid%64));
+  while(word == 0) {
+    if(++w >= (pt_top+63)/64) return NOPROC;
+    word = pt_used[w];
   }
+  return w*64 + __builtin_ctzll(word);
+}
 
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+
+/*
+  Fill a record for a used PCB. Must be called with PT_mutex held
+*/
+static void fill_procinfo(procinfo* info, PCB* pcb)
+{
+  info->pid = pcb->pid;
+  info->ppid = get_pid(get_parent(pcb));
+  info->alive = (pcb->pstate == ALIVE);
+
+  thread_stats stats;
+  info->thread_count = get_process_thread_stats(pcb, &stats);
+  info->run_time = stats.run_time;
+  info->wait_time = stats.wait_time;
+  info->voluntary = stats.voluntary;
+  info->involuntary = stats.involuntary;
+
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  int n = pcb->argl < PROCINFO_MAX_ARGS_SIZE ? pcb->argl : PROCINFO_MAX_ARGS_SIZE;
+  if(pcb->args != NULL && n > 0)
+    memcpy(info->args, pcb->args, n);
+}
+
+
+/*
+  Collect the next batch of records, holding PT_mutex only for the batch.
+*/
+static void procinfo_fill(procinfo_cb* pi)
+{
+  unsigned int n = 0;
+  Pid_t pid = pi->cursor;
+
+  Mutex_Lock(& PT_mutex);
+  while(n < PROCINFO_BATCH && (pid = pt_next_used(pid)) != NOPROC) {
+    fill_procinfo(& pi->buf[n++], & PT[pid/PT_CHUNK][pid%PT_CHUNK]);
+    pid++;
   }
+  Mutex_Unlock(& PT_mutex);
 
-  /* Disconnect my main_thread */
-  curproc->main_thread = NULL;
+  pi->cursor = (pid == NOPROC) ? MAX_PROC : pid;
+  pi->pos = 0;
+  pi->len = n*sizeof(procinfo);
+}
 
-  /* Now, mark the process as exited. */
-  curproc->pstate = ZOMBIE;
 
-  /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+static int procinfo_read(void* this, char* buf, unsigned int size)
+{
+  procinfo_cb* pi = (procinfo_cb*) this;
+
+  Mutex_Lock(& pi->mx);
+  if(pi->pos == pi->len && pi->cursor < MAX_PROC)
+    procinfo_fill(pi);
+
+  unsigned int n = pi->len - pi->pos;
+  if(n > size) n = size;
+  memcpy(buf, (char*) pi->buf + pi->pos, n);
+  pi->pos += n;
+  Mutex_Unlock(& pi->mx);
+
+  return n;
+}
+
+
+static int procinfo_close(void* this)
+{
+  free(this);
+  return 0;
 }
 
 
+static file_ops procinfo_ops = {
+  .Open = NULL,
+  .Read = procinfo_read,
+  .Write = NULL,
+  .Close = procinfo_close
+};
+
 
 Fid_t sys_OpenInfo()
 {
-	return NOFILE;
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  procinfo_cb* pi = xmalloc(sizeof(procinfo_cb));
+  pi->mx = MUTEX_INIT;
+  pi->cursor = 0;
+  pi->pos = pi->len = 0;
+
+  fcb->streamobj = pi;
+  fcb->streamfunc = &procinfo_ops;
+  return fid;
 }
 
@@ -30,6 +30,70 @@ typedef enum pid_state_e {
   ZOMBIE  /**< @brief The PID is held by a zombie */
 } pid_state;
 
+/** @brief The largest argument string stored inside the PCB. Longer ones are allocated. */
+#define PCB_ARGS_SIZE 256
+
+/** @brief The number of 64-bit words in the bitmap of a fileid table of @c n slots. */
+#define FIDT_WORDS(n) (((n)+63)/64)
+
+/** @brief The number of thread id slots stored inside the PCB. More are allocated. */
+#define PCB_TIDS 8
+
+/**
+  @brief Process Thread Control Block.
+
+  This structure holds the process-level state of a thread: its task, 
+  its exit value and whether it has been joined or detached. It is kept
+  apart from the TCB, whose memory (including the stack) is recycled as 
+  soon as the thread exits. The PTCB of an exited thread is kept until the
+  thread is joined, or until the process exits. The PTCB of a detached 
+  thread is released when the thread exits.
+ */
+typedef struct process_thread_control_block {
+  TCB* tcb;               /**< @brief The thread, or NULL after it has exited */
+  Tid_t tid;              /**< @brief The thread id */
+
+  Task task;              /**< @brief The thread's function */
+  int argl;               /**< @brief The thread's argument length */
+  void* args;             /**< @brief The thread's argument */
+
+  int exitval;            /**< @brief The exit value of the thread */
+  int exited;             /**< @brief Set when the thread has exited */
+  int detached;           /**< @brief Set when the thread has been detached */
+  CondVar exit_cv;        /**< @brief Broadcast when the thread exits or is detached */
+
+  uint refcount;          /**< @brief The thread while it runs, its tid slot, and its joiners */
+} PTCB;
+
+/**
+  @brief A slot of the thread id table of a process.
+
+  A thread id encodes the index of the slot and its generation, so that
+  a tid is validated in constant time, and the tids of threads that have
+  been joined, or have exited detached, are not valid for new threads in
+  the same slot.
+ */
+typedef struct tid_slot {
+  PTCB* ptcb;             /**< @brief The thread, or NULL for a free slot */
+  uint gen;               /**< @brief The generation, incremented when the slot is freed */
+  uint next_free;         /**< @brief The next free slot, for free slots */
+} tid_slot;
+
+/**
+  @brief The link from a set of children to their parent.
+
+  The children of a process do not point to their parent directly, but
+  to a link shared by all of them. When a process exits, its children are
+  passed to the init process by splicing its children list and by updating 
+  the link, in constant time.
+
+  A link is freed when it has neither an owner nor children pointing to it.
+ */
+typedef struct parent_link {
+  struct process_control_block* pcb;  /**< @brief The parent */
+  uint refcount;          /**< @brief Children pointing to the link, plus 1 while it is owned */
+} parent_link;
+
 /**
   @brief Process Control Block.
 
@@ -37,14 +101,16 @@ typedef enum pid_state_e {
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
+  Pid_t pid;              /**< @brief The pid of this PCB */
 
-  PCB* parent;            /**< @brief Parent's pcb. */
+  parent_link* parent;    /**< @brief The link to the parent, or NULL */
+  parent_link* children_link; /**< @brief The link of the children, or NULL if not allocated yet */
   int exitval;            /**< @brief The exit value of the process */
 
-  TCB* main_thread;       /**< @brief The main thread */
   Task main_task;         /**< @brief The main thread's function */
   int argl;               /**< @brief The main thread's argument length */
   void* args;             /**< @brief The main thread's argument string */
+  _Alignas(16) char args_local[PCB_ARGS_SIZE]; /**< @brief Storage for short argument strings */
 
   rlnode children_list;   /**< @brief List of children */
   rlnode exited_list;     /**< @brief List of exited children */
@@ -52,22 +118,49 @@ typedef struct process_control_block {
   rlnode children_node;   /**< @brief Intrusive node for @c children_list */
   rlnode exited_node;     /**< @brief Intrusive node for @c exited_list */
 
-  CondVar child_exit;     /**< @brief Condition variable for @c WaitChild. 
+  CondVar child_exit;     /**< @brief Condition variable for @c WaitChild(NOPROC). 
 
-                             This condition variable is  broadcast each time a child
-                             process terminates. It is used in the implementation of
-                             @c WaitChild() */
+                             This condition variable is signalled once each time a child
+                             process terminates, and broadcast when the last child is 
+                             cleaned up. */
 
-  FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  CondVar exited;         /**< @brief Broadcast when this process terminates, 
+                             for @c WaitChild() on its pid */
+
+  FCB** FIDT;             /**< @brief The fileid table of the process */
+  uint64_t* FIDT_used;    /**< @brief Bitmap of the non-empty slots of @c FIDT */
+  uint FIDT_size;         /**< @brief The size of @c FIDT */
+  FCB* FIDT_local[MAX_FILEID];  /**< @brief The initial storage of @c FIDT */
+  uint64_t FIDT_local_used[FIDT_WORDS(MAX_FILEID)]; /**< @brief The initial storage of @c FIDT_used */
+  Mutex FIDT_mutex;       /**< @brief Protects the fileid table */
+
+  tid_slot* tids;         /**< @brief The thread id table of the process */
+  uint tids_size;         /**< @brief The size of @c tids */
+  uint tids_free;         /**< @brief The first free slot of @c tids, or @c tids_size */
+  tid_slot tids_local[PCB_TIDS];  /**< @brief The initial storage of @c tids */
+  uint thread_count;      /**< @brief The number of threads that have not exited */
+  Mutex threads_mutex;    /**< @brief Protects the thread id table, the PTCBs 
+                               and @c thread_count */
+
+  struct io_ring_control_block* ring; /**< @brief The I/O ring, or NULL (see @c RingSetup), protected by @c FIDT_mutex */
+  rlnode shm_list;        /**< @brief The attached shared memory segments, protected by @c FIDT_mutex */
+
+  void (*exit_hooks[MAX_EXIT_HOOKS])(void); /**< @brief The hooks registered by @c AtExit */
+  uint exit_hook_count;   /**< @brief The number of @c exit_hooks */
 
 } PCB;
 
 
+/** @brief The number of PCBs in each chunk of the process table. */
+#define PT_CHUNK 256
+
 /**
   @brief Initialize the process table.
 
   This function is called during kernel initialization, to initialize
-  any data structures related to process creation.
+  any data structures related to process creation. The process table
+  is allocated in chunks of @ref PT_CHUNK PCBs, and PCBs are initialized
+  when their pid is first used, so this takes constant time.
 */
 void initialize_processes();
 
@@ -83,6 +176,17 @@ void initialize_processes();
 */
 PCB* get_pcb(Pid_t pid);
 
+/**
+  @brief Get the parent of a process.
+
+  @param pcb the pcb of the process
+  @returns the PCB of the parent, or NULL for processes without a parent.
+ */
+static inline PCB* get_parent(PCB* pcb)
+{
+  return pcb->parent ? pcb->parent->pcb : NULL;
+}
+
 /**
   @brief Get the PID of a PCB.
 
@@ -95,6 +199,47 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Initialize the thread id table of a new PCB.
+
+  The table is empty, with @c PCB_TIDS slots, in storage inside the PCB.
+ */
+void tids_init(PCB* pcb);
+
+/**
+  @brief Create a thread in a process.
+
+  A PTCB and a tid are allocated for the new thread, and its TCB is 
+  created to execute @c func, which must call the task of the PTCB.
+  The thread is returned in the @c INIT state; the caller must wake up
+  @c ptcb->tcb to start it.
+
+  @returns the PTCB of the new thread
+ */
+PTCB* spawn_process_thread(PCB* pcb, Task task, int argl, void* args, void (*func)());
+
+/**
+  @brief Terminate the current process.
+
+  This is called by the last thread of the process, after it has
+  released its PTCB. The thread does not return.
+ */
+void exit_process(void);
+
+/**
+  @brief Release the thread id table of a process whose threads have all exited.
+
+  The PTCBs of the threads that have not been joined are released.
+ */
+void tids_release(PCB* pcb);
+
+/**
+  @brief Sum the scheduler counters of the live threads of a process.
+
+  @returns the number of live threads.
+ */
+unsigned int get_process_thread_stats(PCB* pcb, thread_stats* stats);
+
 /** @} */
 
 #endif
@@ -0,0 +1,291 @@
+
+#include "kernel_ring.h"
+#include "kernel_sched.h"
+#include "kernel_streams.h"
+
+
+/* A request that waits for a worker thread */
+typedef struct ring_request {
+  rlnode node;
+  io_sqe sqe;
+  FCB* fcb;
+} ring_request;
+
+
+/* Execute a read or write, without blocking */
+static int ring_transfer(FCB* fcb, io_sqe* sqe)
+{
+  return FCB_try_io(fcb, sqe->op == IO_WRITE, sqe->buf, sqe->size);
+}
+
+
+/*
+  Post a completion, unless the process is exiting. Must be called with
+  rcb->mx held.
+ */
+static void ring_post(RCB* rcb, unsigned long user_data, int result)
+{
+  if(! rcb->closing) {
+    io_ring* ring = rcb->ring;
+    io_cqe* cqe = &ring->cq[ring->cq_tail & (ring->entries-1)];
+    cqe->user_data = user_data;
+    cqe->result = result;
+    __atomic_store_n(&ring->cq_tail, ring->cq_tail+1, __ATOMIC_RELEASE);
+  }
+  rcb->inflight--;
+}
+
+
+/*
+  This function is provided as an argument to spawn_thread, to run
+  a worker thread. Workers take turns on the deferred requests: each
+  request gets one poll of at most RING_POLL_INTERVAL and one attempt,
+  and goes to the back of the list if it would still block. A worker
+  exits when the list is empty.
+ */
+static void ring_worker()
+{
+  RCB* rcb = CURPROC->ring;
+
+  Mutex_Lock(&rcb->mx);
+  while(! is_rlist_empty(&rcb->deferred)) {
+    ring_request* req = rlist_pop_front(&rcb->deferred)->obj;
+    Mutex_Unlock(&rcb->mx);
+
+    int event = (req->sqe.op == IO_READ) ? POLL_READ : POLL_WRITE;
+    int result = -1;
+    if(! __atomic_load_n(&rcb->closing, __ATOMIC_ACQUIRE)) {
+      if(FCB_poll(req->fcb, event, RING_POLL_INTERVAL) & (event|POLL_HANGUP|POLL_ERROR))
+        result = ring_transfer(req->fcb, &req->sqe);
+      else
+        result = IO_WOULDBLOCK;
+    }
+
+    /* Once the process is exiting, requests are cancelled */
+    int requeue = (result == IO_WOULDBLOCK) && ! __atomic_load_n(&rcb->closing, __ATOMIC_ACQUIRE);
+    if(! requeue) {
+      if(result == IO_WOULDBLOCK) result = -1;
+      FCB_decref(req->fcb);
+    }
+
+    Mutex_Lock(&rcb->mx);
+    if(requeue) {
+      rlist_push_back(&rcb->deferred, &req->node);
+    } else {
+      ring_post(rcb, req->sqe.user_data, result);
+      kernel_broadcast(&rcb->completed);
+      free(req);
+    }
+  }
+  rcb->workers--;
+
+  /* The RCB may be freed once the mutex is unlocked */
+  kernel_sleep(&rcb->mx, EXITED, SCHED_IO);
+}
+
+
+/*
+  Start a request, given the FCB of its file id (with a reference), or NULL.
+  Return 1 if the request completed, with its result stored in *result, or
+  0 if it was handed to a worker.
+ */
+static int ring_start(RCB* rcb, io_sqe* sqe, FCB* fcb, int* result)
+{
+  *result = -1;
+
+  switch(sqe->op) {
+  case IO_NOP:
+    *result = 0;
+    break;
+
+  case IO_CLOSE:
+    /* As in Close(), closing a closed file id is legal */
+    if(fcb)
+      *result = FCB_decref(fcb);
+    else
+      *result = (sqe->fd >= 0 && sqe->fd < MAX_FILEID_LIMIT) ? 0 : -1;
+    return 1;
+
+  case IO_READ:
+  case IO_WRITE:
+    if(fcb == NULL) break;
+    int event = (sqe->op == IO_READ) ? POLL_READ : POLL_WRITE;
+    file_ops* ops = fcb->streamfunc;
+    if(ops->Poll == NULL || (ops->Poll(fcb->streamobj, NULL) & (event|POLL_HANGUP|POLL_ERROR))) {
+      *result = ring_transfer(fcb, sqe);
+      if(*result != IO_WOULDBLOCK) break;
+    }
+
+    /* Hand the request, and the reference to the FCB, to the workers */
+    ring_request* req = xmalloc(sizeof(ring_request));
+    rlnode_init(&req->node, req);
+    req->sqe = *sqe;
+    req->fcb = fcb;
+    Mutex_Lock(&rcb->mx);
+    rlist_push_back(&rcb->deferred, &req->node);
+    int spawn = (rcb->workers < RING_WORKERS);
+    if(spawn) rcb->workers++;
+    Mutex_Unlock(&rcb->mx);
+    if(spawn)
+      wakeup(spawn_thread(CURPROC, ring_worker));
+    return 0;
+
+  default:
+    break;
+  }
+
+  if(fcb) FCB_decref(fcb);
+  return 1;
+}
+
+
+int sys_RingSetup(io_ring* ring)
+{
+  if(ring != NULL) {
+    uint n = ring->entries;
+    if(n == 0 || (n & (n-1)) != 0 || ring->sq == NULL || ring->cq == NULL)
+      return -1;
+  }
+
+  PCB* pcb = CURPROC;
+  Mutex_Lock(&pcb->FIDT_mutex);
+  RCB* rcb = pcb->ring;
+
+  if(rcb != NULL) {
+    Mutex_Lock(&rcb->mx);
+    int busy = rcb->submitting || (rcb->inflight > 0);
+    Mutex_Unlock(&rcb->mx);
+    if(busy) {
+      Mutex_Unlock(&pcb->FIDT_mutex);
+      return -1;
+    }
+  }
+
+  if(ring == NULL) {
+    pcb->ring = NULL;
+    Mutex_Unlock(&pcb->FIDT_mutex);
+    free(rcb);
+    return 0;
+  }
+
+  if(rcb == NULL) {
+    rcb = xmalloc(sizeof(RCB));
+    rcb->mx = MUTEX_INIT;
+    rcb->completed = COND_INIT;
+    rcb->inflight = 0;
+    rlnode_init(&rcb->deferred, NULL);
+    rcb->workers = 0;
+    rcb->closing = 0;
+    rcb->submitting = 0;
+    pcb->ring = rcb;
+  }
+
+  ring->sq_head = ring->sq_tail = 0;
+  ring->cq_head = ring->cq_tail = 0;
+  rcb->ring = ring;
+  Mutex_Unlock(&pcb->FIDT_mutex);
+  return 0;
+}
+
+
+/* 
+  Claim the ring of a process for a Submit() call. Return NULL if there is
+  no ring, or another thread is submitting.
+ */
+static RCB* ring_claim(PCB* pcb)
+{
+  Mutex_Lock(&pcb->FIDT_mutex);
+  RCB* rcb = pcb->ring;
+  if(rcb != NULL && rcb->submitting)
+    rcb = NULL;
+  if(rcb != NULL)
+    rcb->submitting = 1;
+  Mutex_Unlock(&pcb->FIDT_mutex);
+  return rcb;
+}
+
+static void ring_unclaim(PCB* pcb, RCB* rcb)
+{
+  Mutex_Lock(&pcb->FIDT_mutex);
+  rcb->submitting = 0;
+  Mutex_Unlock(&pcb->FIDT_mutex);
+}
+
+
+int sys_Submit(unsigned int n, unsigned int min_complete)
+{
+  PCB* pcb = CURPROC;
+  RCB* rcb = ring_claim(pcb);
+  if(rcb == NULL) return -1;
+  io_ring* ring = rcb->ring;
+  uint mask = ring->entries-1;
+
+  /* Take only as many requests as there is room for their completions */
+  Mutex_Lock(&rcb->mx);
+  uint queued = ring->cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+  uint room = ring->entries - queued - rcb->inflight;
+  uint avail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE) - ring->sq_head;
+  if(n > avail) n = avail;
+  if(n > room) n = room;
+  rcb->inflight += n;
+  Mutex_Unlock(&rcb->mx);
+
+  for(uint done = 0; done < n; ) {
+    uint k = (n - done < RING_BATCH) ? n - done : RING_BATCH;
+
+    io_sqe sqe[k];
+    Fid_t fid[k];
+    int detach[k];
+    FCB* fcb[k];
+    for(uint i = 0; i < k; i++) {
+      sqe[i] = ring->sq[(ring->sq_head + i) & mask];
+      fid[i] = sqe[i].fd;
+      detach[i] = (sqe[i].op == IO_CLOSE);
+    }
+    __atomic_store_n(&ring->sq_head, ring->sq_head + k, __ATOMIC_RELEASE);
+
+    /* One lookup for the whole batch */
+    get_fcbs(k, fid, detach, fcb);
+
+    int result[k], completed[k];
+    for(uint i = 0; i < k; i++)
+      completed[i] = ring_start(rcb, &sqe[i], fcb[i], &result[i]);
+
+    /* Post the completions of the batch at once */
+    Mutex_Lock(&rcb->mx);
+    for(uint i = 0; i < k; i++)
+      if(completed[i])
+        ring_post(rcb, sqe[i].user_data, result[i]);
+    kernel_broadcast(&rcb->completed);
+    Mutex_Unlock(&rcb->mx);
+
+    done += k;
+  }
+
+  /* Wait for completions, while any may still arrive */
+  Mutex_Lock(&rcb->mx);
+  while(rcb->inflight > 0 &&
+      ring->cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) < min_complete)
+    kernel_wait(&rcb->mx, &rcb->completed, SCHED_IO);
+  Mutex_Unlock(&rcb->mx);
+
+  ring_unclaim(pcb, rcb);
+  return n;
+}
+
+
+void ring_release(PCB* pcb)
+{
+  RCB* rcb = pcb->ring;
+  if(rcb == NULL) return;
+
+  /* Workers notice this within RING_POLL_INTERVAL */
+  Mutex_Lock(&rcb->mx);
+  __atomic_store_n(&rcb->closing, 1, __ATOMIC_RELEASE);
+  while(rcb->inflight > 0)
+    kernel_wait(&rcb->mx, &rcb->completed, SCHED_IO);
+  Mutex_Unlock(&rcb->mx);
+
+  pcb->ring = NULL;
+  free(rcb);
+}
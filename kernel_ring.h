@@ -0,0 +1,74 @@
+#ifndef __KERNEL_RING_H
+#define __KERNEL_RING_H
+
+/**
+  @file kernel_ring.h
+  @brief Batched I/O rings.
+
+  @defgroup rings I/O rings
+  @ingroup kernel
+  @brief Batched I/O rings.
+
+  A process may register an @c io_ring, a pair of submission and completion
+  rings in its own memory (see @c RingSetup). A @c Submit() call takes a
+  batch of requests from the submission ring, looks up all of their file ids
+  under one lock of the fileid table, and executes the requests whose streams
+  are ready. Each request that would block is queued for a small pool of
+  kernel worker threads of the process, which wait for its stream, execute 
+  it and post its completion. Completions are read by the process without 
+  a system call. Requests are always executed in non-blocking mode (see
+  @c FCB_try_io), so that a worker never blocks on a stream indefinitely.
+
+  Worker threads are not threads of the process API: they have no tid and
+  are not counted in the thread count of the process. When the process
+  exits, its workers cancel the queued requests, and the exit waits for 
+  them to finish.
+
+  The ring of a process is set up, replaced and claimed by @c Submit() under
+  the @c FIDT_mutex of the process. Only one thread at a time may submit,
+  and the ring cannot be replaced while a thread is submitting.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_proc.h"
+
+
+/** @brief The largest number of requests whose file ids are looked up together. */
+#define RING_BATCH 64
+
+/** @brief How long (in msec) a worker polls one request, before moving to the next. */
+#define RING_POLL_INTERVAL 50
+
+/** @brief The largest number of worker threads of a ring. */
+#define RING_WORKERS 4
+
+/**
+  @brief The kernel side of the I/O ring of a process.
+ */
+typedef struct io_ring_control_block {
+  io_ring* ring;       /**< @brief The ring, in process memory */
+  Mutex mx;            /**< @brief Protects the fields below, and the completion ring */
+  CondVar completed;   /**< @brief Broadcast on each completion */
+  uint inflight;       /**< @brief Requests submitted but not completed yet */
+  rlnode deferred;     /**< @brief Requests waiting for a worker thread */
+  uint workers;        /**< @brief The number of worker threads */
+  int closing;         /**< @brief Set when the process exits */
+  int submitting;      /**< @brief Set while a thread is in @c Submit(), protected by @c FIDT_mutex */
+} RCB;
+
+
+/**
+  @brief Release the I/O ring of an exiting process.
+
+  Any requests in progress are cancelled. This waits for the worker
+  threads of the process to finish. It must be called before the fileid
+  table of the process is cleaned up.
+ */
+void ring_release(PCB* pcb);
+
+/** @} */
+
+#endif
@@ -1,10 +1,12 @@
 
 #include <assert.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_sched.h"
+#include "kernel_trace.h"
 #include "tinyos.h"
 
 #ifndef NVALGRIND
@@ -85,6 +87,28 @@ TCB* cur_thread()
 volatile unsigned int active_threads = 0;
 Mutex active_threads_spinlock = MUTEX_INIT;
 
+/*
+  The priority boost epoch. This is increased every SCHED_BOOST_PERIOD,
+  at which point the priority of all threads is reset to level 0.
+ */
+static volatile uint sched_boost_epoch = 0;
+static TimerDuration sched_next_boost = 0;
+
+/*
+  The core reservations of boot_reserve_cores(). The reserved cores are 
+  excluded from sched_default_affinity, the affinity of threads spawned
+  outside a normal thread (such as the init process). The interrupt core 
+  is the first core reserved for a NULL task, or else core 0.
+ */
+static struct {
+	Task task;
+	core_mask cores;
+} sched_reservations[MAX_CORES];
+static uint sched_reservation_count = 0;
+static core_mask sched_reserved = 0;
+static core_mask sched_default_affinity = ALL_CORES;
+static uint sched_interrupt_core = 0;
+
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
 
@@ -92,15 +116,18 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
-//#define MMAPPED_THREAD_MEM
+/* Defined by 'make GUARD=1' */
 #ifdef MMAPPED_THREAD_MEM
 
+/* A guard page is kept between the TCB and the stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + THREAD_STACK_SIZE)
+
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The "sentinel page" below the stack
+  has its access changed to PROT_NONE, so that a stack overflow
+  is detected as seg.fault, instead of corrupting the TCB.
  */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
@@ -111,9 +138,16 @@ void* allocate_thread(size_t size)
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
+
 	return ptr;
 }
 #else
+
+#define THREAD_GUARD_SIZE 0
+
+#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
@@ -129,6 +163,129 @@ void* allocate_thread(size_t size)
 #endif
 
 
+/*
+  The thread pool.
+  ----------------
+
+  Memory blocks of exited threads are recycled. Each core keeps a 
+  cache of up to THREAD_CACHE_SIZE free blocks, accessed without locking 
+  (with preemption disabled). Blocks that overflow a core cache go to a global
+  pool of up to THREAD_POOL_SIZE blocks, protected by @c thread_pool_spinlock. 
+  Blocks that overflow the pool are returned to the system.
+
+  Free blocks are kept in singly linked lists, threaded through the 
+  first word of each block.
+ */
+
+struct free_thread_block { struct free_thread_block* next; };
+
+static struct free_thread_block* thread_pool = NULL;
+static uint thread_pool_count = 0;
+static Mutex thread_pool_spinlock = MUTEX_INIT;
+
+static thread_pool_stats pool_stats;
+
+static inline void thread_pool_count_event(unsigned long* counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void* thread_pool_get()
+{
+	struct free_thread_block* block = NULL;
+
+	/* Try the local cache first */
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	if (ccb->thread_cache != NULL) {
+		block = ccb->thread_cache;
+		ccb->thread_cache = block->next;
+		ccb->thread_cache_count--;
+	}
+	if (preempt) preempt_on;
+
+	/* Then the global pool */
+	if (block == NULL && thread_pool_count > 0) {
+		Mutex_Lock(&thread_pool_spinlock);
+		if (thread_pool != NULL) {
+			block = thread_pool;
+			thread_pool = block->next;
+			thread_pool_count--;
+		}
+		Mutex_Unlock(&thread_pool_spinlock);
+	}
+
+	if (block != NULL) {
+		thread_pool_count_event(&pool_stats.hits);
+		return block;
+	}
+
+	thread_pool_count_event(&pool_stats.misses);
+	return allocate_thread(THREAD_SIZE);
+}
+
+static void thread_pool_put(void* ptr)
+{
+	struct free_thread_block* block = ptr;
+
+	/* Try the local cache first */
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	if (ccb->thread_cache_count < THREAD_CACHE_SIZE) {
+		block->next = ccb->thread_cache;
+		ccb->thread_cache = block;
+		ccb->thread_cache_count++;
+		block = NULL;
+	}
+	if (preempt) preempt_on;
+
+	if (block == NULL)
+		return;
+
+	/* Then the global pool */
+	Mutex_Lock(&thread_pool_spinlock);
+	if (thread_pool_count < THREAD_POOL_SIZE) {
+		block->next = thread_pool;
+		thread_pool = block;
+		thread_pool_count++;
+		block = NULL;
+	}
+	Mutex_Unlock(&thread_pool_spinlock);
+
+	if (block != NULL) {
+		thread_pool_count_event(&pool_stats.released);
+		free_thread(block, THREAD_SIZE);
+	}
+}
+
+/* 
+  Move the cache of a core to the global pool, or return it to the 
+  system. This is called while the cores are not running.
+ */
+static void thread_cache_drain(CCB* ccb)
+{
+	while (ccb->thread_cache != NULL) {
+		struct free_thread_block* block = ccb->thread_cache;
+		ccb->thread_cache = block->next;
+		if (thread_pool_count < THREAD_POOL_SIZE) {
+			block->next = thread_pool;
+			thread_pool = block;
+			thread_pool_count++;
+		} else {
+			free_thread(block, THREAD_SIZE);
+		}
+	}
+	ccb->thread_cache_count = 0;
+}
+
+void get_thread_pool_stats(thread_pool_stats* stats)
+{
+	stats->hits = __atomic_load_n(&pool_stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&pool_stats.misses, __ATOMIC_RELAXED);
+	stats->released = __atomic_load_n(&pool_stats.released, __ATOMIC_RELAXED);
+}
+
+
 
 
 /*
@@ -153,26 +310,44 @@ static void thread_start()
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	TCB* tcb = (TCB*)thread_pool_get();
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
+	tcb->ptcb = NULL;
 
 	/* Initialize the other attributes */
 	tcb->type = NORMAL_THREAD;
 	tcb->state = INIT;
 	tcb->phase = CTX_CLEAN;
+	tcb->state_spinlock = MUTEX_INIT;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->timeout_index = NO_TIMEOUT_INDEX;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	tcb->priority = 0;
+	tcb->boost_epoch = sched_boost_epoch;
+	tcb->last_core = cpu_core_id;
+	tcb->ready_core = cpu_core_id;
+
+	/* Inherit the affinity of the spawning thread */
+	TCB* parent = cur_thread();
+	tcb->affinity = (parent != NULL && parent->type == NORMAL_THREAD)
+		? parent->affinity : sched_default_affinity;
+
+	tcb->run_since = tcb->ready_since = 0;
+	tcb->run_time = tcb->wait_time = 0;
+	memset(tcb->switches, 0, sizeof(tcb->switches));
+	tcb->mutex_time = 0;
+	tcb->io_nonblock = 0;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
 
 	/* Init the context */
 	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
@@ -190,7 +365,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called from gain(), after the thread has exited and its
+  context is clean.
  */
 void release_TCB(TCB* tcb)
 {
@@ -198,7 +374,7 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	thread_pool_put(tcb);
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -216,83 +392,406 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Each core has its own scheduler queue, implemented as a multilevel 
+  feedback queue: one doubly linked list per priority level, stored in 
+  its CCB and protected by the core's @c ready_spinlock.
+  A thread made ready is queued at an idle core if possible (preferring the
+  core it last ran on), else at the core with the shortest queue, and
+  a core whose queue is empty steals from the queues of other cores.
+  The core is sent an ICI, to wake it up if it is idle, or to preempt its
+  current thread if that has lower priority.
+
+  The priority level of a thread is adjusted at the end of each time-slice,
+  according to the cause of the yield (see sched_adjust_priority()).
+
+  The state (and phase) of each thread is protected by its own 
+  @c state_spinlock.
+
+  Also, the scheduler contains a binary min-heap of all the sleeping
+  threads with a timeout, keyed on @c wakeup_time. Each thread records
+  its position in the heap, so that insertion and removal take O(log n)
+  time and the earliest timeout is found in O(1). This is protected by 
+  @c timeout_spinlock.
+
+  The lock order is: first a thread's @c state_spinlock, then 
+  @c timeout_spinlock, then a core's @c ready_spinlock. The only exception
+  is sched_wakeup_expired_timeouts(), which uses a try-lock on the 
+  @c state_spinlock while it holds @c timeout_spinlock.
 */
 
-rlnode SCHED; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+static TCB** TIMEOUT_HEAP = NULL; /* The heap of threads with a timeout */
+static size_t timeout_heap_size = 0; /* Number of threads in the heap */
+static size_t timeout_heap_capacity = 0; /* Allocated size of the heap */
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for the timeout heap */
+
+/* The wakeup time at the top of TIMEOUT_HEAP, read without locking */
+static volatile TimerDuration timeout_deadline = NO_TIMEOUT;
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
-/* Interrupt handle for inter-core interrupts */
+/* 
+  Interrupt handler for inter-core interrupts.
+
+  An ICI is a reschedule request: either a thread of higher priority 
+  than the current one was queued at this core, or a thread was queued
+  at this (idle) core.
+*/
 void ici_handler()
-{ /* noop for now... */
+{
+	CCB* ccb = &CURCORE;
+	int resched = __atomic_exchange_n(&ccb->resched, 0, __ATOMIC_ACQUIRE);
+
+	if (CURTHREAD->type == IDLE_THREAD) {
+		if (ccb->ready_count > 0)
+			yield(SCHED_IDLE);
+	} else if (resched)
+		yield(SCHED_PREEMPT);
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  The time-slice of a priority level.
+ */
+static inline TimerDuration sched_quantum(uint level)
+{
+	return QUANTUM << level;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Start a new boost epoch, if the boost period has passed.
+ */
+static void sched_boost_priorities(TimerDuration curtime)
+{
+	TimerDuration next_boost = sched_next_boost;
+	if (curtime >= next_boost
+		&& __atomic_compare_exchange_n(&sched_next_boost, &next_boost,
+			curtime + SCHED_BOOST_PERIOD, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&sched_boost_epoch, 1, __ATOMIC_RELAXED);
+}
+
+/*
+  Reset the priority of a thread which has missed a boost.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static inline void sched_boost_check(TCB* tcb)
+{
+	if (tcb->boost_epoch != sched_boost_epoch) {
+		tcb->boost_epoch = sched_boost_epoch;
+		tcb->priority = 0;
+	}
+}
+
+/*
+  Adjust the priority level and the next time-slice of a thread 
+  at the end of its time-slice.
+
+  - A thread that used up its quantum drops a level (and gets a longer quantum).
+  - A thread that blocked on I/O or a pipe rises a level.
+  - A thread that slept on a contended mutex, or was preempted by
+    a thread of higher priority, keeps its level, and continues with the 
+    remainder of its time-slice.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_adjust_priority(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	sched_boost_check(tcb);
+
+	switch (cause) {
+	case SCHED_QUANTUM:
+		if (tcb->priority < SCHED_LEVELS - 1)
+			tcb->priority++;
+		break;
+	case SCHED_IO:
+	case SCHED_PIPE:
+		if (tcb->priority > 0)
+			tcb->priority--;
+		break;
+	case SCHED_MUTEX:
+	case SCHED_PREEMPT:
+		if (tcb->rts > 0) {
+			tcb->its = tcb->rts;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	tcb->its = sched_quantum(tcb->priority);
+}
+
+/*
+  Helpers for the timeout heap.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static inline void timeout_heap_set(size_t i, TCB* tcb)
+{
+	TIMEOUT_HEAP[i] = tcb;
+	tcb->timeout_index = i;
+}
+
+static void timeout_heap_sift_up(size_t i)
+{
+	TCB* tcb = TIMEOUT_HEAP[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (TIMEOUT_HEAP[parent]->wakeup_time <= tcb->wakeup_time)
+			break;
+		timeout_heap_set(i, TIMEOUT_HEAP[parent]);
+		i = parent;
+	}
+	timeout_heap_set(i, tcb);
+}
+
+static void timeout_heap_sift_down(size_t i)
+{
+	TCB* tcb = TIMEOUT_HEAP[i];
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= timeout_heap_size)
+			break;
+		if (child + 1 < timeout_heap_size
+			&& TIMEOUT_HEAP[child + 1]->wakeup_time < TIMEOUT_HEAP[child]->wakeup_time)
+			child++;
+		if (tcb->wakeup_time <= TIMEOUT_HEAP[child]->wakeup_time)
+			break;
+		timeout_heap_set(i, TIMEOUT_HEAP[child]);
+		i = child;
+	}
+	timeout_heap_set(i, tcb);
+}
+
+static inline void timeout_heap_update_deadline()
+{
+	timeout_deadline = (timeout_heap_size == 0) ? NO_TIMEOUT
+		: TIMEOUT_HEAP[0]->wakeup_time;
+}
+
+/*
+  Possibly add TCB to the scheduler timeout heap.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		tcb->wakeup_time = curtime + timeout;
+
+		Mutex_Lock(&timeout_spinlock);
+
+		/* grow the heap if needed */
+		if (timeout_heap_size == timeout_heap_capacity) {
+			size_t newcap = (timeout_heap_capacity == 0) ? 64 : 2 * timeout_heap_capacity;
+			TCB** newheap = realloc(TIMEOUT_HEAP, newcap * sizeof(TCB*));
+			if (newheap == NULL)
+				FATAL("Out of memory for the timeout heap");
+			TIMEOUT_HEAP = newheap;
+			timeout_heap_capacity = newcap;
+		}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		/* add at the bottom of the heap and restore the heap order */
+		timeout_heap_set(timeout_heap_size++, tcb);
+		timeout_heap_sift_up(tcb->timeout_index);
+
+		TimerDuration old_deadline = timeout_deadline;
+		timeout_heap_update_deadline();
+		int earlier = timeout_deadline < old_deadline;
+
+		Mutex_Unlock(&timeout_spinlock);
+
+		/* A halted core may need to re-arm its timer for the new deadline */
+		if (earlier)
+			cpu_core_restart_one();
+	}
+}
+
+/*
+  Remove TCB from the scheduler timeout heap.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void sched_remove_timeout(TCB* tcb)
+{
+	assert(tcb->timeout_index != NO_TIMEOUT_INDEX && tcb->state == STOPPED);
+
+	/* replace with the last element of the heap */
+	size_t i = tcb->timeout_index;
+	TCB* last = TIMEOUT_HEAP[--timeout_heap_size];
+	if (last != tcb) {
+		timeout_heap_set(i, last);
+		if (i > 0 && TIMEOUT_HEAP[(i - 1) / 2]->wakeup_time > last->wakeup_time)
+			timeout_heap_sift_up(i);
+		else
+			timeout_heap_sift_down(i);
+	}
+
+	tcb->timeout_index = NO_TIMEOUT_INDEX;
+	tcb->wakeup_time = NO_TIMEOUT;
+
+	timeout_heap_update_deadline();
+}
+
+/*
+  Core affinity.
+
+  Each thread has a mask of the cores it may run on. It is only queued at
+  such a core (see sched_queue_target()), only taken from a queue by such a
+  core (see sched_queue_pop()), and a core stops running it once its 
+  affinity excludes the core (see sched_set_affinity()).
+
+  The reservations of boot_reserve_cores() are kept in sched_reservations
+  (see sched_reserve_cores()).
+*/
+static inline core_mask sched_valid_cores()
+{
+	uint ncores = cpu_cores();
+	return (ncores >= 32) ? ALL_CORES : (1u << ncores) - 1;
+}
+
+static inline int sched_allowed(TCB* tcb, uint core)
+{
+	return (tcb->affinity >> core) & 1;
+}
+
+void sched_reserve_cores(Task task, core_mask cores)
+{
+	cores &= sched_valid_cores();
+	if (cores == 0 || sched_reservation_count == MAX_CORES)
+		return;
+
+	sched_reservations[sched_reservation_count].task = task;
+	sched_reservations[sched_reservation_count].cores = cores;
+	sched_reservation_count++;
+
+	if (task == NULL && (sched_reserved & (1u << sched_interrupt_core)) == 0)
+		sched_interrupt_core = __builtin_ctz(cores);
+
+	sched_reserved |= cores;
+	sched_default_affinity = sched_valid_cores() & ~sched_reserved;
+	if (sched_default_affinity == 0)
+		sched_default_affinity = sched_valid_cores();
+}
+
+core_mask sched_task_affinity(Task task, core_mask inherited)
+{
+	core_mask mask = 0;
+	for (uint i = 0; i < sched_reservation_count; i++)
+		if (task != NULL && sched_reservations[i].task == task)
+			mask |= sched_reservations[i].cores;
+	return (mask != 0) ? mask : inherited;
+}
+
+uint sched_irq_core(TCB* tcb)
+{
+	if (tcb->affinity == sched_default_affinity || sched_allowed(tcb, sched_interrupt_core))
+		return sched_interrupt_core;
+	return __builtin_ctz(tcb->affinity);
+}
+
+/*
+  Select the core to queue a ready thread at, among the cores of its affinity.
+
+  An idle core is preferred, then the core with the shortest queue. On ties,
+  the core the thread last ran on is preferred (its cache may still be warm),
+  and then the current core. As in cpu_core_restart_one(), only cores backed 
+  by a host processor are considered, unless the affinity allows no such 
+  core; the rest only get threads by stealing.
+*/
+static CCB* sched_queue_target(TCB* tcb)
+{
+	uint ncores = cpu_cores();
+	uint nhosted = cpu_physical_cores();
+	core_mask allowed = tcb->affinity;
+	if (nhosted < ncores && (allowed & ((1u << nhosted) - 1)) != 0)
+		allowed &= (1u << nhosted) - 1;
+
+	uint best;
+	if ((allowed >> tcb->last_core) & 1)
+		best = tcb->last_core;
+	else if ((allowed >> cpu_core_id) & 1)
+		best = cpu_core_id;
+	else
+		best = __builtin_ctz(allowed);
+
+	for (uint i = 0; i < ncores; i++) {
+		uint c = (cpu_core_id + i) % ncores;
+		if (((allowed >> c) & 1) == 0)
+			continue;
+		int idle = cctx[c].current_priority == SCHED_LEVELS;
+		int best_idle = cctx[best].current_priority == SCHED_LEVELS;
+		if (idle > best_idle 
+			|| (idle == best_idle && cctx[c].ready_count < cctx[best].ready_count))
+			best = c;
 	}
+
+	return &cctx[best];
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the scheduler list of its level, at some core
+  (see sched_queue_target()). Then, mark the core for an ICI, if it is idle 
+  or it runs a thread of lower priority. The ICI is sent later, by
+  sched_send_icis(), when the caller has released its locks; else, the 
+  woken core would just spin on tcb->state_spinlock.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
+	CCB* ccb = sched_queue_target(tcb);
+
+	sched_boost_check(tcb);
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED, &tcb->sched_node);
+	Mutex_Lock(&ccb->ready_spinlock);
+	rlist_push_back(&ccb->ready_list[tcb->priority], &tcb->sched_node);
+	ccb->ready_count++;
+	tcb->ready_core = ccb->id;
+	Mutex_Unlock(&ccb->ready_spinlock);
+
+	/* Wake up or preempt the core */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint curprio = ccb->current_priority;
+	if (curprio == SCHED_LEVELS)
+		CURCORE.ici_mask |= 1u << ccb->id;
+	else if (tcb->priority < curprio) {
+		ccb->resched = 1;
+		CURCORE.ici_mask |= 1u << ccb->id;
+	}
+}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+/*
+  Send the ICIs marked by sched_queue_add().
+  Must be called with preemption off, after releasing the locks.
+*/
+static void sched_send_icis()
+{
+	uint mask = CURCORE.ici_mask;
+	CURCORE.ici_mask = 0;
+	for (uint c = 0; mask != 0; c++, mask >>= 1)
+		if (mask & 1)
+			cpu_ici(c);
 }
 
 /*
 	Adjust the state of a thread to make it READY.
+	The thread must not be in TIMEOUT_HEAP.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	assert(tcb->wakeup_time == NO_TIMEOUT);
 
 	/* Mark as ready */
 	tcb->state = READY;
+	tcb->ready_since = bios_clock();
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
@@ -300,70 +799,277 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
+  Pop from the \c TIMEOUT_HEAP the threads whose timeout has expired, and
   wake them up.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  A thread whose state_spinlock is held by someone else is left in the
+  heap, to be woken up by a later call (or by whoever holds the lock).
 */
-static void sched_wakeup_expired_timeouts()
+static void sched_wakeup_expired_timeouts(TimerDuration curtime)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	/* Empty the timeout heap up to the current time and wake up each thread */
+
+	/* Avoid the lock when nothing has expired */
+	if (timeout_deadline > curtime)
+		return;
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
+	Mutex_Lock(&timeout_spinlock);
+
+	while (timeout_heap_size > 0) {
+		TCB* tcb = TIMEOUT_HEAP[0];
 		if (tcb->wakeup_time > curtime)
 			break;
+		if (!Mutex_TryLock(&tcb->state_spinlock))
+			break;
+		sched_remove_timeout(tcb);
 		sched_make_ready(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
 	}
+
+	Mutex_Unlock(&timeout_spinlock);
+
+	sched_send_icis();
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Move all threads of a core's queue to level 0, if the core has
+  missed a boost.
+
+  *** MUST BE CALLED WITH ccb->ready_spinlock HELD ***
+*/
+static void sched_queue_boost(CCB* ccb)
+{
+	if (ccb->boost_epoch != sched_boost_epoch) {
+		ccb->boost_epoch = sched_boost_epoch;
+		for (uint level = 1; level < SCHED_LEVELS; level++)
+			rlist_append(&ccb->ready_list[0], &ccb->ready_list[level]);
+	}
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Remove the first thread allowed on the current core from the 
+  highest-priority non-empty scheduler list of a core, if any, and return it.
+  Only levels up to @c maxlevel are examined. Return NULL if there is no such
+  thread. Threads that may not run here are skipped; they are only found
+  at the head of a list of another core, when stealing.
+*/
+static TCB* sched_queue_pop(CCB* ccb, uint maxlevel)
+{
+	/* Do not bother locking an empty queue */
+	if (ccb->ready_count == 0)
+		return NULL;
+
+	TCB* tcb = NULL;
+
+	Mutex_Lock(&ccb->ready_spinlock);
+
+	sched_queue_boost(ccb);
+
+	for (uint level = 0; level <= maxlevel && tcb == NULL; level++) {
+		rlnode* list = &ccb->ready_list[level];
+		for (rlnode* p = list->next; p != list; p = p->next) {
+			if (sched_allowed(p->tcb, cpu_core_id)) {
+				tcb = rlist_remove(p)->tcb;
+				tcb->priority = level;
+				tcb->boost_epoch = ccb->boost_epoch;
+				ccb->ready_count--;
+				break;
+			}
+		}
+	}
+
+	Mutex_Unlock(&ccb->ready_spinlock);
+
+	return tcb;
+}
+
+/*
+  Steal a thread from the scheduler list of some other core, trying nearby
+  cores on the host first (see sched_init_steal_order()).
+  Return NULL if all lists are empty.
+*/
+static TCB* sched_queue_steal()
+{
+	uint ncores = cpu_cores();
+	uint* order = CURCORE.steal_order;
+
+	for (uint i = 0; i + 1 < ncores; i++) {
+		TCB* tcb = sched_queue_pop(&cctx[order[i]], SCHED_LEVELS - 1);
+		if (tcb != NULL)
+			return tcb;
+	}
+	return NULL;
+}
+
+/*
+  Order the other cores by their distance from core c on the host. Cores at the
+  same distance are visited round-robin, starting after c.
+*/
+static void sched_init_steal_order(uint c)
+{
+	uint ncores = cpu_cores();
+	uint n = 0;
+	for (int dist = 1; dist <= 3; dist++)
+		for (uint i = 1; i < ncores; i++) {
+			uint other = (c + i) % ncores;
+			if (cpu_core_distance(c, other) == dist)
+				cctx[c].steal_order[n++] = other;
+		}
+	assert(n + 1 == ncores);
+}
+
+/*
+  Select the next thread to run on the current core.
+
+  If the current thread is still READY (and may run on this core), it 
+  continues unless the local scheduler queue holds a thread of equal or 
+  higher priority.
+  Else, the highest-priority thread of the local queue is preferred. If the 
+  queue is empty, a thread is stolen from another core. If everything fails, 
+  the idle thread is returned.
 */
 static TCB* sched_queue_select(TCB* current)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED);
+	TCB* next_thread;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	int runnable = (current->state == READY && sched_allowed(current, cpu_core_id));
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	if (current->type != IDLE_THREAD && runnable) {
+		next_thread = sched_queue_pop(&CURCORE, current->priority);
+		if (next_thread == NULL)
+			next_thread = current;
+		return next_thread;
+	}
+
+	/* 
+	  Mark the core as idle before looking at the queue, so that a thread 
+	  queued concurrently is either found here, or the core gets an ICI
+	  (see sched_queue_add()).
+	*/
+	CURCORE.current_priority = SCHED_LEVELS;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	next_thread = sched_queue_pop(&CURCORE, SCHED_LEVELS - 1);
 
-	next_thread->its = QUANTUM;
+	if (next_thread == NULL) {
+		next_thread = sched_queue_steal();
+		if (next_thread != NULL)
+			CURCORE.steals++;
+	}
+
+	if (next_thread == NULL)
+		next_thread = runnable ? current : &CURCORE.idle_thread;
 
 	return next_thread;
 }
 
 /*
-  Make the process ready.
+  Make the threads ready.
  */
-int wakeup(TCB* tcb)
+int wakeup_many(TCB** tcbs, size_t n)
 {
-	int ret = 0;
+	int count = 0;
 
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	for (size_t i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+
+		/* To touch tcb->state, we must get the spinlock. */
+		Mutex_Lock(&tcb->state_spinlock);
+
+		if (tcb->state == STOPPED || tcb->state == INIT) {
+			/* Possibly remove from TIMEOUT_HEAP */
+			if (tcb->wakeup_time != NO_TIMEOUT) {
+				Mutex_Lock(&timeout_spinlock);
+				sched_remove_timeout(tcb);
+				Mutex_Unlock(&timeout_spinlock);
+			}
+			sched_make_ready(tcb);
+			TRACE(TRACE_WAKEUP, tcb, NULL, 0);
+			count++;
+		}
+		else
+			tcbs[i] = NULL;
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
+		Mutex_Unlock(&tcb->state_spinlock);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	sched_send_icis();
 
 	/* Restore preemption state */
 	if (oldpre)
 		preempt_on;
 
-	return ret;
+	return count;
+}
+
+/*
+  Make the process ready.
+ */
+int wakeup(TCB* tcb)
+{
+	return wakeup_many(&tcb, 1);
+}
+
+int sched_cancel_timeout(TCB* tcb)
+{
+	int oldpre = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	int stopped = (tcb->state == STOPPED);
+	if (stopped && tcb->wakeup_time != NO_TIMEOUT) {
+		Mutex_Lock(&timeout_spinlock);
+		sched_remove_timeout(tcb);
+		Mutex_Unlock(&timeout_spinlock);
+	}
+
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (oldpre)
+		preempt_on;
+	return stopped;
+}
+
+int sched_set_affinity(TCB* tcb, core_mask mask)
+{
+	mask &= sched_valid_cores();
+	if (mask == 0)
+		return -1;
+
+	int oldpre = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	if (tcb->state == READY && tcb->phase == CTX_CLEAN) {
+		/*
+		  The thread is queued, unless a core has just taken it. The affinity
+		  is changed under the queue lock, as sched_queue_pop() reads it.
+		*/
+		CCB* ccb = &cctx[tcb->ready_core];
+		Mutex_Lock(&ccb->ready_spinlock);
+		tcb->affinity = mask;
+		int requeue = (tcb->sched_node.next != &tcb->sched_node) && !sched_allowed(tcb, ccb->id);
+		if (requeue) {
+			rlist_remove(&tcb->sched_node);
+			ccb->ready_count--;
+		}
+		Mutex_Unlock(&ccb->ready_spinlock);
+		if (requeue)
+			sched_queue_add(tcb);
+	} else {
+		tcb->affinity = mask;
+		/* Preempt the thread (maybe the current one) off a core it may not run on */
+		if (tcb->state == RUNNING && !sched_allowed(tcb, tcb->last_core)) {
+			cctx[tcb->last_core].resched = 1;
+			CURCORE.ici_mask |= 1u << tcb->last_core;
+		}
+	}
+
+	Mutex_Unlock(&tcb->state_spinlock);
+	sched_send_icis();
+	if (oldpre)
+		preempt_on;
+	return 0;
 }
 
 /*
@@ -377,7 +1083,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	TRACE(TRACE_SLEEP, tcb, NULL, cause);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -390,8 +1097,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the state spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -405,7 +1112,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 void yield(enum SCHED_CAUSE cause)
 {
-	/* Reset the timer, so that we are not interrupted by ALARM */
+	/* Reset the timer, so that we are not interrupted by ALARM (this is cheap) */
 	TimerDuration remaining = bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
@@ -413,19 +1120,36 @@ void yield(enum SCHED_CAUSE cause)
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	TimerDuration curtime = bios_clock();
+
+	/* Account for the time-slice */
+	TimerDuration slice = curtime - current->run_since;
+	current->run_time += slice;
+	if (current->type != IDLE_THREAD)
+		CURCORE.busy_time += slice;
+
+	Mutex_Lock(&current->state_spinlock);
 
 	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
+	if (current->state == RUNNING) {
 		current->state = READY;
+		current->ready_since = curtime;
+	}
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
+	if (current->type != IDLE_THREAD)
+		sched_adjust_priority(current, cause);
+
+	Mutex_Unlock(&current->state_spinlock);
+
+	/* Periodically boost all threads to the highest level */
+	sched_boost_priorities(curtime);
 
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_wakeup_expired_timeouts(curtime);
 
 	/* Get next */
 	TCB* next = sched_queue_select(current);
@@ -434,10 +1158,13 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
-
 	/* Switch contexts */
 	if (current != next) {
+		current->switches[cause]++;
+		CURCORE.switches++;
+		if (cause == SCHED_MUTEX)
+			current->mutex_since = bios_fast_clock_nsec();
+		TRACE(TRACE_SWITCH_OUT, current, NULL, cause);
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -448,6 +1175,20 @@ void yield(enum SCHED_CAUSE cause)
 	gain(preempt);
 }
 
+/*
+  Set the timer of an idle core to fire at the nearest timeout, if any.
+*/
+static void sched_set_idle_timer()
+{
+	TimerDuration deadline = timeout_deadline;
+	if (deadline == NO_TIMEOUT) {
+		bios_cancel_timer();
+	} else {
+		TimerDuration curtime = bios_clock();
+		bios_set_timer((deadline > curtime) ? deadline - curtime : 1);
+	}
+}
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -462,42 +1203,64 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = cpu_core_id;
+	Mutex_Unlock(&current->state_spinlock);
+
+	/* Account for the time spent in the ready queue */
+	TimerDuration curtime = bios_clock();
+	if (current != CURCORE.previous_thread && current->type != IDLE_THREAD)
+		current->wait_time += curtime - current->ready_since;
+	current->run_since = curtime;
+
+	CURCORE.current_priority = (current->type == IDLE_THREAD) ? SCHED_LEVELS : current->priority;
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		TRACE(TRACE_SWITCH_IN, current, NULL, 0);
+		if (current->curr_cause == SCHED_MUTEX)
+			current->mutex_time += bios_fast_clock_nsec() - current->mutex_since;
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
-	}
+		Mutex_Unlock(&prev->state_spinlock);
+		sched_send_icis();
 
-	Mutex_Unlock(&sched_spinlock);
+		/* Nobody else may access an exited thread */
+		if (prev_state == EXITED)
+			release_TCB(prev);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* 
+	  Set a 1-quantum alarm. The idle thread does not need a quantum, 
+	  but it must wake up for the nearest timeout.
+	*/
+	if (current->type != IDLE_THREAD)
+		bios_set_timer(current->rts);
+	else
+		sched_set_idle_timer();
 }
 
 static void idle_thread()
@@ -517,12 +1280,34 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-	rlnode_init(&SCHED, NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	for (uint c = 0; c < MAX_CORES; c++) {
+		for (uint level = 0; level < SCHED_LEVELS; level++)
+			rlnode_init(&cctx[c].ready_list[level], NULL);
+		cctx[c].ready_count = 0;
+		cctx[c].ready_spinlock = MUTEX_INIT;
+		cctx[c].boost_epoch = sched_boost_epoch;
+		/* Keep the blocks cached by the previous boot */
+		thread_cache_drain(&cctx[c]);
+		cctx[c].id = c;
+		cctx[c].current_priority = SCHED_LEVELS;
+		cctx[c].resched = 0;
+		cctx[c].ici_mask = 0;
+		cctx[c].busy_time = 0;
+		cctx[c].switches = 0;
+		cctx[c].steals = 0;
+		sched_init_steal_order(c);
+	}
+	timeout_heap_size = 0;
+	timeout_deadline = NO_TIMEOUT;
+	sched_reservation_count = 0;
+	sched_reserved = 0;
+	sched_default_affinity = sched_valid_cores();
+	sched_interrupt_core = 0;
+	sched_next_boost = bios_clock() + SCHED_BOOST_PERIOD;
 }
 
 void run_scheduler()
@@ -535,10 +1320,13 @@ void run_scheduler()
 	curcore->current_thread = &curcore->idle_thread;
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
+	curcore->idle_thread.ptcb = NULL;
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.timeout_index = NO_TIMEOUT_INDEX;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -546,6 +1334,14 @@ void run_scheduler()
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.priority = SCHED_LEVELS - 1;
+	curcore->idle_thread.boost_epoch = sched_boost_epoch;
+	curcore->idle_thread.affinity = 1u << cpu_core_id;
+
+	curcore->idle_thread.run_since = bios_clock();
+	curcore->idle_thread.run_time = curcore->idle_thread.wait_time = 0;
+	memset(curcore->idle_thread.switches, 0, sizeof(curcore->idle_thread.switches));
+	curcore->idle_thread.mutex_time = 0;
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -560,3 +1356,69 @@ void run_scheduler()
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
+
+
+/* 
+  Scheduler statistics 
+*/
+
+_Static_assert(SCHED_PREEMPT + 1 == SWITCH_CAUSES, "SCHED_CAUSE must match switch_cause");
+
+void get_thread_stats(TCB* tcb, thread_stats* stats)
+{
+	stats->run_time = tcb->run_time;
+	stats->wait_time = tcb->wait_time;
+	stats->voluntary = 0;
+	stats->involuntary = 0;
+	for (int c = 0; c < SWITCH_CAUSES; c++) {
+		stats->switches[c] = tcb->switches[c];
+		if (c == SWITCH_QUANTUM || c == SWITCH_PREEMPT)
+			stats->involuntary += tcb->switches[c];
+		else
+			stats->voluntary += tcb->switches[c];
+	}
+
+	/* Add the current time-slice (the thread's core may be updating it) */
+	if (tcb->state == RUNNING) {
+		TimerDuration curtime = bios_clock(), since = tcb->run_since;
+		if (since != 0 && curtime > since)
+			stats->run_time += curtime - since;
+	}
+}
+
+
+int sys_GetCoreStats(unsigned int core, core_stats* stats)
+{
+	if (core >= cpu_cores())
+		return -1;
+
+	CCB* ccb = &cctx[core];
+	stats->idle_time = ccb->idle_thread.run_time;
+	stats->busy_time = ccb->busy_time;
+	stats->switches = ccb->switches;
+	stats->steals = ccb->steals;
+
+	/* Add the current time-slice of an idle core (the core may be updating it) */
+	if (ccb->current_thread == &ccb->idle_thread) {
+		TimerDuration curtime = bios_clock(), since = ccb->idle_thread.run_since;
+		if (curtime > since)
+			stats->idle_time += curtime - since;
+	}
+
+	return 0;
+}
+
+
+int sys_GetTime(time_clock clock, unsigned long* usec)
+{
+	switch (clock) {
+	case TIME_MONOTONIC:
+		*usec = bios_clock();
+		return 0;
+	case TIME_FAST:
+		*usec = bios_fast_clock();
+		return 0;
+	default:
+		return -1;
+	}
+}
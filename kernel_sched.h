@@ -57,8 +57,8 @@ typedef enum {
   The following **invariant** of the scheduler guarantees 
   correctness:  
 
-  > A TCB is in the scheduler
-  > queue, if and only if, its @c Thread_state is @c READY and the @c Thread_phase 
+  > A TCB is in the ready queue of some
+  > core, if and only if, its @c Thread_state is @c READY and the @c Thread_phase 
   > is @c CTX_CLEAN.
 
   @see Thread_state
@@ -79,16 +79,19 @@ typedef enum {
   @brief Designate different origins of scheduler invocation.
 
   This is used in the scheduler heuristics to determine how to
-  adjust the dynamic priority of the current thread.
+  adjust the dynamic priority of the current thread. The causes are
+  listed in the order of @c switch_cause, which is used to report them
+  to user space (see @c GetThreadStats()).
  */
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock parked the thread on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A thread of higher priority became ready */
 };
 
 /**
@@ -100,15 +103,19 @@ enum SCHED_CAUSE {
 typedef struct thread_control_block {
 
 	PCB* owner_pcb; /**< @brief This is null for a free TCB */
+	struct process_thread_control_block* ptcb; /**< @brief The process thread, or NULL for idle threads */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
 
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
+
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	size_t timeout_index; /**< @brief Position in the scheduler timeout heap, or @c NO_TIMEOUT_INDEX */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -117,6 +124,22 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	uint priority; /**< @brief The feedback queue level, 0 is the highest priority */
+	uint boost_epoch; /**< @brief The priority boost epoch seen last by this thread */
+	uint last_core; /**< @brief The core this thread last ran on */
+	core_mask affinity; /**< @brief The cores this thread may run on (see @c sched_set_affinity) */
+	uint ready_core; /**< @brief The core whose ready queue holds this thread, while it is queued */
+
+	TimerDuration run_since; /**< @brief The time this thread last started running */
+	TimerDuration ready_since; /**< @brief The time this thread last became ready */
+	TimerDuration run_time; /**< @brief The total time this thread has run */
+	TimerDuration wait_time; /**< @brief The total time this thread has waited in a ready queue */
+	unsigned long switches[SWITCH_CAUSES]; /**< @brief Context switches away from this thread, per cause */
+	uint64_t mutex_since; /**< @brief When the thread was last parked on a mutex, in nsec */
+	uint64_t mutex_time; /**< @brief The total time this thread has been parked on mutexes, in nsec */
+
+	int io_nonblock; /**< @brief Set during a non-blocking stream call (see @c FCB_try_io) */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -136,15 +159,69 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/**
+  @brief The number of free thread blocks cached by each core.
+
+  The memory of exited threads (TCB and stack) is recycled. Each core
+  caches up to this many blocks.
+ */
+#ifndef THREAD_CACHE_SIZE
+#define THREAD_CACHE_SIZE 16
+#endif
+
+/**
+  @brief The high-water mark of the global thread pool.
+
+  Free thread blocks that do not fit in a core's cache are kept in a 
+  global pool, of up to this many blocks. The rest are returned to the system.
+ */
+#ifndef THREAD_POOL_SIZE
+#define THREAD_POOL_SIZE 256
+#endif
+
+/** @brief Counters of the thread pool */
+typedef struct thread_pool_stats {
+	unsigned long hits;     /**< @brief Thread blocks taken from a core cache or the pool */
+	unsigned long misses;   /**< @brief Thread blocks newly allocated */
+	unsigned long released; /**< @brief Thread blocks returned to the system */
+} thread_pool_stats;
+
+/**
+  @brief Get the counters of the thread pool.
+ */
+void get_thread_pool_stats(thread_pool_stats* stats);
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/**
+  @brief Number of priority levels of the multilevel feedback queue.
+
+  Level 0 is the highest priority. A thread whose time-slice expires
+  drops one level and is given a longer quantum (see @c QUANTUM), and a 
+  thread that blocks on I/O or on a pipe rises one level.
+ */
+#define SCHED_LEVELS 4
+
+/**
+  @brief Priority boost period (in microseconds).
+
+  Every so often, all threads are moved back to level 0, so that
+  threads at lower levels do not starve.
+ */
+#define SCHED_BOOST_PERIOD (1000000L)
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core has its own ready queue, with one list per priority level.
+  Threads made ready are queued at an idle core, or else at the core with 
+  the shortest queue, and a core that runs out of ready threads steals from 
+  the queues of other cores before running its idle thread.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -153,6 +230,23 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	rlnode ready_list[SCHED_LEVELS]; /**< @brief The ready queue of this core, per level */
+	volatile uint ready_count; /**< @brief The total length of @c ready_list */
+	Mutex ready_spinlock; /**< @brief Protects @c ready_list and @c ready_count */
+	uint boost_epoch; /**< @brief The priority boost epoch of @c ready_list */
+
+	volatile uint current_priority; /**< @brief The level of the current thread, or @c SCHED_LEVELS when idle */
+	volatile int resched; /**< @brief Set by other cores to request preemption of the current thread */
+	uint ici_mask; /**< @brief The cores that this core must send an ICI to */
+
+	TimerDuration busy_time; /**< @brief The total time spent in threads other than the idle thread */
+	unsigned long switches; /**< @brief The number of context switches */
+	unsigned long steals; /**< @brief The number of threads stolen from other cores */
+	uint steal_order[MAX_CORES]; /**< @brief The other cores, nearest first, for stealing */
+
+	void* thread_cache; /**< @brief Free thread blocks cached by this core */
+	uint thread_cache_count; /**< @brief The length of @c thread_cache */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -185,6 +279,11 @@ TCB* cur_thread();
 */
 #define NO_TIMEOUT ((TimerDuration)-1)
 
+/**
+  @brief A heap index constant, denoting a thread not in the timeout heap.
+*/
+#define NO_TIMEOUT_INDEX ((size_t)-1)
+
 /**
 	@brief Create a new thread.
 
@@ -214,6 +313,32 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a number of blocked threads.
+
+  This call is equivalent to calling @c wakeup() for each thread of 
+  array @c tcbs, but it is cheaper: preemption is turned off once, and the 
+  cores that get new ready threads are sent a single ICI each, after all
+  the threads are queued. The entries of @c tcbs for threads that were
+  not blocked are set to NULL.
+
+  @param tcbs an array of threads to be made @c READY
+  @param n the size of @c tcbs
+  @returns the number of threads whose state was @c STOPPED or @c INIT
+*/
+int wakeup_many(TCB** tcbs, size_t n);
+
+/**
+  @brief Cancel the timeout of a blocked thread.
+
+  If the thread is @c STOPPED, its sleep timeout (if any) is cancelled, so 
+  that the thread can only be woken up by some explicit @c wakeup().
+
+  @param tcb the thread
+  @returns 1 if the thread state was @c STOPPED, 0 otherwise
+*/
+int sched_cancel_timeout(TCB* tcb);
+
 /** 
   @brief Block the current thread.
 
@@ -264,6 +389,14 @@ void yield(enum SCHED_CAUSE cause);
 */
 void run_scheduler(void);
 
+/**
+  @brief Get the scheduler counters of a thread.
+
+  The thread may be running on another core, in which case the counters may be 
+  slightly out of date. The caller must make sure that the TCB is not released.
+ */
+void get_thread_stats(TCB* tcb, thread_stats* stats);
+
 /**
   @brief Initialize the scheduler.
 
@@ -271,10 +404,54 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Change the cores a thread may run on.
+
+  The mask is restricted to the cores of the VM. A queued thread is moved
+  to a core of the new mask, and a thread running on some other core is
+  preempted, so that it moves at its next scheduling. If @c tcb is the
+  current thread, it moves before this call returns.
+
+  @param tcb the thread
+  @param mask the allowed cores
+  @returns 0 on success, -1 if @c mask contains no core of the VM
+ */
+int sched_set_affinity(TCB* tcb, core_mask mask);
+
+/**
+  @brief Reserve cores for the processes of a task.
+
+  This is called during kernel initialization, after @c initialize_scheduler(),
+  for each call of @c boot_reserve_cores(). The reserved cores are removed
+  from the affinity of threads that do not inherit it from a normal thread
+  (such as the init process). If @c task is NULL, the first of the cores
+  becomes the interrupt core (see @c sched_irq_core()).
+ */
+void sched_reserve_cores(Task task, core_mask cores);
+
+/**
+  @brief The affinity of the main thread of a new process.
+
+  This is the union of the reservations for @c task, if any, or else 
+  @c inherited.
+ */
+core_mask sched_task_affinity(Task task, core_mask inherited);
+
+/**
+  @brief The core that should handle the interrupts a thread waits for.
+
+  This is the interrupt core (core 0, unless @c sched_reserve_cores()
+  reserved one), unless @c tcb has a restricted affinity that excludes it,
+  in which case it is the first core of the affinity.
+ */
+uint sched_irq_core(TCB* tcb);
+
 /**
   @brief Quantum (in microseconds) 
 
   This is the default quantum for each thread, in microseconds.
+  This is the quantum of the highest priority level; the quantum
+  doubles at each lower level.
   */
 #define QUANTUM (10000L)
 
@@ -0,0 +1,139 @@
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "kernel_shm.h"
+#include "kernel_streams.h"
+
+
+/* A shared memory segment */
+typedef struct shm_segment {
+  void* addr;          /* The segment memory */
+  size_t mapped;       /* The size of the mapping, a multiple of the page size */
+  unsigned int size;   /* The size requested by ShmCreate */
+  uint refcount;       /* The FCB and the attachments */
+} shm_segment;
+
+
+/* An attachment of a segment by a process */
+typedef struct shm_attachment {
+  rlnode node;
+  shm_segment* seg;
+} shm_attachment;
+
+
+static void shm_decref(shm_segment* seg)
+{
+  if(__atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    CHECK(munmap(seg->addr, seg->mapped));
+    free(seg);
+  }
+}
+
+
+static int shm_close(void* obj)
+{
+  shm_decref(obj);
+  return 0;
+}
+
+
+/* A segment can only be attached; Read and Write fail. */
+static file_ops shm_ops = {
+  .Close = shm_close
+};
+
+
+Fid_t sys_ShmCreate(unsigned int size)
+{
+  if(size == 0 || size > SHM_MAX_SIZE)
+    return NOFILE;
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped = ((size + page - 1) / page) * page;
+  void* addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if(addr == MAP_FAILED)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb)) {
+    CHECK(munmap(addr, mapped));
+    return NOFILE;
+  }
+
+  shm_segment* seg = xmalloc(sizeof(shm_segment));
+  seg->addr = addr;
+  seg->mapped = mapped;
+  seg->size = size;
+  seg->refcount = 1;
+
+  fcb->streamobj = seg;
+  fcb->streamfunc = &shm_ops;
+  return fid;
+}
+
+
+void* sys_ShmAttach(Fid_t fid, unsigned int* size)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL)
+    return NULL;
+
+  if(fcb->streamfunc != &shm_ops) {
+    FCB_decref(fcb);
+    return NULL;
+  }
+
+  shm_segment* seg = fcb->streamobj;
+  __atomic_add_fetch(&seg->refcount, 1, __ATOMIC_RELAXED);
+  FCB_decref(fcb);
+
+  shm_attachment* att = xmalloc(sizeof(shm_attachment));
+  rlnode_init(&att->node, att);
+  att->seg = seg;
+
+  PCB* pcb = CURPROC;
+  Mutex_Lock(&pcb->FIDT_mutex);
+  rlist_push_back(&pcb->shm_list, &att->node);
+  Mutex_Unlock(&pcb->FIDT_mutex);
+
+  if(size) *size = seg->size;
+  return seg->addr;
+}
+
+
+int sys_ShmDetach(void* addr)
+{
+  PCB* pcb = CURPROC;
+  shm_attachment* att = NULL;
+
+  Mutex_Lock(&pcb->FIDT_mutex);
+  for(rlnode* p = pcb->shm_list.next; p != &pcb->shm_list; p = p->next) {
+    shm_attachment* a = p->obj;
+    if(a->seg->addr == addr) {
+      att = a;
+      rlist_remove(p);
+      break;
+    }
+  }
+  Mutex_Unlock(&pcb->FIDT_mutex);
+
+  if(att == NULL)
+    return -1;
+
+  shm_decref(att->seg);
+  free(att);
+  return 0;
+}
+
+
+void shm_detach_all(PCB* pcb)
+{
+  /* No other thread of the process is running */
+  while(! is_rlist_empty(&pcb->shm_list)) {
+    shm_attachment* att = rlist_pop_front(&pcb->shm_list)->obj;
+    shm_decref(att->seg);
+    free(att);
+  }
+}
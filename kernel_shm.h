@@ -0,0 +1,36 @@
+#ifndef __KERNEL_SHM_H
+#define __KERNEL_SHM_H
+
+/**
+  @file kernel_shm.h
+  @brief Shared memory segments.
+
+  @defgroup shm Shared memory
+  @ingroup kernel
+  @brief Shared memory segments.
+
+  A shared memory segment is a stream object, created by @c ShmCreate().
+  Its memory is allocated with @c mmap, so that it is page-aligned and
+  zero-filled. Since all processes run in the same address space, a
+  segment is attached by simply handing out its address.
+
+  A segment is reference counted: its FCB holds one reference, and each
+  attachment holds another. The attachments of a process are kept in a
+  list of its PCB, protected by @c FIDT_mutex, and are dropped when the
+  process exits.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_proc.h"
+
+
+/**
+  @brief Detach all the segments attached by an exiting process.
+ */
+void shm_detach_all(PCB* pcb);
+
+/** @} */
+
+#endif
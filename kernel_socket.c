@@ -1,32 +1,446 @@
 
 #include "tinyos.h"
+#include "kernel_socket.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
 
 
+/*
+  The listener of each port, or NULL. Protected by port_mutex.
+ */
+static socket_cb* port_table[MAX_PORT+1];
+static Mutex port_mutex = MUTEX_INIT;
+
+
+void initialize_sockets()
+{
+  port_mutex = MUTEX_INIT;
+  for(int p=0; p<=MAX_PORT; p++)
+    port_table[p] = NULL;
+}
+
+
+/*
+  A connection request, queued at a listener by Connect().
+  It lives on the stack of the connecting thread.
+ */
+typedef struct connection_request {
+  int admitted;           /* 1 when connected, -1 when refused */
+  socket_cb* peer;        /* the connecting socket */
+  CondVar connected_cv;   /* signalled when admitted changes */
+  rlnode queue_node;      /* node in the listener queue */
+} connection_request;
+
+
+static socket_cb* socket_create(port_t port)
+{
+  socket_cb* scb = xmalloc(sizeof(socket_cb));
+  scb->refcount = 1;
+  scb->type = SOCKET_UNBOUND;
+  scb->port = port;
+  scb->closed = 0;
+  scb->mx = MUTEX_INIT;
+  return scb;
+}
+
+
+static void socket_incref(socket_cb* scb)
+{
+  __atomic_add_fetch(&scb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+static void socket_decref(socket_cb* scb)
+{
+  if(__atomic_sub_fetch(&scb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    free(scb);
+}
+
+
+/* Make an unbound socket one end of a connection */
+static void socket_connect_peer(socket_cb* scb, pipe_cb* rx, pipe_cb* tx)
+{
+  scb->peer.rx = rx;
+  scb->peer.tx = tx;
+  scb->peer.rx_shut = 0;
+  scb->peer.tx_shut = 0;
+  __atomic_store_n(&scb->type, SOCKET_PEER, __ATOMIC_RELEASE);
+}
+
+
+/* Return the socket of a fid, with a reference to its FCB, or NULL. */
+static socket_cb* get_socket(Fid_t sock, FCB** fcb)
+{
+  *fcb = get_fcb(sock);
+  if(*fcb == NULL) return NULL;
+  if((*fcb)->streamfunc != &socket_ops) {
+    FCB_decref(*fcb);
+    return NULL;
+  }
+  return (socket_cb*) (*fcb)->streamobj;
+}
+
+
+/* Return the peer part of a socket, or NULL if it is not connected */
+static inline peer_socket* socket_peer(void* this)
+{
+  socket_cb* scb = this;
+  if(__atomic_load_n(&scb->type, __ATOMIC_ACQUIRE) != SOCKET_PEER)
+    return NULL;
+  return &scb->peer;
+}
+
+
+/*
+  Stream operations
+ */
+
+static int socket_read(void* this, char* buf, unsigned int size)
+{
+  peer_socket* peer = socket_peer(this);
+  if(peer == NULL || peer->rx_shut) return -1;
+  return pipe_read(peer->rx, buf, size);
+}
+
+
+static int socket_write(void* this, const char* buf, unsigned int size)
+{
+  peer_socket* peer = socket_peer(this);
+  if(peer == NULL || peer->tx_shut) return -1;
+  return pipe_write(peer->tx, buf, size);
+}
+
+
+static int socket_readv(void* this, const iovec_t* iov, unsigned int iovcnt)
+{
+  peer_socket* peer = socket_peer(this);
+  if(peer == NULL || peer->rx_shut) return -1;
+  return pipe_readv(peer->rx, iov, iovcnt);
+}
+
+
+static int socket_writev(void* this, const iovec_t* iov, unsigned int iovcnt)
+{
+  peer_socket* peer = socket_peer(this);
+  if(peer == NULL || peer->tx_shut) return -1;
+  return pipe_writev(peer->tx, iov, iovcnt);
+}
+
+
+static int socket_splice(void* this, stream_sink sink, void* sinkobj,
+  unsigned int size, int consume)
+{
+  peer_socket* peer = socket_peer(this);
+  if(peer == NULL || peer->rx_shut) return -1;
+  return pipe_splice(peer->rx, sink, sinkobj, size, consume);
+}
+
+
+static int socket_poll(void* this, poll_table* pt)
+{
+  socket_cb* scb = this;
+  int events = 0;
+
+  switch(__atomic_load_n(&scb->type, __ATOMIC_ACQUIRE)) {
+  case SOCKET_LISTENER:
+    poll_wait(pt, &scb->listener.pollq);
+    if(__atomic_load_n(&scb->listener.backlog, __ATOMIC_ACQUIRE) > 0
+        || __atomic_load_n(&scb->closed, __ATOMIC_ACQUIRE))
+      events |= POLL_READ;
+    break;
+
+  case SOCKET_PEER:
+    events |= scb->peer.rx_shut ? (POLL_READ|POLL_ERROR) : pipe_reader_poll(scb->peer.rx, pt);
+    /* A peer that stopped reading is reported as a hangup */
+    events |= scb->peer.tx_shut ? (POLL_WRITE|POLL_ERROR) 
+      : (pipe_writer_poll(scb->peer.tx, pt) & ~POLL_ERROR);
+    break;
+
+  default:
+    /* Unconnected sockets cannot be read or written */
+    events |= POLL_ERROR;
+  }
+  return events;
+}
+
+
+/* Refuse all pending connections of a listener. Called with scb->mx held. */
+static void listener_close(socket_cb* scb)
+{
+  listener_socket* ls = &scb->listener;
+  scb->closed = 1;
+  while(! is_rlist_empty(&ls->queue)) {
+    connection_request* req = rlist_pop_front(&ls->queue)->obj;
+    req->admitted = -1;
+    kernel_signal(&req->connected_cv);
+  }
+  ls->backlog = 0;
+  kernel_broadcast(&ls->req_available);
+  kernel_broadcast(&ls->queue_space);
+  poll_queue_notify(&ls->pollq);
+}
+
+
+static int socket_close(void* this)
+{
+  socket_cb* scb = this;
+
+  switch(scb->type) {
+  case SOCKET_LISTENER:
+    Mutex_Lock(&port_mutex);
+    assert(port_table[scb->port] == scb);
+    port_table[scb->port] = NULL;
+    Mutex_Unlock(&port_mutex);
+
+    Mutex_Lock(&scb->mx);
+    listener_close(scb);
+    Mutex_Unlock(&scb->mx);
+    break;
+
+  case SOCKET_PEER:
+    pipe_reader_close(scb->peer.rx);
+    pipe_writer_close(scb->peer.tx);
+    break;
+
+  default:
+    break;
+  }
+
+  socket_decref(scb);
+  return 0;
+}
+
+
+file_ops socket_ops = {
+  .Open = NULL,
+  .Read = socket_read,
+  .Write = socket_write,
+  .Close = socket_close,
+  .Splice = socket_splice,
+  .ReadV = socket_readv,
+  .WriteV = socket_writev,
+  .Poll = socket_poll
+};
+
+
+
+/*
+  System calls
+ */
+
 Fid_t sys_Socket(port_t port)
 {
-	return NOFILE;
+  if(port < NOPORT || port > MAX_PORT)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  fcb->streamobj = socket_create(port);
+  fcb->streamfunc = &socket_ops;
+  return fid;
 }
 
+
 int sys_Listen(Fid_t sock)
 {
-	return -1;
+  FCB* fcb;
+  socket_cb* scb = get_socket(sock, &fcb);
+  if(scb == NULL) return -1;
+
+  int retcode = -1;
+
+  Mutex_Lock(&port_mutex);
+  if(scb->type == SOCKET_UNBOUND && scb->port != NOPORT
+      && port_table[scb->port] == NULL) {
+    listener_socket* ls = &scb->listener;
+    rlnode_init(&ls->queue, NULL);
+    ls->backlog = 0;
+    ls->req_available = COND_INIT;
+    ls->queue_space = COND_INIT;
+    poll_queue_init(&ls->pollq);
+    scb->type = SOCKET_LISTENER;
+    port_table[scb->port] = scb;
+    retcode = 0;
+  }
+  Mutex_Unlock(&port_mutex);
+
+  FCB_decref(fcb);
+  return retcode;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	return NOFILE;
+  FCB* lfcb;
+  socket_cb* lscb = get_socket(lsock, &lfcb);
+  if(lscb == NULL) return NOFILE;
+
+  Fid_t fid = NOFILE;
+  FCB* fcb;
+
+  if(lscb->type != SOCKET_LISTENER) {
+    FCB_decref(lfcb);
+    return NOFILE;
+  }
+
+  /* 
+    Hold the socket, but not its FCB, so that closing the listening
+    socket wakes us up.
+   */
+  socket_incref(lscb);
+  FCB_decref(lfcb);
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    goto finish;
+
+  /* The new socket is unbound until it is connected */
+  socket_cb* scb = socket_create(lscb->port);
+  fcb->streamobj = scb;
+  fcb->streamfunc = &socket_ops;
+
+  listener_socket* ls = &lscb->listener;
+  Mutex_Lock(&lscb->mx);
+
+  while(! lscb->closed && is_rlist_empty(&ls->queue))
+    kernel_wait(&lscb->mx, &ls->req_available, SCHED_PIPE);
+
+  if(lscb->closed) {
+    Mutex_Unlock(&lscb->mx);
+    FCB_unreserve(1, &fid, &fcb);
+    socket_decref(scb);
+    fid = NOFILE;
+    goto finish;
+  }
+
+  connection_request* req = rlist_pop_front(&ls->queue)->obj;
+  if(ls->backlog-- == SOCKET_BACKLOG)
+    kernel_signal(&ls->queue_space);
+
+  /*
+    Connectors only signal when the queue becomes non-empty, so pass the
+    wakeup on to the next acceptor when more requests are pending.
+   */
+  if(ls->backlog > 0)
+    kernel_signal(&ls->req_available);
+
+  /* Connect the two peers by a pair of pipes */
+  pipe_cb* p1 = pipe_create(PIPE_BUFFER_SIZE);
+  pipe_cb* p2 = pipe_create(PIPE_BUFFER_SIZE);
+  socket_connect_peer(scb, p1, p2);
+  socket_connect_peer(req->peer, p2, p1);
+
+  req->admitted = 1;
+  kernel_signal(&req->connected_cv);
+  Mutex_Unlock(&lscb->mx);
+
+finish:
+  socket_decref(lscb);
+  return fid;
 }
 
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	return -1;
+  if(port <= NOPORT || port > MAX_PORT)
+    return -1;
+
+  FCB* fcb;
+  socket_cb* scb = get_socket(sock, &fcb);
+  if(scb == NULL) return -1;
+
+  int retcode = -1;
+  if(scb->type != SOCKET_UNBOUND) goto finish;
+
+  /* Find the listener, and keep it alive while we are connecting */
+  Mutex_Lock(&port_mutex);
+  socket_cb* lscb = port_table[port];
+  if(lscb) socket_incref(lscb);
+  Mutex_Unlock(&port_mutex);
+
+  if(lscb == NULL) goto finish;
+
+  TimerDuration deadline = NO_TIMEOUT;
+  if((long)timeout >= 0)
+    deadline = bios_clock() + timeout*1000ul;
+
+  listener_socket* ls = &lscb->listener;
+  connection_request req;
+  req.admitted = 0;
+  req.peer = scb;
+  req.connected_cv = COND_INIT;
+  rlnode_init(&req.queue_node, &req);
+
+  Mutex_Lock(&lscb->mx);
+
+  /* Wait for space in the backlog */
+  while(! lscb->closed && ls->backlog >= SOCKET_BACKLOG) {
+    TimerDuration now = bios_clock();
+    if(deadline != NO_TIMEOUT && now >= deadline) break;
+    kernel_timedwait(&lscb->mx, &ls->queue_space, SCHED_PIPE,
+      (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+  }
+
+  if(! lscb->closed && ls->backlog < SOCKET_BACKLOG) {
+    rlist_push_back(&ls->queue, &req.queue_node);
+    if(ls->backlog++ == 0) {
+      kernel_signal(&ls->req_available);
+      poll_queue_notify(&ls->pollq);
+    }
+
+    while(req.admitted == 0) {
+      TimerDuration now = bios_clock();
+      if(deadline != NO_TIMEOUT && now >= deadline) break;
+      kernel_timedwait(&lscb->mx, &req.connected_cv, SCHED_PIPE,
+        (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+    }
+
+    if(req.admitted == 0) {
+      /* Timed out, withdraw the request */
+      rlist_remove(&req.queue_node);
+      if(ls->backlog-- == SOCKET_BACKLOG)
+        kernel_signal(&ls->queue_space);
+    }
+    else if(req.admitted > 0)
+      retcode = 0;
+  }
+
+  Mutex_Unlock(&lscb->mx);
+  socket_decref(lscb);
+
+finish:
+  FCB_decref(fcb);
+  return retcode;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
-	return -1;
-}
+  if(how < SHUTDOWN_READ || how > SHUTDOWN_BOTH)
+    return -1;
 
+  FCB* fcb;
+  socket_cb* scb = get_socket(sock, &fcb);
+  if(scb == NULL) return -1;
+
+  int retcode = -1;
+  peer_socket* peer = socket_peer(scb);
+  if(peer) {
+    Mutex_Lock(&scb->mx);
+    if((how & SHUTDOWN_READ) && ! peer->rx_shut) {
+      peer->rx_shut = 1;
+      pipe_reader_shutdown(peer->rx);
+    }
+    if((how & SHUTDOWN_WRITE) && ! peer->tx_shut) {
+      peer->tx_shut = 1;
+      pipe_writer_shutdown(peer->tx);
+    }
+    Mutex_Unlock(&scb->mx);
+    retcode = 0;
+  }
+
+  FCB_decref(fcb);
+  return retcode;
+}
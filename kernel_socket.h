@@ -0,0 +1,90 @@
+#ifndef __KERNEL_SOCKET_H
+#define __KERNEL_SOCKET_H
+
+/**
+  @file kernel_socket.h
+  @brief Local sockets.
+
+  @defgroup sockets Sockets
+  @ingroup kernel
+  @brief Local sockets.
+
+  A socket starts out unbound. It becomes either a listener, by
+  @c Listen(), or one peer of a connection, by @c Connect() or
+  @c Accept(). Listeners are found through a table indexed directly by
+  port. Each listener keeps a bounded queue of pending connection
+  requests.
+
+  The two peers of a connection communicate through a pair of pipes,
+  one for each direction (see @ref pipes).
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_cc.h"
+#include "kernel_pipe.h"
+
+
+/** @brief The maximum number of pending connection requests of a listener. */
+#define SOCKET_BACKLOG 64
+
+
+/** @brief The type of a socket. */
+typedef enum {
+  SOCKET_UNBOUND,   /**< @brief A new socket */
+  SOCKET_LISTENER,  /**< @brief A socket initialized by @c Listen() */
+  SOCKET_PEER       /**< @brief A connected socket */
+} socket_type;
+
+
+/** @brief The listener part of a socket. */
+typedef struct listener_socket {
+  rlnode queue;           /**< @brief Pending connection requests */
+  uint backlog;           /**< @brief The length of @c queue */
+  CondVar req_available;  /**< @brief Signalled when @c queue becomes non-empty */
+  CondVar queue_space;    /**< @brief Signalled when @c queue becomes non-full */
+  poll_queue pollq;       /**< @brief Threads polling for connection requests */
+} listener_socket;
+
+
+/** @brief The peer part of a socket. */
+typedef struct peer_socket {
+  pipe_cb* rx;            /**< @brief The pipe we read from */
+  pipe_cb* tx;            /**< @brief The pipe we write to */
+  int rx_shut;            /**< @brief The read direction is shut down */
+  int tx_shut;            /**< @brief The write direction is shut down */
+} peer_socket;
+
+
+/** @brief The socket control block. */
+typedef struct socket_control_block {
+  int refcount;           /**< @brief The FCB, plus any thread connecting to it */
+  socket_type type;       /**< @brief The type of the socket */
+  port_t port;            /**< @brief The port the socket is bound to */
+  int closed;             /**< @brief A listener that has been closed */
+
+  Mutex mx;               /**< @brief Protects the listener queue and shutdowns */
+
+  union {
+    listener_socket listener;
+    peer_socket peer;
+  };
+} socket_cb;
+
+
+/** @brief Stream operations of sockets. */
+extern file_ops socket_ops;
+
+
+/**
+  @brief Initialization for sockets.
+
+  This function is called at kernel startup.
+ */
+void initialize_sockets();
+
+/** @} */
+
+#endif
@@ -1,4 +1,5 @@
 
+#include <string.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
@@ -8,52 +9,84 @@
 
 #define MAX_FILES MAX_PROC
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+/* The number of FCBs in each chunk of FT */
+#define FT_CHUNK 256
+
+/* 
+  The file table. As the process table, it is allocated in chunks 
+  on first use, and the chunks are kept from one boot to the next.
+ */
+static FCB* FT[MAX_FILES/FT_CHUNK];
+
+/* FCBs with index < ft_top have been handed out since boot */
+static uint ft_top;
+
+/* A stack of the free FCBs below ft_top */
+static FCB* ft_free[MAX_FILES];
+static uint ft_free_count;
+
+/* 
+  Protects FT, ft_top and ft_free. The reference counts are updated atomically.
+  When both are needed, a FIDT_mutex is locked before FT_mutex.
+ */
+static Mutex FT_mutex = MUTEX_INIT;
 
 
 void initialize_files()
 {
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
-
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
-  }
+  FT_mutex = MUTEX_INIT;
+  ft_top = 0;
+  ft_free_count = 0;
 }
 
 
-FCB* acquire_FCB()
+/*
+  Must be called with FT_mutex held
+*/
+static FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
+  FCB* fcb;
+  if(ft_free_count > 0)
+    fcb = ft_free[--ft_free_count];
+  else if(ft_top < MAX_FILES) {
+    uint i = ft_top++;
+    if(FT[i/FT_CHUNK] == NULL)
+      FT[i/FT_CHUNK] = xmalloc(FT_CHUNK*sizeof(FCB));
+    fcb = &FT[i/FT_CHUNK][i%FT_CHUNK];
   }
   else
     return NULL;
+
+  fcb->refcount = 0;
+  return fcb;
 }
 
-void release_FCB(FCB* fcb)
+/*
+  Must be called with FT_mutex held
+*/
+static void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  ft_free[ft_free_count++] = fcb;
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_fetch_add(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  int last = (__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL) == 0);
+
+  if(last) {
+    /* Nobody else can reach the FCB now, close it without the lock */
     int retval = fcb->streamfunc->Close(fcb->streamobj);
+    Mutex_Lock(&FT_mutex);
     release_FCB(fcb);
+    Mutex_Unlock(&FT_mutex);
     return retval;
   }
   else
@@ -62,21 +95,174 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+ *
+ *   Fileid tables
+ *
+ */
+
+/* Store fcb (possibly NULL) in slot fid. Must be called with FIDT_mutex held. */
+static inline void fidt_set(PCB* pcb, Fid_t fid, FCB* fcb)
+{
+  pcb->FIDT[fid] = fcb;
+  if(fcb)
+    pcb->FIDT_used[fid/64] |= 1ull << (fid%64);
+  else
+    pcb->FIDT_used[fid/64] &= ~(1ull << (fid%64));
+}
+
+/* The lowest free fid >= from, or FIDT_size if there is none */
+static uint fidt_lowest_free(PCB* pcb, uint from)
+{
+  for(uint w = from/64; w < FIDT_WORDS(pcb->FIDT_size); w++) {
+    uint64_t avail = ~pcb->FIDT_used[w];
+    if(w == from/64) 
+      avail &= ~0ull << (from%64);
+    if(avail) {
+      uint f = w*64 + __builtin_ctzll(avail);
+      return (f < pcb->FIDT_size) ? f : pcb->FIDT_size;
+    }
+  }
+  return pcb->FIDT_size;
+}
+
+/* 
+  Grow the table, by doubling, to at least size slots. 
+  Return 0 if this exceeds MAX_FILEID_LIMIT.
+ */
+static int fidt_grow(PCB* pcb, uint size)
+{
+  uint oldsize = pcb->FIDT_size;
+  if(size <= oldsize) return 1;
+  if(size > MAX_FILEID_LIMIT) return 0;
+
+  uint n = oldsize;
+  while(n < size) n *= 2;
+  if(n > MAX_FILEID_LIMIT) n = MAX_FILEID_LIMIT;
+
+  /* The table and its bitmap are a single block */
+  FCB** table = xmalloc(n*sizeof(FCB*) + FIDT_WORDS(n)*sizeof(uint64_t));
+  uint64_t* used = (uint64_t*) (table + n);
+  memcpy(table, pcb->FIDT, oldsize*sizeof(FCB*));
+  memset(table+oldsize, 0, (n-oldsize)*sizeof(FCB*));
+  memcpy(used, pcb->FIDT_used, FIDT_WORDS(oldsize)*sizeof(uint64_t));
+  memset(used+FIDT_WORDS(oldsize), 0, (FIDT_WORDS(n)-FIDT_WORDS(oldsize))*sizeof(uint64_t));
+
+  if(pcb->FIDT != pcb->FIDT_local)
+    free(pcb->FIDT);
+  pcb->FIDT = table;
+  pcb->FIDT_used = used;
+  pcb->FIDT_size = n;
+  return 1;
+}
+
+
+void FIDT_init(PCB* pcb)
+{
+  pcb->FIDT = pcb->FIDT_local;
+  pcb->FIDT_used = pcb->FIDT_local_used;
+  pcb->FIDT_size = MAX_FILEID;
+  memset(pcb->FIDT_local, 0, sizeof(pcb->FIDT_local));
+  memset(pcb->FIDT_local_used, 0, sizeof(pcb->FIDT_local_used));
+}
+
+
+/* Apply a Spawn action to a table, without touching reference counts */
+static int fidt_apply(PCB* pcb, const fd_action* act)
+{
+  if(act->fid < 0 || (uint)act->fid >= pcb->FIDT_size)
+    return 0;
+
+  switch(act->op) {
+  case SPAWN_DUP2:
+    if(pcb->FIDT[act->fid] == NULL || act->newfid < 0 
+      || !fidt_grow(pcb, act->newfid+1))
+      return 0;
+    fidt_set(pcb, act->newfid, pcb->FIDT[act->fid]);
+    return 1;
+  case SPAWN_CLOSE:
+    fidt_set(pcb, act->fid, NULL);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+int FIDT_inherit(PCB* newproc, PCB* proc, const fd_action* actions, uint n)
+{
+  int ok = 1;
+
+  Mutex_Lock(&proc->FIDT_mutex);
+  ok = fidt_grow(newproc, proc->FIDT_size);
+  assert(ok);
+  memcpy(newproc->FIDT, proc->FIDT, proc->FIDT_size*sizeof(FCB*));
+  memcpy(newproc->FIDT_used, proc->FIDT_used, FIDT_WORDS(proc->FIDT_size)*sizeof(uint64_t));
+
+  for(uint i=0; ok && i<n; i++)
+    ok = fidt_apply(newproc, &actions[i]);
+
+  if(ok) {
+    /* Take references for the final table only */
+    for(uint w=0; w<FIDT_WORDS(newproc->FIDT_size); w++)
+      for(uint64_t used = newproc->FIDT_used[w]; used; used &= used-1)
+        FCB_incref(newproc->FIDT[w*64 + __builtin_ctzll(used)]);
+  }
+  Mutex_Unlock(&proc->FIDT_mutex);
+
+  if(! ok) {
+    if(newproc->FIDT != newproc->FIDT_local)
+      free(newproc->FIDT);
+    FIDT_init(newproc);
+  }
+
+  return ok ? 0 : -1;
+}
+
+
+void FIDT_close_all(PCB* pcb)
+{
+  FCB* local[MAX_FILEID];
+
+  /* Detach the table, then close the streams without holding FIDT_mutex */
+  Mutex_Lock(&pcb->FIDT_mutex);
+  FCB** table = pcb->FIDT;
+  uint size = pcb->FIDT_size;
+  if(table == pcb->FIDT_local) {
+    memcpy(local, table, sizeof(local));
+    table = local;
+  }
+  FIDT_init(pcb);
+  Mutex_Unlock(&pcb->FIDT_mutex);
+
+  for(uint i=0; i<size; i++)
+    if(table[i] != NULL)
+      FCB_decref(table[i]);
+
+  if(table != local)
+    free(table);
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
+    uint f=0;
     uint i;
+    int ok = 0;
 
-    /* Find distinct fids */
+    Mutex_Lock(&cur->FIDT_mutex);
+
+    /* Find distinct fids, growing the table as needed */
     for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
+	f = fidt_lowest_free(cur, f);
+	if(f==cur->FIDT_size && !fidt_grow(cur, f+1)) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
+    Mutex_Lock(&FT_mutex);
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
 	    break;
@@ -86,14 +272,20 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	Mutex_Unlock(&FT_mutex);
+	goto finish;
     }
+    Mutex_Unlock(&FT_mutex);
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount = 1;
+	fidt_set(cur, fid[i], fcb[i]);
     }
-    return 1;
+    ok = 1;
+
+finish:
+    Mutex_Unlock(&cur->FIDT_mutex);
+    return ok;
 }
 
 
@@ -101,11 +293,15 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->FIDT_mutex);
+    Mutex_Lock(&FT_mutex);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	fidt_set(cur, fid[i], NULL);
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&FT_mutex);
+    Mutex_Unlock(&cur->FIDT_mutex);
 }
 
 
@@ -122,9 +318,34 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  if(fid < 0 || fid >= MAX_FILEID_LIMIT) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->FIDT_mutex);
+  FCB* fcb = ((uint)fid < cur->FIDT_size) ? cur->FIDT[fid] : NULL;
+  if(fcb)
+    FCB_incref(fcb);
+  Mutex_Unlock(&cur->FIDT_mutex);
 
-  return CURPROC->FIDT[fid];
+  return fcb;
+}
+
+
+void get_fcbs(size_t num, const Fid_t* fid, const int* detach, FCB** fcb)
+{
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->FIDT_mutex);
+  for(size_t i=0; i<num; i++) {
+    Fid_t f = fid[i];
+    fcb[i] = (f >= 0 && (uint)f < cur->FIDT_size) ? cur->FIDT[f] : NULL;
+    if(fcb[i] == NULL) continue;
+
+    if(detach[i])
+      fidt_set(cur, f, NULL);   /* The caller gets the reference of the table */
+    else
+      FCB_incref(fcb[i]);
+  }
+  Mutex_Unlock(&cur->FIDT_mutex);
 }
 
 
@@ -135,16 +356,14 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream. The reference taken by get_fcb() 
+     makes sure that the stream will not be closed (by another thread) 
+     while we are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,9 +371,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -167,7 +383,7 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream (and a reference to it) */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
@@ -175,11 +391,6 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -193,52 +404,433 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
-int sys_Close(int fd)
+/*
+  Vectored I/O for streams without a native ReadV/WriteV method: 
+  transfer each buffer in turn, and stop at the first short transfer.
+ */
+static int iov_fallback(FCB* fcb, const iovec_t* iov, unsigned int iovcnt, int write)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  int total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = write 
+      ? fcb->streamfunc->Write(fcb->streamobj, iov[i].base, iov[i].len)
+      : fcb->streamfunc->Read(fcb->streamobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (total > 0) ? total : -1;
+    total += rc;
+    if((unsigned int)rc < iov[i].len) break;
+  }
+  return total;
+}
+
 
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC || (iovcnt > 0 && iov == NULL))
+    return -1;
+
+  int retcode = -1;
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    file_ops* ops = fcb->streamfunc;
+    if(ops->ReadV)
+      retcode = ops->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(ops->Read)
+      retcode = iov_fallback(fcb, iov, iovcnt, 0);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC || (iovcnt > 0 && iov == NULL))
+    return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    if(ops->WriteV)
+      retcode = ops->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(ops->Write)
+      retcode = iov_fallback(fcb, iov, iovcnt, 1);
+
+    FCB_decref(fcb);
   }
 
   return retcode;
 }
 
 
+/*
+ *
+ *   Polling
+ *
+ */
+
+/* A registration of a poll table on a poll queue */
+typedef struct poll_entry
+{
+  rlnode queue_node;    /* in q->entries */
+  rlnode table_node;    /* in pt->entries */
+  poll_queue* queue;
+  poll_table* table;
+} poll_entry;
+
+
+void poll_queue_init(poll_queue* q)
+{
+  q->lock = MUTEX_INIT;
+  rlnode_init(&q->entries, NULL);
+  q->count = 0;
+}
+
+
+void poll_wait(poll_table* pt, poll_queue* q)
+{
+  if(pt == NULL) return;
+
+  poll_entry* e = xmalloc(sizeof(poll_entry));
+  rlnode_init(&e->queue_node, e);
+  rlnode_init(&e->table_node, e);
+  e->queue = q;
+  e->table = pt;
+  rlist_push_back(&pt->entries, &e->table_node);
+
+  int pre = preempt_off;
+  Mutex_Lock(&q->lock);
+  rlist_push_back(&q->entries, &e->queue_node);
+  /* Seq-cst, so that the stream's state is checked after this */
+  __atomic_add_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+  Mutex_Unlock(&q->lock);
+  if(pre) preempt_on;
+}
+
+
+void poll_queue_notify(poll_queue* q)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&q->count, __ATOMIC_RELAXED) == 0) return;
+
+  int pre = preempt_off;
+  Mutex_Lock(&q->lock);
+  for(rlnode* p = q->entries.next; p != &q->entries; p = p->next) {
+    poll_table* pt = ((poll_entry*) p->obj)->table;
+    Mutex_Lock(&pt->mx);
+    pt->fired = 1;
+    kernel_signal(&pt->cv);
+    Mutex_Unlock(&pt->mx);
+  }
+  Mutex_Unlock(&q->lock);
+  if(pre) preempt_on;
+}
+
+
+static void poll_table_release(poll_table* pt)
+{
+  while(! is_rlist_empty(&pt->entries)) {
+    poll_entry* e = rlist_pop_front(&pt->entries)->obj;
+    poll_queue* q = e->queue;
+
+    int pre = preempt_off;
+    Mutex_Lock(&q->lock);
+    rlist_remove(&e->queue_node);
+    __atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+    Mutex_Unlock(&q->lock);
+    if(pre) preempt_on;
+
+    free(e);
+  }
+}
+
+
+/* Check the streams, registering pt on their poll queues if it is not NULL */
+static int poll_scan(pollfd_t* fds, FCB** fcbs, unsigned int n, poll_table* pt)
+{
+  int ready = 0;
+  for(unsigned int i=0; i<n; i++) {
+    if(fds[i].fid < 0) {
+      fds[i].revents = 0;
+      continue;
+    }
+    if(fcbs[i] == NULL) {
+      fds[i].revents = POLL_INVALID;
+    }
+    else {
+      file_ops* ops = fcbs[i]->streamfunc;
+      int ev = ops->Poll ? ops->Poll(fcbs[i]->streamobj, pt) : (POLL_READ|POLL_WRITE);
+      fds[i].revents = ev & (fds[i].events | POLL_HANGUP | POLL_ERROR);
+    }
+    if(fds[i].revents) ready++;
+  }
+  return ready;
+}
+
+
+/* Poll the given streams. The caller holds a reference to each of them. */
+static int poll_streams(pollfd_t* fds, FCB** fcbs, unsigned int n, timeout_t timeout)
+{
+  TimerDuration deadline = NO_TIMEOUT;
+  if((long)timeout >= 0)
+    deadline = bios_clock() + timeout*1000ul;
+
+  poll_table pt;
+  pt.mx = MUTEX_INIT;
+  pt.cv = COND_INIT;
+  pt.fired = 0;
+  rlnode_init(&pt.entries, NULL);
+
+  /* Register on the first scan only */
+  int ready = poll_scan(fds, fcbs, n, (timeout==0) ? NULL : &pt);
+
+  while(ready == 0) {
+    int pre = preempt_off;
+    Mutex_Lock(&pt.mx);
+    while(! pt.fired) {
+      TimerDuration now = bios_clock();
+      if(deadline != NO_TIMEOUT && now >= deadline) break;
+      kernel_timedwait(&pt.mx, &pt.cv, SCHED_IO, 
+        (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+    }
+    int fired = pt.fired;
+    pt.fired = 0;
+    Mutex_Unlock(&pt.mx);
+    if(pre) preempt_on;
+
+    if(! fired) break;    /* timed out */
+    ready = poll_scan(fds, fcbs, n, NULL);
+  }
+
+  poll_table_release(&pt);
+  return ready;
+}
+
+
+int sys_Poll(pollfd_t* fds, unsigned int n, timeout_t timeout)
+{
+  if(n > MAX_FILEID_LIMIT || (n > 0 && fds == NULL)) return -1;
+
+  /* Hold a reference to each stream, while we are registered with it */
+  FCB* local[MAX_FILEID];
+  FCB** fcbs = (n <= MAX_FILEID) ? local : xmalloc(n*sizeof(FCB*));
+  for(unsigned int i=0; i<n; i++)
+    fcbs[i] = (fds[i].fid >= 0) ? get_fcb(fds[i].fid) : NULL;
+
+  int ready = poll_streams(fds, fcbs, n, timeout);
+
+  for(unsigned int i=0; i<n; i++)
+    if(fcbs[i]) FCB_decref(fcbs[i]);
+  if(fcbs != local)
+    free(fcbs);
+
+  return ready;
+}
+
+
+int FCB_poll(FCB* fcb, int events, timeout_t timeout)
+{
+  pollfd_t pfd = { .fid = 0, .events = events, .revents = 0 };
+  poll_streams(&pfd, &fcb, 1, timeout);
+  return pfd.revents;
+}
+
+
+int io_nonblocking()
+{
+  return cur_thread()->io_nonblock;
+}
+
+
+int FCB_try_io(FCB* fcb, int write, char* buf, unsigned int size)
+{
+  file_ops* ops = fcb->streamfunc;
+  TCB* tcb = cur_thread();
+
+  tcb->io_nonblock = 1;
+  int rc = -1;
+  if(write) {
+    if(ops->Write) rc = ops->Write(fcb->streamobj, buf, size);
+  }
+  else {
+    if(ops->Read) rc = ops->Read(fcb->streamobj, buf, size);
+  }
+  tcb->io_nonblock = 0;
+  return rc;
+}
+
+
+/* 
+  Try the transfer until it succeeds, or the deadline passes. Between
+  the attempts, wait for the stream to become ready.
+ */
+static int timed_io(Fid_t fd, int write, char* buf, unsigned int size, timeout_t timeout)
+{
+  FCB* fcb = get_fcb(fd);
+  if(fcb == NULL) return -1;
+
+  int event = write ? POLL_WRITE : POLL_READ;
+  TimerDuration deadline = (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+  int rc;
+  while((rc = FCB_try_io(fcb, write, buf, size)) == IO_WOULDBLOCK) {
+    TimerDuration now = bios_clock();
+    if(deadline != NO_TIMEOUT && now >= deadline) {
+      rc = -1;
+      break;
+    }
+    /* Round up, so that we do not spin for the last fraction of a msec */
+    FCB_poll(fcb, event, (deadline == NO_TIMEOUT) ? (timeout_t)-1 : (deadline - now + 999)/1000);
+  }
+
+  FCB_decref(fcb);
+  return rc;
+}
+
+
+int sys_TimedRead(Fid_t fd, char *buf, unsigned int size, timeout_t timeout)
+{
+  return timed_io(fd, 0, buf, size, timeout);
+}
+
+
+int sys_TimedWrite(Fid_t fd, const char *buf, unsigned int size, timeout_t timeout)
+{
+  return timed_io(fd, 1, (char*) buf, size, timeout);
+}
+
+
+
+int sys_Close(int fd)
+{
+  if(fd<0 || fd>=MAX_FILEID_LIMIT) 
+    return -1;
+
+  int retcode = 0;  /* Closing a closed fd is legal! */
+
+  PCB* cur = CURPROC;
+  FCB* fcb = NULL;
+  Mutex_Lock(&cur->FIDT_mutex);
+  /* Slots beyond the table size are closed */
+  if((uint)fd < cur->FIDT_size) {
+    fcb = cur->FIDT[fd];
+    fidt_set(cur, fd, NULL);
+  }
+  Mutex_Unlock(&cur->FIDT_mutex);
+
+  if(fcb)
+    retcode = FCB_decref(fcb);    
+
+  return retcode;
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  The table is grown if newfd is beyond its size.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
   int retcode=0;
-  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
+  if(oldfd<0 || newfd<0 || newfd>=MAX_FILEID_LIMIT)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->FIDT_mutex);
 
-  if(old==NULL) {
-    retcode = -1;
+  if((uint)oldfd >= cur->FIDT_size || cur->FIDT[oldfd] == NULL
+    || !fidt_grow(cur, newfd+1)) {
+    Mutex_Unlock(&cur->FIDT_mutex);
+    return -1;
   }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
+
+  if(old!=new) {
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_set(cur, newfd, old);
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(&cur->FIDT_mutex);
+
+  /* The replaced stream is closed without holding FIDT_mutex */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
 
 
 
+/* Size of the kernel buffer used to splice streams without a Splice method */
+#define SPLICE_BOUNCE_SIZE 4096
+
+/*
+  Pass data from one stream to another. If the input stream does not
+  provide a Splice method, use Read and Write on a kernel buffer.
+ */
+static int splice_streams(Fid_t in, Fid_t out, unsigned int len, int consume)
+{
+  int retcode = -1;
+
+  FCB* fin = get_fcb(in);
+  FCB* fout = get_fcb(out);
+
+  if(fin==NULL || fout==NULL) goto finish;
+
+  stream_sink sink = fout->streamfunc->Write;
+  if(sink==NULL) goto finish;
+
+  if(fin->streamfunc->Splice) {
+    retcode = fin->streamfunc->Splice(fin->streamobj, sink, fout->streamobj, len, consume);
+  }
+  else if(consume && fin->streamfunc->Read) {
+    char buffer[SPLICE_BOUNCE_SIZE];
+    unsigned int n = (len < SPLICE_BOUNCE_SIZE) ? len : SPLICE_BOUNCE_SIZE;
+    retcode = fin->streamfunc->Read(fin->streamobj, buffer, n);
+
+    /* Write out everything we read */
+    int done = 0;
+    while(done < retcode) {
+      int rc = sink(fout->streamobj, buffer+done, retcode-done);
+      if(rc <= 0) break;
+      done += rc;
+    }
+    if(done < retcode)
+      retcode = (done > 0) ? done : -1;
+  }
+
+finish:
+  if(fin) FCB_decref(fin);
+  if(fout) FCB_decref(fout);
+  return retcode;
+}
+
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int len)
+{
+  return splice_streams(in, out, len, 1);
+}
+
+
+int sys_Tee(Fid_t in, Fid_t out, unsigned int len)
+{
+  return splice_streams(in, out, len, 0);
+}
+
+
+
 unsigned int sys_GetTerminalDevices()
 {
   return device_no(DEV_SERIAL);
@@ -281,3 +873,13 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+int sys_IsTerminal(Fid_t fid)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL) return -1;
+  int terminal = fcb->streamfunc->Terminal;
+  FCB_decref(fcb);
+  return terminal;
+}
+
@@ -40,14 +40,44 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
-  rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
 
 
+struct process_control_block;
+
+/**
+  @brief Initialize the fileid table of a new PCB.
+
+  The table is empty, with @c MAX_FILEID slots, in storage inside the PCB.
+ */
+void FIDT_init(struct process_control_block* pcb);
+
+/**
+  @brief Copy the fileid table of a process to a new process.
+
+  The table of @c newproc must be empty. It is made as large as the table of
+  @c proc, and then the @c n actions of @c actions are applied to it (see 
+  @ref Spawn). Only the FCBs in the final table get their reference counts 
+  increased.
+
+  @returns 0 on success, or -1 if an action is illegal, in which case the
+    table of @c newproc is left empty.
+ */
+int FIDT_inherit(struct process_control_block* newproc, struct process_control_block* proc,
+  const fd_action* actions, unsigned int n);
+
+/**
+  @brief Close all the streams of a process.
+
+  The table of @c pcb is also released, and it is left as by @ref FIDT_init.
+ */
+void FIDT_close_all(struct process_control_block* pcb);
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -84,6 +114,8 @@ int FCB_decref(FCB* fcb);
    size @ num, this function will check is available resources
    in the current process PCB and FCB are available, and if so
    it will fill the two arrays with the appropriate values.
+   The lowest free fids are used, and the fileid table of the process
+   is grown if needed.
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
@@ -121,6 +153,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Else, it increases the reference count of the FCB, so that the 
+	stream is not closed while it is in use; the caller must
+	release it by @ref FCB_decref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -128,6 +163,113 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate a batch of fids to FCBs, locking the fileid table once.
+
+	For each @c i, @c fcb[i] is set as @ref get_fcb(fid[i]) would set it. 
+	If @c detach[i] is non-zero, the fid is also removed from the fileid
+	table, and the reference of the table is passed to the caller. Thus,
+	@c FCB_decref(fcb[i]) then completes a @c Close(fid[i]).
+
+	The fids are handled in order, so that a fid detached at some position
+	is not found at a later position.
+
+	@param num the length of the arrays
+	@param fid the file ids to translate
+	@param detach the fids to remove from the table
+	@param fcb the FCBs are stored here, or NULL for illegal fids
+ */
+void get_fcbs(size_t num, const Fid_t* fid, const int* detach, FCB** fcb);
+
+
+/** @brief Wait until a stream is ready.
+
+	This is like a @c Poll() on a single stream, given by its FCB,
+	which the caller must hold a reference to.
+
+	@param fcb the stream
+	@param events the events to wait for (@c POLL_READ, @c POLL_WRITE)
+	@param timeout the timeout, as in @c Poll()
+	@returns the events of the stream, which may include @c POLL_HANGUP and 
+		@c POLL_ERROR, or 0 if the timeout expired
+ */
+int FCB_poll(FCB* fcb, int events, timeout_t timeout);
+
+
+/** @brief Returned by stream methods that would block during @c FCB_try_io(). */
+#define IO_WOULDBLOCK (-2)
+
+/** @brief Read or write a stream, without blocking.
+
+	The @c Read (or @c Write) method of the stream is called in non-blocking
+	mode: instead of waiting, a stream that supports this mode returns 
+	@c IO_WOULDBLOCK. Streams that never block, or do not support the mode,
+	behave as in a normal call.
+
+	@param fcb the stream, which the caller must hold a reference to
+	@param write 0 to read, or 1 to write
+	@param buf the buffer
+	@param size the size of @c buf
+	@returns the result of the method, or @c IO_WOULDBLOCK
+ */
+int FCB_try_io(FCB* fcb, int write, char* buf, unsigned int size);
+
+/** @brief True if stream methods must not block (see @c FCB_try_io). */
+int io_nonblocking();
+
+
+/**
+  @brief A queue of threads polling a stream.
+
+  A stream contains a poll queue for each condition that pollers may wait
+  for, and calls @ref poll_queue_notify on it when the condition may have
+  become true. 
+
+  The locks of poll queues are held with preemption off, so that 
+  streams can notify their pollers from interrupt handlers.
+ */
+typedef struct poll_queue
+{
+  Mutex lock;           /**< @brief Protects @c entries */
+  rlnode entries;       /**< @brief Registered poll entries */
+  int count;            /**< @brief The length of @c entries, read without the lock */
+} poll_queue;
+
+
+/**
+  @brief The state of a thread executing @c Poll().
+
+  For each poll queue that the thread waits on, a poll entry is
+  registered by @ref poll_wait.
+ */
+struct poll_table
+{
+  Mutex mx;             /**< @brief Protects @c fired */
+  CondVar cv;           /**< @brief The polling thread sleeps here */
+  int fired;            /**< @brief Some queue was notified */
+  rlnode entries;       /**< @brief The entries registered by this table */
+};
+
+
+/** @brief Initialize a poll queue. */
+void poll_queue_init(poll_queue* q);
+
+/**
+  @brief Register a poll table on a poll queue.
+
+  This is called by the @c Poll method of streams. If @c pt is NULL,
+  it does nothing.
+ */
+void poll_wait(poll_table* pt, poll_queue* q);
+
+/**
+  @brief Wake up the threads polling on a queue.
+
+  This call is cheap when there are no pollers. It must be called after
+  the change of state is visible to other cores.
+ */
+void poll_queue_notify(poll_queue* q);
+
+
 /** @} */
 
 #endif
@@ -1,7 +1,10 @@
 
+#include <string.h>
+
 #include "tinyos.h"
 #include "kernel_sys.h"
 #include "kernel_cc.h"
+#include "kernel_trace.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -12,13 +15,141 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
+/**
+	@brief Collect per-call counters and latency histograms.
+
+	When this is non-zero, each system call that returns is timed, and its
+	service time and lock time are added to the counters of the current 
+	core (see GetSyscallStats).
+ */
+#ifndef SYSCALL_STATS
+#define SYSCALL_STATS 1
+#endif
+
+
+/* Per-core counters, per system call. The name field is not used. */
+static syscall_stats syscall_counters[MAX_CORES][SYSCALL_COUNT];
+
+#define SYSCALL(NAME, RET, SIG, ARGS) #NAME,
+#define SYSCALLV(NAME, SIG, ARGS) #NAME,
+static const char* syscall_names[SYSCALL_COUNT] = { SYSCALLS };
+#undef SYSCALL
+#undef SYSCALLV
+
+
+/* The state of a call in progress, kept on the stack of the wrapper */
+typedef struct syscall_probe {
+	TCB* tcb;
+	uint64_t start;
+	uint64_t lock_time;
+	unsigned long lock_waits;
+	unsigned long sleeps;
+} syscall_probe;
+
+
+/* Sleeps of a thread, other than on a mutex */
+static inline unsigned long thread_sleeps(TCB* tcb)
+{
+	return tcb->switches[SCHED_IO] + tcb->switches[SCHED_PIPE] 
+		+ tcb->switches[SCHED_POLL] + tcb->switches[SCHED_USER];
+}
+
+static inline uint hist_bucket(uint64_t nsec)
+{
+	uint b = (nsec < 2) ? 0 : 63 - __builtin_clzl(nsec);
+	return (b < SYSCALL_HIST_BUCKETS) ? b : SYSCALL_HIST_BUCKETS-1;
+}
+
+static inline void syscall_enter(syscall_probe* probe)
+{
+	/* There is no current thread for the calls made at boot */
+	TCB* tcb = cur_thread();
+	probe->tcb = tcb;
+	if(tcb != NULL) {
+		probe->lock_time = tcb->mutex_time;
+		probe->lock_waits = tcb->switches[SCHED_MUTEX];
+		probe->sleeps = thread_sleeps(tcb);
+	}
+	probe->start = bios_fast_clock_nsec();
+}
+
+static void syscall_exit(uint sysno, syscall_probe* probe)
+{
+	uint64_t service_time = bios_fast_clock_nsec() - probe->start;
+
+	TCB* tcb = probe->tcb;
+	uint64_t lock_time = 0;
+	unsigned long lock_waits = 0, sleeps = 0;
+	if(tcb != NULL) {
+		lock_time = tcb->mutex_time - probe->lock_time;
+		lock_waits = tcb->switches[SCHED_MUTEX] - probe->lock_waits;
+		sleeps = thread_sleeps(tcb) - probe->sleeps;
+	}
+
+	/* The counters of a core are only updated by the core */
+	int preempt = preempt_off;
+	syscall_stats* c = &syscall_counters[cpu_core_id][sysno];
+	c->calls++;
+	c->service_time += service_time;
+	c->lock_time += lock_time;
+	c->lock_waits += lock_waits;
+	c->sleeps += sleeps;
+	c->service_hist[hist_bucket(service_time)]++;
+	c->lock_hist[hist_bucket(lock_time)]++;
+	if(preempt) preempt_on;
+}
+
+
+void initialize_syscalls()
+{
+	memset(syscall_counters, 0, cpu_cores()*sizeof(syscall_counters[0]));
+}
+
+
+int sys_GetSyscallStats(unsigned int sysno, syscall_stats* stats)
+{
+	if(sysno >= SYSCALL_COUNT)
+		return -1;
+
+	memset(stats, 0, sizeof(syscall_stats));
+	strncpy(stats->name, syscall_names[sysno], sizeof(stats->name)-1);
+
+	for(uint core = 0; core < cpu_cores(); core++) {
+		syscall_stats* c = &syscall_counters[core][sysno];
+		stats->calls += c->calls;
+		stats->service_time += c->service_time;
+		stats->lock_time += c->lock_time;
+		stats->lock_waits += c->lock_waits;
+		stats->sleeps += c->sleeps;
+		for(uint b = 0; b < SYSCALL_HIST_BUCKETS; b++) {
+			stats->service_hist[b] += c->service_hist[b];
+			stats->lock_hist[b] += c->lock_hist[b];
+		}
+	}
+	return 0;
+}
+
+
+/*
+	There is no global kernel lock: each system call locks the 
+	kernel data it uses (see kernel_cc.h).
+
+	The entry and exit of each call are traced (see kernel_trace.h) and,
+	with SYSCALL_STATS, timed. Calls that do not return, such as Exit, 
+	are traced only on entry, and not timed.
+ */
+#if SYSCALL_STATS
+#define STATS_PRE_CALL syscall_probe __probe; syscall_enter(&__probe);
+#define STATS_POST_CALL(NAME) syscall_exit(SYSNO_##NAME, &__probe);
+#else
+#define STATS_PRE_CALL
+#define STATS_POST_CALL(NAME)
+#endif
 
+#define PRE_CALL(NAME) STATS_PRE_CALL TRACE(TRACE_SYSCALL_ENTER, cur_thread(), #NAME, 0);
 
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL(NAME, RET) TRACE(TRACE_SYSCALL_EXIT, cur_thread(), #NAME, (long)(RET)); STATS_POST_CALL(NAME)
 
 
 /* with return */
@@ -26,9 +157,9 @@ kernel_unlock();\
 RET NAME SIG \
 {\
 	RET __ret;\
-	PRE_CALL\
+	PRE_CALL(NAME)\
 	__ret = sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL(NAME, __ret)\
 	return __ret;\
 }\
 
@@ -36,9 +167,9 @@ RET NAME SIG \
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
+	PRE_CALL(NAME)\
 	sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL(NAME, 0)\
 }\
 
 
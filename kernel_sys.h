@@ -6,7 +6,9 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(Spawn, Pid_t, (Task task, int argl, void* args, const fd_action* actions, unsigned int n), (task, argl, args, actions, n))\
 SYSCALLV(Exit, (int exitval), (exitval))\
+SYSCALL(AtExit, int, (void (*hook)(void)), (hook))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
@@ -15,20 +17,40 @@ SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, core_mask mask), (tid, mask))\
+SYSCALL(GetAffinity, int, (Tid_t tid, core_mask* mask), (tid, mask))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
+SYSCALL(IsTerminal, int, (Fid_t fid), (fid))\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(WriteV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(Poll,int,(pollfd_t* fds, unsigned int n, timeout_t timeout), (fds,n,timeout))\
+SYSCALL(TimedRead,int,(Fid_t fd, char *buf, unsigned int size, timeout_t timeout), (fd,buf,size,timeout))\
+SYSCALL(TimedWrite,int,(Fid_t fd, const char *buf, unsigned int size, timeout_t timeout), (fd,buf,size,timeout))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int len), (in, out, len))\
+SYSCALL(Tee, int, (Fid_t in, Fid_t out, unsigned int len), (in, out, len))\
+SYSCALL(RingSetup, int, (io_ring* ring), (ring))\
+SYSCALL(Submit, int, (unsigned int n, unsigned int min_complete), (n, min_complete))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeSized, int, (pipe_t* pipe, unsigned int size), (pipe, size))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(ShmCreate, Fid_t, (unsigned int size), (size))\
+SYSCALL(ShmAttach, void*, (Fid_t fid, unsigned int* size), (fid, size))\
+SYSCALL(ShmDetach, int, (void* addr), (addr))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(GetThreadStats, int, (Tid_t tid, thread_stats* stats), (tid, stats))\
+SYSCALL(GetCoreStats, int, (unsigned int core, core_stats* stats), (core, stats))\
+SYSCALL(GetTime, int, (time_clock clock, unsigned long* usec), (clock, usec))\
+SYSCALL(GetSyscallStats, int, (unsigned int sysno, syscall_stats* stats), (sysno, stats))\
 
 
 
@@ -44,4 +66,18 @@ SYSCALLS
 #undef SYSCALL
 #undef SYSCALLV
 
+
+/* System call numbers, in the order of SYSCALLS */
+#define SYSCALL(NAME, RET, SIG, ARGS) SYSNO_ ## NAME,
+#define SYSCALLV(NAME, SIG, ARGS) SYSNO_ ## NAME,
+
+enum { SYSCALLS SYSCALL_COUNT };
+
+#undef SYSCALL
+#undef SYSCALLV
+
+
+/* Reset the system call counters, at boot (see GetSyscallStats) */
+void initialize_syscalls();
+
 #endif
\ No newline at end of file
@@ -1,14 +1,212 @@
 
+#include <assert.h>
 #include "tinyos.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_cc.h"
+#include "kernel_sys.h"
 
-/** 
+/*
+  The threads of a process and related system calls:
+  - CreateThread
+  - ThreadSelf
+  - ThreadJoin
+  - ThreadDetach
+  - ThreadExit
+
+  A tid holds the generation of its slot in the high 32 bits, and the
+  slot index plus one in the low 32 bits, so that NOTHREAD is never a
+  valid tid. Generations start at 1.
+ */
+
+static inline uint tid_index(Tid_t tid)
+{
+	return (uint)(tid & 0xffffffff) - 1;
+}
+
+static inline Tid_t make_tid(uint index, uint gen)
+{
+	return ((Tid_t)gen << 32) | (index + 1);
+}
+
+
+/* Initialize slots [from, to) as free, chained in order */
+static void tids_init_slots(PCB* pcb, uint from, uint to)
+{
+	for(uint i = from; i < to; i++) {
+		pcb->tids[i].ptcb = NULL;
+		pcb->tids[i].gen = 1;
+		pcb->tids[i].next_free = i+1;
+	}
+}
+
+
+void tids_init(PCB* pcb)
+{
+	pcb->tids = pcb->tids_local;
+	pcb->tids_size = PCB_TIDS;
+	pcb->tids_free = 0;
+	tids_init_slots(pcb, 0, PCB_TIDS);
+	pcb->thread_count = 0;
+}
+
+
+/* Drop n references to a PTCB. Must be called with threads_mutex held. */
+static void ptcb_put_n(PTCB* ptcb, uint n)
+{
+	ptcb->refcount -= n;
+	if(ptcb->refcount == 0)
+		free(ptcb);
+}
+
+
+/*
+  Give a tid to a PTCB, doubling the table if it is full.
+  Must be called with threads_mutex held.
+ */
+static void tid_alloc(PCB* pcb, PTCB* ptcb)
+{
+	if(pcb->tids_free == pcb->tids_size) {
+		uint oldsize = pcb->tids_size;
+		tid_slot* table = xmalloc(2*oldsize*sizeof(tid_slot));
+		memcpy(table, pcb->tids, oldsize*sizeof(tid_slot));
+		if(pcb->tids != pcb->tids_local)
+			free(pcb->tids);
+		pcb->tids = table;
+		pcb->tids_size = 2*oldsize;
+		tids_init_slots(pcb, oldsize, pcb->tids_size);
+	}
+
+	uint i = pcb->tids_free;
+	tid_slot* slot = &pcb->tids[i];
+	pcb->tids_free = slot->next_free;
+	slot->ptcb = ptcb;
+	ptcb->tid = make_tid(i, slot->gen);
+}
+
+
+/*
+  Free the tid of a PTCB. The caller must drop the reference of the slot.
+  Must be called with threads_mutex held.
+ */
+static void tid_free(PCB* pcb, PTCB* ptcb)
+{
+	uint i = tid_index(ptcb->tid);
+	tid_slot* slot = &pcb->tids[i];
+	assert(slot->ptcb == ptcb);
+
+	slot->ptcb = NULL;
+	if(++slot->gen == 0) slot->gen = 1;
+	slot->next_free = pcb->tids_free;
+	pcb->tids_free = i;
+}
+
+
+/*
+  Return the PTCB of a tid of the process, or NULL if the tid is not valid.
+  Must be called with threads_mutex held.
+ */
+static PTCB* tid_lookup(PCB* pcb, Tid_t tid)
+{
+	uint i = tid_index(tid);
+	if(i >= pcb->tids_size) return NULL;
+	tid_slot* slot = &pcb->tids[i];
+	return (slot->gen == (uint)(tid >> 32)) ? slot->ptcb : NULL;
+}
+
+
+void tids_release(PCB* pcb)
+{
+	Mutex_Lock(&pcb->threads_mutex);
+	assert(pcb->thread_count == 0);
+	for(uint i = 0; i < pcb->tids_size; i++)
+		if(pcb->tids[i].ptcb != NULL) {
+			PTCB* ptcb = pcb->tids[i].ptcb;
+			tid_free(pcb, ptcb);
+			ptcb_put_n(ptcb, 1);
+		}
+	if(pcb->tids != pcb->tids_local)
+		free(pcb->tids);
+	tids_init(pcb);
+	Mutex_Unlock(&pcb->threads_mutex);
+}
+
+
+PTCB* spawn_process_thread(PCB* pcb, Task task, int argl, void* args, void (*func)())
+{
+	PTCB* ptcb = xmalloc(sizeof(PTCB));
+	ptcb->task = task;
+	ptcb->argl = argl;
+	ptcb->args = args;
+	ptcb->exitval = 0;
+	ptcb->exited = 0;
+	ptcb->detached = 0;
+	ptcb->exit_cv = COND_INIT;
+	ptcb->refcount = 2;   /* The thread and the slot */
+
+	ptcb->tcb = spawn_thread(pcb, func);
+	ptcb->tcb->ptcb = ptcb;
+
+	Mutex_Lock(&pcb->threads_mutex);
+	tid_alloc(pcb, ptcb);
+	pcb->thread_count++;
+	Mutex_Unlock(&pcb->threads_mutex);
+
+	return ptcb;
+}
+
+
+unsigned int get_process_thread_stats(PCB* pcb, thread_stats* stats)
+{
+	memset(stats, 0, sizeof(thread_stats));
+
+	Mutex_Lock(&pcb->threads_mutex);
+	unsigned int count = pcb->thread_count;
+	for(uint i = 0; i < pcb->tids_size; i++) {
+		PTCB* ptcb = pcb->tids[i].ptcb;
+		if(ptcb == NULL || ptcb->tcb == NULL) continue;
+
+		thread_stats ts;
+		get_thread_stats(ptcb->tcb, &ts);
+		stats->run_time += ts.run_time;
+		stats->wait_time += ts.wait_time;
+		for(int c = 0; c < SWITCH_CAUSES; c++)
+			stats->switches[c] += ts.switches[c];
+		stats->voluntary += ts.voluntary;
+		stats->involuntary += ts.involuntary;
+	}
+	Mutex_Unlock(&pcb->threads_mutex);
+
+	return count;
+}
+
+
+/*
+  This function is provided as an argument to spawn_thread,
+  to execute a thread created by CreateThread.
+ */
+static void start_thread()
+{
+	PTCB* ptcb = cur_thread()->ptcb;
+	int exitval = ptcb->task(ptcb->argl, ptcb->args);
+	sys_ThreadExit(exitval);
+}
+
+
+/**
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
-	return NOTHREAD;
+	if(task == NULL)
+		return NOTHREAD;
+
+	PTCB* ptcb = spawn_process_thread(CURPROC, task, argl, args, start_thread);
+
+	/* Once it is woken up, the thread may exit and be joined */
+	Tid_t tid = ptcb->tid;
+	wakeup(ptcb->tcb);
+	return tid;
 }
 
 /**
@@ -16,7 +214,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) cur_thread();
+	return cur_thread()->ptcb->tid;
 }
 
 /**
@@ -24,7 +222,36 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
-	return -1;
+	PCB* pcb = CURPROC;
+	int rc = -1;
+
+	Mutex_Lock(&pcb->threads_mutex);
+
+	PTCB* ptcb = tid_lookup(pcb, tid);
+	if(ptcb == NULL || ptcb == cur_thread()->ptcb || ptcb->detached)
+		goto unlock;
+
+	/* Keep the PTCB while we wait, even if some other joiner frees the tid */
+	ptcb->refcount++;
+	while(!ptcb->exited && !ptcb->detached)
+		kernel_wait(&pcb->threads_mutex, &ptcb->exit_cv, SCHED_USER);
+
+	uint refs = 1;
+	if(!ptcb->detached) {
+		rc = 0;
+		if(exitval) *exitval = ptcb->exitval;
+
+		/* The first joiner to return frees the tid */
+		if(tid_lookup(pcb, tid) == ptcb) {
+			tid_free(pcb, ptcb);
+			refs++;
+		}
+	}
+	ptcb_put_n(ptcb, refs);
+
+unlock:
+	Mutex_Unlock(&pcb->threads_mutex);
+	return rc;
 }
 
 /**
@@ -32,7 +259,19 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-	return -1;
+	PCB* pcb = CURPROC;
+	int rc = -1;
+
+	Mutex_Lock(&pcb->threads_mutex);
+	PTCB* ptcb = tid_lookup(pcb, tid);
+	if(ptcb != NULL && !ptcb->exited) {
+		ptcb->detached = 1;
+		/* Joiners must fail */
+		kernel_broadcast(&ptcb->exit_cv);
+		rc = 0;
+	}
+	Mutex_Unlock(&pcb->threads_mutex);
+	return rc;
 }
 
 /**
@@ -40,6 +279,95 @@ int sys_ThreadDetach(Tid_t tid)
   */
 void sys_ThreadExit(int exitval)
 {
+	TCB* tcb = cur_thread();
+	PTCB* ptcb = tcb->ptcb;
+	PCB* pcb = CURPROC;
+
+	Mutex_Lock(&pcb->threads_mutex);
+
+	ptcb->exitval = exitval;
+	ptcb->exited = 1;
+	ptcb->tcb = NULL;
+	tcb->ptcb = NULL;
+	kernel_broadcast(&ptcb->exit_cv);
+
+	/* A detached thread leaves nothing behind */
+	uint refs = 1;
+	if(ptcb->detached) {
+		tid_free(pcb, ptcb);
+		refs++;
+	}
+	ptcb_put_n(ptcb, refs);
+
+	if(--pcb->thread_count > 0) {
+		/* The TCB is released once the mutex is unlocked and we are off the core */
+		kernel_sleep(&pcb->threads_mutex, EXITED, SCHED_USER);
+	}
+	Mutex_Unlock(&pcb->threads_mutex);
+
+	/* We are the last thread */
+	exit_process();
+}
+
+/**
+  @brief Get the scheduler counters of a thread of the current process.
+  */
+int sys_GetThreadStats(Tid_t tid, thread_stats* stats)
+{
+	PCB* pcb = CURPROC;
+	int rc = -1;
 
+	Mutex_Lock(&pcb->threads_mutex);
+	TCB* tcb = (tid == NOTHREAD) ? cur_thread() : NULL;
+	if(tcb == NULL) {
+		PTCB* ptcb = tid_lookup(pcb, tid);
+		if(ptcb != NULL) tcb = ptcb->tcb;
+	}
+	if(tcb != NULL) {
+		get_thread_stats(tcb, stats);
+		rc = 0;
+	}
+	Mutex_Unlock(&pcb->threads_mutex);
+	return rc;
 }
 
+
+/*
+  Find the TCB of a thread of the current process, or NULL.
+  Must be called with pcb->threads_mutex held.
+ */
+static TCB* affinity_thread(PCB* pcb, Tid_t tid)
+{
+	if(tid == NOTHREAD)
+		return cur_thread();
+	PTCB* ptcb = tid_lookup(pcb, tid);
+	return (ptcb == NULL || ptcb->exited) ? NULL : ptcb->tcb;
+}
+
+int sys_SetAffinity(Tid_t tid, core_mask mask)
+{
+	PCB* pcb = CURPROC;
+	int rc = -1;
+
+	Mutex_Lock(&pcb->threads_mutex);
+	TCB* tcb = affinity_thread(pcb, tid);
+	if(tcb != NULL)
+		rc = sched_set_affinity(tcb, mask);
+	Mutex_Unlock(&pcb->threads_mutex);
+	return rc;
+}
+
+int sys_GetAffinity(Tid_t tid, core_mask* mask)
+{
+	PCB* pcb = CURPROC;
+	int rc = -1;
+
+	Mutex_Lock(&pcb->threads_mutex);
+	TCB* tcb = affinity_thread(pcb, tid);
+	if(tcb != NULL) {
+		*mask = tcb->affinity;
+		rc = 0;
+	}
+	Mutex_Unlock(&pcb->threads_mutex);
+	return rc;
+}
@@ -0,0 +1,190 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kernel_trace.h"
+#include "kernel_proc.h"
+
+/*
+	The kernel event tracer (see kernel_trace.h).
+
+	The events of a core are written at increasing positions of its ring.
+	A position is reserved by an atomic increment of the ring head, so that
+	an event is recorded without locks, even when the recording thread is
+	interrupted, or moves to another core, in the middle of it.
+
+	The seq field of a slot is 0 while the slot is written, and the position
+	plus one after that. A reader copies a slot and checks that its seq was
+	the expected one both before and after the copy.
+ */
+
+#if defined(KERNEL_TRACE)
+
+_Static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE-1)) == 0, "TRACE_RING_SIZE must be a power of 2");
+
+typedef struct trace_event {
+	uint64_t seq;
+	TimerDuration ts;
+	const char* name;
+	long arg;
+	uint32_t pid;
+	uint32_t tid;
+	enum trace_type type;
+} trace_event;
+
+typedef struct trace_ring {
+	uint64_t head;     /* The next position to write */
+	uint64_t start;    /* The first position of the current boot */
+	trace_event event[TRACE_RING_SIZE];
+} __attribute__((aligned(64))) trace_ring;
+
+static trace_ring trace_rings[MAX_CORES];
+
+
+void trace_record(enum trace_type type, TCB* tcb, const char* name, long arg)
+{
+	trace_ring* ring = &trace_rings[cpu_core_id];
+	uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	trace_event* e = &ring->event[pos & (TRACE_RING_SIZE-1)];
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->ts = bios_fast_clock();
+	e->name = name;
+	e->arg = arg;
+	e->type = type;
+	if(tcb == NULL) {
+		e->pid = 0;
+		e->tid = 0;
+	} else {
+		PTCB* ptcb = tcb->ptcb;
+		e->pid = get_pid(tcb->owner_pcb);
+		e->tid = (ptcb == NULL) ? 0 : (uint32_t)ptcb->tid;
+	}
+
+	__atomic_store_n(&e->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+
+static void trace_irq(Interrupt intno)
+{
+	trace_record(TRACE_IRQ, NULL, NULL, intno);
+}
+
+
+void initialize_trace()
+{
+	for(uint c = 0; c < MAX_CORES; c++)
+		trace_rings[c].start = __atomic_load_n(&trace_rings[c].head, __ATOMIC_ACQUIRE);
+	cpu_interrupt_trace(trace_irq);
+}
+
+
+void finalize_trace()
+{
+	cpu_interrupt_trace(NULL);
+
+	const char* path = getenv("TINYOS_TRACE");
+	if(path != NULL && trace_dump(path) != 0)
+		fprintf(stderr, "tinyos: cannot write the trace to %s\n", path);
+}
+
+
+/*
+	Trace output
+ */
+
+static const char* cause_names[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+};
+
+static const char* irq_names[] = {
+	"ICI", "ALARM", "SERIAL_RX_READY", "SERIAL_TX_READY"
+};
+
+_Static_assert(sizeof(cause_names)/sizeof(char*) == SCHED_PREEMPT+1, "cause_names must match SCHED_CAUSE");
+_Static_assert(sizeof(irq_names)/sizeof(char*) == maximum_interrupt_no, "irq_names must match Interrupt");
+
+static const char* cause_name(long cause)
+{
+	return (cause >= 0 && cause <= SCHED_PREEMPT) ? cause_names[cause] : "?";
+}
+
+
+/* Copy the event at pos, if it is complete and has not been overwritten */
+static int trace_read(trace_ring* ring, uint64_t pos, trace_event* e)
+{
+	trace_event* slot = &ring->event[pos & (TRACE_RING_SIZE-1)];
+
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos+1) return 0;
+	*e = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == pos+1;
+}
+
+
+/* Print one event in Chrome trace format, after a comma. Idle thread switches are omitted. */
+static int trace_print(FILE* f, uint core, trace_event* e)
+{
+	int idle = (e->pid == 0 && e->tid == 0);
+
+	switch(e->type) {
+	case TRACE_SWITCH_IN:
+		if(idle) return 0;
+		return fprintf(f, ",\n{\"name\":\"pid %u tid %u\",\"ph\":\"B\",\"ts\":%lu,\"pid\":0,\"tid\":%u}",
+			e->pid, e->tid, e->ts, core);
+	case TRACE_SWITCH_OUT:
+		if(idle) return 0;
+		return fprintf(f, ",\n{\"ph\":\"E\",\"ts\":%lu,\"pid\":0,\"tid\":%u,\"args\":{\"cause\":\"%s\"}}",
+			e->ts, core, cause_name(e->arg));
+	case TRACE_WAKEUP:
+		return fprintf(f, ",\n{\"name\":\"wakeup\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"pid\":%u,\"tid\":%u}}",
+			e->ts, core, e->pid, e->tid);
+	case TRACE_SLEEP:
+		return fprintf(f, ",\n{\"name\":\"sleep\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"pid\":%u,\"tid\":%u,\"cause\":\"%s\"}}",
+			e->ts, core, e->pid, e->tid, cause_name(e->arg));
+	case TRACE_IRQ:
+		return fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":0,\"tid\":%u}",
+			(e->arg >= 0 && e->arg < maximum_interrupt_no) ? irq_names[e->arg] : "?", e->ts, core);
+	case TRACE_SYSCALL_ENTER:
+		return fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%lu,\"pid\":%u,\"tid\":%u,\"args\":{\"core\":%u}}",
+			e->name, e->ts, e->pid, idle ? core : e->tid, core);
+	case TRACE_SYSCALL_EXIT:
+		return fprintf(f, ",\n{\"ph\":\"E\",\"ts\":%lu,\"pid\":%u,\"tid\":%u,\"args\":{\"ret\":%ld}}",
+			e->ts, e->pid, idle ? core : e->tid, e->arg);
+	}
+	return 0;
+}
+
+
+int trace_dump(const char* path)
+{
+	FILE* f = fopen(path, "w");
+	if(f == NULL) return -1;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"kernel\"}}");
+
+	for(uint c = 0; c < MAX_CORES; c++) {
+		trace_ring* ring = &trace_rings[c];
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(head == ring->start) continue;
+
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"core %u\"}}", c, c);
+
+		uint64_t pos = (head - ring->start > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : ring->start;
+		for(; pos < head; pos++) {
+			trace_event e;
+			if(trace_read(ring, pos, &e))
+				trace_print(f, c, &e);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	return (fclose(f) == 0) ? 0 : -1;
+}
+
+#endif
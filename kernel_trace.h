@@ -0,0 +1,107 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+/**
+	@file kernel_trace.h
+	@brief Kernel event tracing.
+
+	@defgroup trace Tracing
+	@ingroup kernel
+	@brief Kernel event tracing.
+
+	When the kernel is compiled with @c KERNEL_TRACE defined (build with
+	`make TRACE=1`, after a `make clean`), each core records kernel
+	events into its own ring of @c TRACE_RING_SIZE events, overwriting
+	the oldest ones. The events are:
+	- context switches, from @c yield() and @c gain()
+	- thread wakeups and sleeps, with their @c SCHED_CAUSE
+	- interrupt dispatch
+	- system call entry and exit
+
+	Each event is time-stamped with @c bios_fast_clock(). Recording takes
+	no locks: a slot of the ring is reserved with an atomic increment,
+	and a sequence number marks the slot as complete, so that a reader
+	skips slots that are being overwritten.
+
+	The rings can be written out in the Chrome trace event JSON format,
+	which is read by `chrome://tracing` and by Perfetto. This happens
+	when the VM shuts down, if the environment variable @c TINYOS_TRACE
+	names the output file, or on demand by calling @c trace_dump(),
+	e.g., from gdb via the `trace-dump` command of `tinyos-gdb.gdb`.
+
+	Without @c KERNEL_TRACE, the @c TRACE macro expands to nothing and
+	the tracer is compiled out completely.
+
+	@{
+*/
+
+#include "kernel_sched.h"
+
+
+/** @brief The number of events kept per core. This must be a power of 2. */
+#define TRACE_RING_SIZE 4096
+
+/** @brief The kinds of traced events */
+enum trace_type {
+	TRACE_SWITCH_IN,	/**< @brief A thread starts running on the core */
+	TRACE_SWITCH_OUT,	/**< @brief A thread stops running on the core, with a @c SCHED_CAUSE */
+	TRACE_WAKEUP,		/**< @brief A thread is made ready */
+	TRACE_SLEEP,		/**< @brief A thread goes to sleep, with a @c SCHED_CAUSE */
+	TRACE_IRQ,			/**< @brief An interrupt is dispatched */
+	TRACE_SYSCALL_ENTER,	/**< @brief A system call is entered */
+	TRACE_SYSCALL_EXIT	/**< @brief A system call returns, with its return value */
+};
+
+
+#if defined(KERNEL_TRACE)
+
+/**
+	@brief Record an event on the ring of the current core.
+
+	@param type the kind of event
+	@param tcb the thread the event refers to, or NULL for the core
+	@param name the system call name for syscall events, otherwise NULL
+	@param arg the cause, interrupt or return value, depending on @c type
+ */
+void trace_record(enum trace_type type, TCB* tcb, const char* name, long arg);
+
+/** @brief Record an event, if tracing is compiled in */
+#define TRACE(type, tcb, name, arg) trace_record((type), (tcb), (name), (arg))
+
+/**
+	@brief Start tracing a new boot of the VM.
+
+	Events recorded before this call are not dumped afterwards. This is
+	called at boot, by core 0, before any thread runs.
+ */
+void initialize_trace();
+
+/**
+	@brief Stop tracing at VM shutdown.
+
+	This is called by core 0, after the scheduler has ended. If @c TINYOS_TRACE
+	is set in the environment, the trace is dumped to the file it names.
+ */
+void finalize_trace();
+
+/**
+	@brief Write the current contents of the rings to a file.
+
+	The file is written in the Chrome trace event JSON format. Core events
+	appear under the "kernel" process, one row per core. System calls appear
+	as spans under the pid and tid of the calling thread.
+
+	@param path the file to write
+	@returns 0 on success, -1 if the file could not be written
+ */
+int trace_dump(const char* path);
+
+#else
+
+#define TRACE(type, tcb, name, arg)
+
+#endif
+
+/** @} */
+
+#endif
@@ -97,6 +97,7 @@ int main(int argc, const char** argv)
   symposium_t symp;
   symp.N = nphil;
   symp.bites = bites;
+  symp.flags = 0;
   adjust_symposium(&symp, dBase, dGap);
 
   /* boot TinyOS */
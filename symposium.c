@@ -53,10 +53,13 @@ int RIGHT(int i, int N) { return (i+N-1) % N; }
 
 /* Prints the current state given a change (described by fmt) for
  philosopher ph */
-void print_state(int N, PHIL* state, const char* fmt, int ph)
+void print_state(SymposiumTable* S, const char* fmt, int ph)
 {
 #if QUIET==0
+  int N = S->symp->N;
+  PHIL* state = S->state;
   int i;
+  if(S->symp->flags & SYMP_QUIET) return;
   if(N<100) {
     for(i=0;i<N;i++) {
       char c= (".THE")[state[i]];
@@ -72,6 +75,26 @@ void print_state(int N, PHIL* state, const char* fmt, int ph)
 void think(int fmin, int fmax) { fibo(fiborand(fmin, fmax)); }
 void eat(int fmin, int fmax)  { think(fmin, fmax); }
 
+/* The clock used for the statistics, in usec */
+static unsigned long now_usec()
+{
+  unsigned long t;
+  GetTime(TIME_FAST, &t);
+  return t;
+}
+
+/* Account for a bite, after a philosopher waited hungry for w usec */
+static void record_bite(philosopher_stats* st, unsigned long w)
+{
+  st->bites++;
+  st->wait_total += w;
+  if(w > st->wait_max) st->wait_max = w;
+
+  unsigned int k = 0;
+  while(w > 0 && k < SYMP_HIST_BUCKETS-1) { w >>= 1; k++; }
+  st->hist[k]++;
+}
+
 /* Attempt to make a (hungry) philosopher i to start eating */
 void trytoeat(SymposiumTable* S, int i)
 {
@@ -80,14 +103,56 @@ void trytoeat(SymposiumTable* S, int i)
 
   if(state[i]==HUNGRY && state[LEFT(i,N)]!=EATING && state[RIGHT(i,N)]!=EATING) {
     state[i] = EATING;
-    print_state(N, state, "     %d is eating\n",i);
+    print_state(S, "     %d is eating\n",i);
     Cond_Signal(&(S->hungry[i]));
   }
 }
 
 
+/*
+  The philosopher of a sharded table. Philosopher i takes the forks
+  fork[i] and fork[RIGHT(i)], lower index first, so that there is no
+  deadlock. The state of philosopher i is only written by i.
+ */
+static void philosopher_sharded(SymposiumTable* S, int i)
+{
+  int N = S->symp->N;
+  int bites = S->symp->bites;
+  int fmin = S->symp->fmin;
+  int fmax = S->symp->fmax;
+  PHIL* state = S->state;
+
+  int f1 = i, f2 = RIGHT(i,N);
+  if(f1 > f2) { int f = f1; f1 = f2; f2 = f; }
+
+  state[i] = THINKING;
+  for(int j=0; j<bites; j++) {
+    think(fmin, fmax);
+
+    state[i] = HUNGRY;
+    unsigned long hungry_since = now_usec();
+    Mutex_Lock(& S->fork[f1]);
+    if(f2 != f1) Mutex_Lock(& S->fork[f2]);
+    state[i] = EATING;
+    record_bite(& S->stats[i], now_usec() - hungry_since);
+
+    eat(fmin, fmax);
+
+    state[i] = THINKING;
+    if(f2 != f1) Mutex_Unlock(& S->fork[f2]);
+    Mutex_Unlock(& S->fork[f1]);
+  }
+  state[i] = NOTHERE;
+}
+
+
 void SymposiumTable_philosopher(SymposiumTable* S, int i)
 {
+  if(S->symp->flags & SYMP_SHARDED) {
+    philosopher_sharded(S, i);
+    return;
+  }
+
   /* cache locally for convenience */
   int N = S->symp->N;
   int bites = S->symp->bites;
@@ -97,7 +162,7 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 
   Mutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
   state[i] = THINKING;
-  print_state(N, state, "     %d has arrived\n",i);
+  print_state(S, "     %d has arrived\n",i);
   Mutex_Unlock(& S->mx);
 
   for(int j=0; j<bites; j++) {	/* Number of bites (mpoykies) */
@@ -105,19 +170,21 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 
     Mutex_Lock(& S->mx);
     state[i] = HUNGRY;
+    unsigned long hungry_since = now_usec();
     trytoeat(S,i);		/* This may not succeed */
     while(state[i]==HUNGRY) {
-      print_state(N, state, "     %d waits hungry\n",i);
+      print_state(S, "     %d waits hungry\n",i);
       Cond_Wait(& S->mx, &(S->hungry[i])); /* If hungry we sleep. trytoeat(i) will wake us. */
     }
     assert(state[i]==EATING); 
     Mutex_Unlock(& S->mx);
+    record_bite(& S->stats[i], now_usec() - hungry_since);
     
     eat(fmin, fmax);
 
     Mutex_Lock(& S->mx);
     state[i] = THINKING;	/* We are done eating, think again */
-    print_state(N, state, "     %d is thinking\n",i);
+    print_state(S, "     %d is thinking\n",i);
     trytoeat(S, LEFT(i,N));		/* Check if our left and right can eat NOW. */
     trytoeat(S, RIGHT(i,N));
     Mutex_Unlock(& S->mx);
@@ -125,7 +192,7 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 
   Mutex_Lock(& S->mx);
   state[i] = NOTHERE;		/* We are done (eaten all the bites) */
-  print_state(N, state, "     %d is leaving\n",i);
+  print_state(S, "     %d is leaving\n",i);
   Mutex_Unlock(& S->mx);
 }
 
@@ -137,16 +204,81 @@ void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 	table->mx = MUTEX_INIT;
 	table->state = (PHIL*) xmalloc(symp->N * sizeof(PHIL));
 	table->hungry = (CondVar*) xmalloc(symp->N * sizeof(CondVar));
+	table->fork = (Mutex*) xmalloc(symp->N * sizeof(Mutex));
+	table->stats = (philosopher_stats*) xmalloc(symp->N * sizeof(philosopher_stats));
 	for(int i=0; i<symp->N; i++) {
 		table->state[i] = NOTHERE;
 		table->hungry[i] = COND_INIT;
+		table->fork[i] = MUTEX_INIT;
 	}
+	memset(table->stats, 0, symp->N * sizeof(philosopher_stats));
+	table->start = now_usec();
 }
 
 void SymposiumTable_destroy(SymposiumTable* table)
 {
 	free(table->state);
 	free(table->hungry);
+	free(table->fork);
+	free(table->stats);
+}
+
+
+/* The upper limit of histogram bucket k, in usec */
+static unsigned long bucket_limit(unsigned int k)
+{
+	return 1ul << k;
+}
+
+/* The upper limit of the bucket of the p-th percentile of a histogram with n values */
+static unsigned long hist_percentile(unsigned long* hist, unsigned long n, double p)
+{
+	unsigned long rank = (unsigned long)(p*n/100.0), count = 0;
+	for(unsigned int k=0; k<SYMP_HIST_BUCKETS; k++) {
+		count += hist[k];
+		if(count > rank) return bucket_limit(k);
+	}
+	return bucket_limit(SYMP_HIST_BUCKETS-1);
+}
+
+void SymposiumTable_report(SymposiumTable* S)
+{
+	int N = S->symp->N;
+	unsigned long elapsed = now_usec() - S->start;
+	if(elapsed == 0) elapsed = 1;
+
+	unsigned long hist[SYMP_HIST_BUCKETS] = { 0 };
+	unsigned long bites = 0, wmax = 0;
+	double wsum = 0.0, wsq = 0.0;
+	for(int i=0; i<N; i++) {
+		philosopher_stats* st = & S->stats[i];
+		bites += st->bites;
+		wsum += st->wait_total;
+		wsq += (double)st->wait_total * st->wait_total;
+		if(st->wait_max > wmax) wmax = st->wait_max;
+		for(unsigned int k=0; k<SYMP_HIST_BUCKETS; k++)
+			hist[k] += st->hist[k];
+	}
+	double jain = (wsq > 0.0) ? wsum*wsum/(N*wsq) : 1.0;
+
+	printf("Symposium of %d philosophers (%s): %lu bites in %.3f sec, %.1f bites/sec\n",
+		N, (S->symp->flags & SYMP_SHARDED) ? "per-fork locks" : "monitor",
+		bites, elapsed/1e6, bites*1e6/elapsed);
+	if(bites == 0) return;
+	printf("Hungry time (usec): mean=%.1f p50<%lu p90<%lu p99<%lu max=%lu\n",
+		wsum/bites, hist_percentile(hist, bites, 50), hist_percentile(hist, bites, 90),
+		hist_percentile(hist, bites, 99), wmax);
+	printf("Jain fairness index of hungry time: %.4f\n", jain);
+
+	for(unsigned int k=0; k<SYMP_HIST_BUCKETS; k++)
+		if(hist[k])
+			printf("  %10lu .. %10lu usec: %lu\n", k ? bucket_limit(k-1) : 0, bucket_limit(k), hist[k]);
+
+	if(N < 100)
+		for(int i=0; i<N; i++)
+			printf("  philosopher %3d: mean hungry=%.1f max=%lu usec\n", i,
+				S->stats[i].bites ? (double)S->stats[i].wait_total/S->stats[i].bites : 0.0,
+				S->stats[i].wait_max);
 }
 
 
@@ -189,6 +321,7 @@ int SymposiumOfProcesses(int argl, void* args)
     WaitChild(NOPROC, NULL);
   }
 
+  SymposiumTable_report(&S);
   SymposiumTable_destroy(&S);
   return 0;
 }
@@ -214,8 +347,8 @@ int SymposiumOfThreads(int argl, void* args)
 	SymposiumTable S;
 	SymposiumTable_init(&S, symp);
 
-	/* Execute philosophers */
-	Tid_t thread[symp->N];
+	/* Execute philosophers. There may be too many tids for the stack. */
+	Tid_t* thread = (Tid_t*) xmalloc(N * sizeof(Tid_t));
 	for(int i=0;i<N;i++) {
 		thread[i] = CreateThread(PhilosopherThread, i, &S);
 	}  
@@ -224,7 +357,9 @@ int SymposiumOfThreads(int argl, void* args)
 	for(int i=0;i<N;i++) {
 		ThreadJoin(thread[i],NULL);
 	}
+	free(thread);
 
+	SymposiumTable_report(&S);
 	SymposiumTable_destroy(&S);
 
 	return 0;
@@ -48,6 +48,14 @@
 	The constants \f$F_\text{BASE}\f$ and \f$F_\text{GAP}\f$ are defined in the source
 	code. 
 
+	A symposium can also be used as a load generator. Each philosopher
+	keeps a histogram of the time it waits hungry (from HUNGRY to EATING),
+	and at the end of the symposium the throughput in bites/second, the
+	wait-time distribution and the Jain fairness index of the philosophers' 
+	wait times are printed. With the @ref SYMP_SHARDED flag, the monitor is
+	replaced by a mutex per fork, so that philosophers at different parts of 
+	the table do not contend for a single lock.
+
 	@see FBASE
 	@see FGAP
 */
@@ -75,14 +83,21 @@ extern unsigned int fibo(unsigned int n);
 typedef enum { NOTHERE=0, THINKING, HUNGRY, EATING } PHIL;
 
 
+/** @brief Flags of a symposium. */
+enum {
+	SYMP_SHARDED = 1,	/**< Use a mutex per fork instead of a single monitor */
+	SYMP_QUIET = 2		/**< Do not print the state changes of the philosophers */
+};
+
 /** @brief A symposium definition.
 
-	The four numbers defining a symposium.
+	The four numbers defining a symposium, and some flags.
 */
 typedef struct {
 	int N;				/**< Number of philosophers */
 	int bites;			/**< Number of bites each philosopher takes. */
 	int fmin, fmax;		/**< Values used by the Fibbonacci routines */
+	unsigned int flags;	/**< Zero, or a combination of @c SYMP_SHARDED and @c SYMP_QUIET */
 } symposium_t;
 
 
@@ -105,6 +120,21 @@ typedef struct {
 void adjust_symposium(symposium_t* table, int dBASE, int dGAP);
 
 
+/** @brief The number of buckets of a wait-time histogram. 
+
+	Bucket 0 counts waits shorter than 1 usec, and bucket \f$k>0\f$ counts 
+	waits of \f$[2^{k-1}, 2^k)\f$ usec. The last bucket also counts longer waits.
+*/
+#define SYMP_HIST_BUCKETS 32
+
+/** @brief The statistics of a philosopher. */
+typedef struct {
+	unsigned long bites;		/**< Bites eaten */
+	unsigned long wait_total;	/**< Total time spent hungry, in usec */
+	unsigned long wait_max;		/**< The longest time spent hungry, in usec */
+	unsigned long hist[SYMP_HIST_BUCKETS];	/**< Histogram of the hungry periods */
+} philosopher_stats;
+
 /** @brief A symposium monitor.
 
 	Such an object must be shared between all philosopher
@@ -115,6 +145,9 @@ typedef struct {
 	symposium_t* symp; 	/**< The symposium definition */
 	PHIL* state;		/**< state[i] i=1...N]: Philosopher state */
 	CondVar* hungry;    /**< hungry[i] i=...N: condition var for philosophers */
+	Mutex* fork;		/**< fork[i] i=1...N: the fork left of philosopher i, for @c SYMP_SHARDED */
+	philosopher_stats* stats;	/**< stats[i] i=1...N: the statistics of philosopher i */
+	unsigned long start;		/**< The time the symposium started, in usec */
 } SymposiumTable;
 
 
@@ -128,6 +161,19 @@ typedef struct {
 */
 void SymposiumTable_init(SymposiumTable* table, symposium_t* symp);
 
+/** @brief Print the statistics of a symposium.
+
+	This prints the throughput, the distribution of the time 
+	philosophers spent hungry and the Jain fairness index 
+	\f[ J = \frac{(\sum_i w_i)^2}{N \sum_i w_i^2} \f]
+	of the total wait times \f$w_i\f$ of the philosophers, which is 1 
+	when all philosophers waited equally. It is called after all the 
+	philosophers have left.
+
+	@param table the monitor
+*/
+void SymposiumTable_report(SymposiumTable* table);
+
 /** @brief Destroy a symposium monitor.
 
 	@param table the monitor
@@ -45,10 +45,17 @@ typedef unsigned long timeout_t;
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
-/** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
+/** @brief The initial size of the file table of a process.
+
+   The legal file ids of a process are 0 to N-1, where N is the size of
+   its file table. A new process has a table of size MAX_FILEID (or as large
+   as the table of its parent). When a process opens a stream and its table
+   is full, the table is doubled, up to @ref MAX_FILEID_LIMIT. */
 #define MAX_FILEID 16
 
+/** @brief The maximum number of open files per process. */
+#define MAX_FILEID_LIMIT 1024
+
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
@@ -72,11 +79,13 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex is a single word. It must only be accessed by the functions below.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +101,9 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking thread spins while the owner 
+  of the mutex runs on another core, and for a few hundred times at most. Then, 
+  it sleeps until the mutex is handed to it by @c Mutex_Unlock.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -241,6 +252,43 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief The type of a file id action of @ref Spawn. */
+typedef enum {
+  SPAWN_DUP2,   /**< @brief As @c Dup2(fid, newfid) */
+  SPAWN_CLOSE   /**< @brief As @c Close(fid) */
+} spawn_op;
+
+/** @brief A file id action, applied to the file table of a new process by @ref Spawn. */
+typedef struct fd_action {
+  spawn_op op;     /**< @brief The action */
+  Fid_t fid;       /**< @brief The file id acted upon */
+  Fid_t newfid;    /**< @brief The target of @c SPAWN_DUP2 */
+} fd_action;
+
+/** @brief Create a new process, with a modified copy of the file ids of the caller.
+
+  This call is as @ref Exec, except that the file table of the new process
+  is obtained by applying the @c n actions of array @c actions, in order,
+  to a copy of the file table of the current process. The actions are applied
+  before the new process starts, and they do not affect the current process.
+
+  A @c SPAWN_DUP2 action may target a file id beyond the current table
+  size, up to @c MAX_FILEID_LIMIT-1.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param actions the file id actions
+  @param n the number of actions
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+    Possible errors:
+   -  The maximum number of processes has been reached.
+   -  An action refers to an illegal or closed file id.
+  */
+Pid_t Spawn(Task task, int argl, void* args, const fd_action* actions, unsigned int n);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -255,6 +303,23 @@ Pid_t Exec(Task task, int argl, void* args);
    */
 void Exit(int val);
 
+/** @brief The maximum number of exit hooks of a process. */
+#define MAX_EXIT_HOOKS 8
+
+/** @brief Register a function to be called when the current process exits.
+
+  The hooks of a process are called by its last thread to exit, in the
+  reverse order of registration, before the file ids of the process are
+  closed. Thus, they may still write to them (e.g., to flush buffered
+  output). A hook registered while the hooks are running is called next.
+  New processes start with no hooks.
+
+  @param hook the function to call
+  @returns 0 on success, or -1 if @c hook is NULL or the process already has
+    @c MAX_EXIT_HOOKS hooks.
+  */
+int AtExit(void (*hook)(void));
+
 /** @brief Wait on a terminating child.
 
    This function will return the exit status of a terminated 
@@ -315,7 +380,9 @@ Pid_t GetPPid(void);
   programmer to define their meaning.
 
   @param task a function to execute
-
+  @returns the tid of the new thread, or @c NOTHREAD if @c task is NULL.
+    The tids of threads that have been joined, or have exited detached,
+    are not reused by other threads for a long time.
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
@@ -375,6 +442,42 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief A set of cores: bit @c c stands for core @c c.
+ */
+typedef unsigned int core_mask;
+
+/** @brief A mask of all the cores */
+#define ALL_CORES ((core_mask)-1)
+
+/**
+  @brief Restrict the cores a thread may run on.
+
+  The thread will only be scheduled on the cores of @c mask that exist
+  in the VM. If it is running on some other core, it moves at once.
+  Threads and processes created by a thread inherit its affinity
+  (but see @c boot_reserve_cores()).
+
+  @param tid the thread, or @c NOTHREAD for the current thread
+  @param mask the allowed cores, e.g., @c ALL_CORES
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask contains none of the cores of the VM.
+  */
+int SetAffinity(Tid_t tid, core_mask mask);
+
+/**
+  @brief Get the cores a thread may run on.
+
+  @param tid the thread, or @c NOTHREAD for the current thread
+  @param mask a location where the affinity of the thread is stored. This
+    only contains cores of the VM.
+  @returns 0 on success, and -1 on error, as in @c SetAffinity().
+  */
+int GetAffinity(Tid_t tid, core_mask* mask);
+
+
 
 /*******************************************
  *
@@ -414,6 +517,19 @@ Fid_t OpenTerminal(unsigned int termno);
 Fid_t OpenNull();
 
 
+/** @brief Check whether a file id refers to a terminal.
+
+  Terminals are the streams returned by @c OpenTerminal(), and other
+  interactive streams. This can be used to choose the buffering of a
+  stream (see @c fidopen()).
+
+  @param fid the file id to check
+  @return 1 if @c fid is a terminal, 0 if it is some other stream, 
+    and -1 if it is not a legal file id.
+*/
+int IsTerminal(Fid_t fid);
+
+
 /** 
   @brief Read bytes from a stream. 
 
@@ -458,13 +574,145 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief The maximum number of buffers passed to @c ReadV and @c WriteV. */
+#define MAX_IOVEC 64
+
+/**
+  @brief A buffer for vectored I/O.
+  @see ReadV
+  @see WriteV
+ */
+typedef struct iovec_s {
+  char* base;           /**< @brief The start of the buffer */
+  unsigned int len;     /**< @brief The length of the buffer */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into a vector of buffers.
+
+   The buffers are filled in order, as if by one call to @c Read() with 
+   a buffer of their total size. The call blocks until some data is 
+   available, like @c Read(), and may return fewer bytes than requested.
+
+   @param fd the file descriptor to read from
+   @param iov the array of buffers
+   @param iovcnt the number of buffers, at most @c MAX_IOVEC
+   @returns the number of bytes read, 0 at the end of data, or -1 on error.
+   Possible errors are:
+   - The file id is invalid.
+   - @c iovcnt is larger than @c MAX_IOVEC.
+   - There was a I/O runtime problem.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from a vector of buffers.
+
+   The buffers are written in order, as if by one call to @c Write() 
+   with a buffer holding all of them. Like @c Write(), the call may 
+   write fewer bytes than requested.
+
+   @param fd the file descriptor to write to
+   @param iov the array of buffers
+   @param iovcnt the number of buffers, at most @c MAX_IOVEC
+   @returns the number of bytes written, or -1 on error.
+   Possible errors are:
+   - The file id is invalid.
+   - @c iovcnt is larger than @c MAX_IOVEC.
+   - There was a I/O runtime problem.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/**
+  @brief Poll events.
+
+  These flags are used in the @c events and @c revents fields of
+  @c pollfd_t. @c POLL_HANGUP, @c POLL_ERROR and @c POLL_INVALID are always
+  reported, whether they were requested or not.
+  @see Poll
+ */
+enum poll_events {
+  POLL_READ = 1,      /**< @brief @c Read() will not block */
+  POLL_WRITE = 2,     /**< @brief @c Write() will not block */
+  POLL_HANGUP = 4,    /**< @brief The other end of the stream is closed */
+  POLL_ERROR = 8,     /**< @brief Reads or writes will fail */
+  POLL_INVALID = 16   /**< @brief The file id is not open */
+};
+
+
+/**
+  @brief A file id to be polled.
+  @see Poll
+ */
+typedef struct pollfd_s {
+  Fid_t fid;        /**< @brief The file id. If negative, it is ignored. */
+  int events;       /**< @brief The requested events (@c POLL_READ, @c POLL_WRITE) */
+  int revents;      /**< @brief The returned events */
+} pollfd_t;
+
+
+/** @brief Wait for any of a number of streams to become ready.
+
+   The call checks the streams of the file ids in @c fds, and stores in 
+   each @c revents field the events that are true for the stream. If no 
+   stream is ready, the call blocks until some stream becomes ready, or 
+   until the timeout expires.
+
+   Streams that do not support polling are always ready for both reading
+   and writing.
+
+   Note that readiness is only a hint: if another thread reads from (or 
+   writes to) the same stream, a subsequent @c Read() (or @c Write()) 
+   may still block.
+
+   @param fds the array of file ids and events
+   @param n the number of elements of @c fds, at most @c MAX_FILEID_LIMIT
+   @param timeout the timeout in msec. A timeout of 0 returns immediately,
+      and a negative timeout (i.e., @c (timeout_t)-1) waits indefinitely.
+   @returns the number of elements of @c fds with a non-zero @c revents
+      field, 0 if the timeout expired, or -1 on error (e.g., if @c n exceeds
+      @c MAX_FILEID_LIMIT).
+ */
+int Poll(pollfd_t* fds, unsigned int n, timeout_t timeout);
+
+
+/** @brief Read from a stream, with a timeout.
+
+   Like @c Read(), but if no data becomes available within @c timeout 
+   msec, the call returns -1. With a timeout of 0, the call does not 
+   block.
+
+   @returns the number of bytes read, 0 at the end of data, or -1 if 
+     the timeout expired or on error.
+   @see Read
+   @see Poll
+ */
+int TimedRead(Fid_t fd, char *buf, unsigned int size, timeout_t timeout);
+
+
+/** @brief Write to a stream, with a timeout.
+
+   Like @c Write(), but if the stream cannot accept any data within 
+   @c timeout msec, the call returns -1. With a timeout of 0, the call 
+   does not block.
+
+   @returns the number of bytes written, or -1 if the timeout expired 
+     or on error.
+   @see Write
+   @see Poll
+ */
+int TimedWrite(Fid_t fd, const char *buf, unsigned int size, timeout_t timeout);
+
+
 /** @brief Close a file id.
    
 
   @param fd the file ID to close
   @return  This call returns 0 on success and -1 on failure.
    Note that it is not an error to call Close on a (valid)
-   file id which is already closed.
+   file id which is already closed, or was never opened; any
+   file id below @c MAX_FILEID_LIMIT is valid.
    Possible reasons for failure:
    - The file id is invalid.
    - There was a I/O runtime problem.   
@@ -478,10 +726,11 @@ int Close(Fid_t fd);
   closed (unless @c oldfd==newfd, in which case nothing happens). 
 
   After the successful call, both oldfd and newfd refer to
-  the same file object.
+  the same file object. If @c newfd is beyond the current size of the
+  file id table, the table is grown, up to @c MAX_FILEID_LIMIT.
 
   @param oldfd the file id to copy from
-  @param newfd the new file id.
+  @param newfd the new file id, less than @c MAX_FILEID_LIMIT.
   @return This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
@@ -489,6 +738,149 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/**
+	@brief Move data from one stream to another.
+
+	Transfer up to @c len bytes from stream @c in to stream @c out,
+	without passing them through user memory. The call blocks until 
+	some data is available at @c in, as @c Read() would, and returns
+	after passing one chunk to @c out. If @c in is a pipe, the data is
+	copied from the pipe buffer directly into @c out.
+
+	@param in the file id to read from.
+	@param out the file id to write to.
+	@param len the maximum number of bytes to transfer.
+	@returns the number of bytes transferred, 0 at the end of data for 
+	  @c in, or -1 on error. Possible reasons for error:
+	  - either file id is invalid.
+	  - @c in cannot be read, or @c out cannot be written.
+	  - @c in and @c out are the two ends of the same pipe.
+	  - there was an I/O runtime problem.
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int len);
+
+
+/**
+	@brief Copy data from one stream to another, without consuming it.
+
+	This call is like @c Splice(), but the data remains in @c in,
+	to be returned by subsequent calls to @c Read(). Only pipes can
+	be the input of @c Tee.
+
+	@param in the file id to read from; it must be the read end of a pipe.
+	@param out the file id to write to.
+	@param len the maximum number of bytes to copy.
+	@returns the number of bytes copied, 0 at the end of data for 
+	  @c in, or -1 on error. Possible reasons for error are as in 
+	  @c Splice(), or that @c in does not support @c Tee().
+*/
+int Tee(Fid_t in, Fid_t out, unsigned int len);
+
+
+/*******************************************
+ *
+ * Batched I/O
+ *
+ *******************************************/
+
+/** @brief The operations of a submission ring entry. */
+typedef enum {
+	IO_NOP,     /**< @brief Do nothing; completes with result 0 */
+	IO_READ,    /**< @brief @c Read(fd, buf, size) */
+	IO_WRITE,   /**< @brief @c Write(fd, buf, size) */
+	IO_CLOSE    /**< @brief @c Close(fd) */
+} io_opcode;
+
+/** @brief A submission ring entry: an I/O request. */
+typedef struct io_sqe {
+	io_opcode op;            /**< @brief The operation */
+	Fid_t fd;                /**< @brief The file id to operate on */
+	char* buf;               /**< @brief The buffer of @c IO_READ and @c IO_WRITE */
+	unsigned int size;       /**< @brief The size of @c buf */
+	unsigned long user_data; /**< @brief Copied to the completion of the request */
+} io_sqe;
+
+/** @brief A completion ring entry: the result of a request. */
+typedef struct io_cqe {
+	unsigned long user_data; /**< @brief The @c user_data of the request */
+	int result;              /**< @brief The return value of the operation */
+} io_cqe;
+
+/**
+	@brief A submission ring and a completion ring, in process memory.
+
+	Both rings have @c entries slots, a power of 2. Each ring has a head and
+	a tail, which count the entries removed from, and added to, the ring. 
+	They are free-running: slot @c i&(entries-1) holds entry @c i. 
+
+	The process adds requests at @c sq_tail, and the kernel removes them
+	from @c sq_head when they are submitted by @c Submit(). The kernel adds 
+	completions at @c cq_tail, and the process removes them from @c cq_head,
+	without a system call. The kernel stores @c cq_tail with release
+	semantics, so it must be loaded with acquire semantics (e.g., by 
+	@c __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) before reading the
+	completions.
+
+	A ring is used by one thread at a time: @c Submit() fails while another
+	thread of the process is in @c Submit(), and @c RingSetup() fails while
+	any thread is in @c Submit().
+
+	@see RingSetup
+	@see Submit
+ */
+typedef struct io_ring {
+	unsigned int entries;   /**< @brief The number of slots of each ring */
+	io_sqe* sq;             /**< @brief The submission ring */
+	io_cqe* cq;             /**< @brief The completion ring */
+	unsigned int sq_head;   /**< @brief Written by the kernel */
+	unsigned int sq_tail;   /**< @brief Written by the process */
+	unsigned int cq_head;   /**< @brief Written by the process */
+	unsigned int cq_tail;   /**< @brief Written by the kernel */
+} io_ring;
+
+/**
+	@brief Register the I/O ring of the current process.
+
+	The caller provides the ring and its two arrays, which must remain valid 
+	until the process exits, or a new ring is registered. The heads and 
+	tails are reset to 0. A ring cannot be replaced while it has requests
+	in progress.
+
+	@param ring the new ring, or NULL to unregister the current one
+	@returns 0 on success and -1 on error. Possible reasons for error are:
+		- @c ring->entries is not a power of 2, or its arrays are NULL.
+		- the current ring has requests in progress, or a thread is in 
+		  @c Submit().
+ */
+int RingSetup(io_ring* ring);
+
+/**
+	@brief Submit requests from the I/O ring of the current process.
+
+	Up to @c n requests are taken from the submission ring, in order. The
+	file ids of the whole batch are looked up at once. Requests that can 
+	complete without blocking are executed during the call; the others are 
+	completed asynchronously, by kernel worker threads. Thus, completions may
+	arrive out of order.
+
+	Requests are not taken if the completion ring does not have room for 
+	their completions. After submitting, the call waits until at least 
+	@c min_complete completions are in the completion ring, or no requests
+	are in progress.
+
+	When the process exits, any requests still in progress complete with
+	result -1.
+
+	@param n the maximum number of requests to submit
+	@param min_complete the number of completions to wait for
+	@returns the number of requests submitted, or -1 on error. Possible 
+		reasons for error are:
+		- the process has no I/O ring.
+		- another thread of the process is in @c Submit().
+ */
+int Submit(unsigned int n, unsigned int min_complete);
+
 /*******************************************
  *
  * Pipes
@@ -531,6 +923,20 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Construct a pipe with a given buffer size.
+
+	This call is like @c Pipe(), but the size of the pipe buffer is
+	given by the caller. It is rounded up to a power of two between
+	256 bytes and 1 Mbyte. A size of 0 selects the default size.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param size the requested buffer size in bytes.
+	@returns 0 on success, or -1 on error, as in @c Pipe().
+*/
+int PipeSized(pipe_t* pipe, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -694,6 +1100,87 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/*******************************************
+ *
+ * Shared memory
+ *
+ *******************************************/
+
+/**
+	@brief The largest size of a shared memory segment, in bytes.
+*/
+#define SHM_MAX_SIZE (1u<<30)
+
+
+/**
+	@brief Create a shared memory segment.
+
+	A new segment of at least @c size bytes is created, and a file id
+	referring to it is returned. The segment memory is page-aligned and
+	filled with zeros.
+
+	The segment is shared with other processes by passing its file id to
+	them, as with any other stream: children created by @c Exec() or
+	@c Spawn() inherit it. A process accesses the segment by calling
+	@c ShmAttach(). The file id cannot be read or written.
+
+	The segment lives as long as any file id refers to it, or any
+	process has it attached. Closing the file id does not affect
+	existing attachments.
+
+	Since @c MUTEX_INIT and @c COND_INIT are all zeros, any @c Mutex and
+	@c CondVar placed in the segment is initialized. Thus, a monitor (a
+	mutex with its condition variables, protecting the rest of the data)
+	can be placed inside a segment, and used by all the processes that
+	have it attached. Large buffers can then be exchanged without copying
+	them through a pipe or socket.
+
+	@param size the size of the segment in bytes, from 1 to @c SHM_MAX_SIZE.
+	@returns a file id for the segment, or NOFILE on error. Possible reasons
+		for error:
+		- the size is 0 or larger than @c SHM_MAX_SIZE
+		- the available file ids for the process are exhausted
+		- the memory could not be allocated
+	@see ShmAttach
+*/
+Fid_t ShmCreate(unsigned int size);
+
+
+/**
+	@brief Attach a shared memory segment to the current process.
+
+	The address of the segment memory is returned. All processes (and
+	all attachments of the same process) see the segment at the same
+	address. A segment may be attached more than once; each attachment
+	must be detached separately.
+
+	@param fid the file id of a shared memory segment
+	@param size if not NULL, the size of the segment (as given to @c ShmCreate)
+		is stored here
+	@returns the address of the segment, or NULL on error. Possible reasons
+		for error:
+		- the file id is not legal
+		- the file id does not refer to a shared memory segment
+	@see ShmDetach
+*/
+void* ShmAttach(Fid_t fid, unsigned int* size);
+
+
+/**
+	@brief Detach a shared memory segment from the current process.
+
+	One attachment of the segment at address @c addr is removed. When the
+	segment is no longer attached by any process, and no file id refers
+	to it, it is released. All segments still attached by a process are
+	detached when it exits.
+
+	@param addr an address returned by @c ShmAttach()
+	@returns 0 on success and -1 on error. Possible reasons for error:
+		- no segment is attached at @c addr by the current process
+*/
+int ShmDetach(void* addr);
+
+
 
 /*******************************************
  *
@@ -723,6 +1210,11 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long run_time;    /**< @brief Time spent running by the threads of the process, in microseconds. */
+  unsigned long wait_time;   /**< @brief Time spent in ready queues by the threads of the process, in microseconds. */
+  unsigned long voluntary;   /**< @brief Switches because a thread of the process blocked or yielded. */
+  unsigned long involuntary; /**< @brief Switches because a thread of the process was preempted. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -751,7 +1243,9 @@ typedef struct procinfo
 
 	There is no guarantee of the timeliness of the information.
 	A best-effort approach to return relevant system information is
-	made. 
+	made. The records are returned in increasing pid order, and are
+	collected a few at a time, as the stream is read. The scheduler
+	counters are zero for zombies.
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -762,6 +1256,150 @@ Fid_t OpenInfo();
 
 
 
+/*******************************************
+ *
+ * Scheduler statistics
+ *
+ *******************************************/
+
+/**
+  @brief The causes of a context switch.
+
+  These index the @c switches array of @c thread_stats.
+ */
+typedef enum {
+	SWITCH_QUANTUM,  /**< @brief The time-slice expired */
+	SWITCH_IO,       /**< @brief The thread waited for I/O */
+	SWITCH_MUTEX,    /**< @brief The thread slept on a busy mutex */
+	SWITCH_PIPE,     /**< @brief The thread waited at a pipe or socket */
+	SWITCH_POLL,     /**< @brief The thread polled a device */
+	SWITCH_IDLE,     /**< @brief The idle thread yielded */
+	SWITCH_USER,     /**< @brief The thread blocked in a system call, e.g., Cond_Wait() or WaitChild() */
+	SWITCH_PREEMPT,  /**< @brief A thread of higher priority became ready */
+	SWITCH_CAUSES    /**< @brief The number of causes */
+} switch_cause;
+
+/**
+  @brief Scheduler counters of a thread.
+
+  Times are in microseconds.
+ */
+typedef struct thread_stats {
+	unsigned long run_time;    /**< @brief Total time spent running */
+	unsigned long wait_time;   /**< @brief Total time spent in a ready queue */
+	unsigned long switches[SWITCH_CAUSES]; /**< @brief Switches away from the thread, per cause */
+	unsigned long voluntary;   /**< @brief Switches because the thread blocked or yielded */
+	unsigned long involuntary; /**< @brief Switches because the thread was preempted */
+} thread_stats;
+
+/**
+  @brief Scheduler counters of a core.
+
+  Times are in microseconds. The utilization of a core is 
+  @c busy_time/(busy_time+idle_time).
+ */
+typedef struct core_stats {
+	unsigned long idle_time;   /**< @brief Total time spent in the idle thread */
+	unsigned long busy_time;   /**< @brief Total time spent in other threads */
+	unsigned long switches;    /**< @brief Context switches */
+	unsigned long steals;      /**< @brief Threads stolen from the queues of other cores */
+} core_stats;
+
+/**
+  @brief Get the scheduler counters of a thread.
+
+  The thread must belong to the current process. 
+
+  @param tid the thread id, or @c NOTHREAD for the current thread
+  @param stats the counters are stored here
+  @returns 0 on success and -1 on error. Possible reasons for error are:
+    - @c tid is not a thread of the current process.
+  */
+int GetThreadStats(Tid_t tid, thread_stats* stats);
+
+/**
+  @brief Get the scheduler counters of a core.
+
+  Cores are numbered starting from 0. The counters are not updated
+  atomically, so they may be slightly out of date.
+
+  @param core the core number
+  @param stats the counters are stored here
+  @returns 0 on success and -1 on error. Possible reasons for error are:
+    - @c core is not smaller than the number of cores.
+  */
+int GetCoreStats(unsigned int core, core_stats* stats);
+
+
+/** @brief The clocks that can be read by @ref GetTime. */
+typedef enum {
+  TIME_MONOTONIC,   /**< @brief The clock of the kernel, used for timeouts */
+  TIME_FAST         /**< @brief The same clock, read without a system call when possible */
+} time_clock;
+
+/**
+  @brief Read a clock.
+
+  Both clocks are monotonic, count microseconds from some unspecified point 
+  in the past, and have a resolution of about 1 microsecond. @c TIME_FAST is 
+  read from the processor's cycle counter when the host supports it, which is
+  cheaper, but it may drift slightly from @c TIME_MONOTONIC. Differences 
+  of values of the same clock can be used to measure latency.
+
+  @param clock the clock to read
+  @param usec the time is stored here
+  @returns 0 on success and -1 on error. Possible reasons for error are:
+    - @c clock is not a valid clock.
+  */
+int GetTime(time_clock clock, unsigned long* usec);
+
+
+/** @brief The number of buckets of a system call latency histogram. */
+#define SYSCALL_HIST_BUCKETS 32
+
+/**
+  @brief Counters and latency histograms of a system call.
+
+  Times are in nanoseconds. The service time of a call is the time from 
+  entry to return. The lock time is the part of the service time that the 
+  calling thread spent parked on busy kernel mutexes. A call that spends
+  most of its time in lock waits is lock-bound, and a call that sleeps a
+  lot is I/O-bound.
+
+  The histograms are log-bucketed: bucket 0 counts calls that took less than
+  2 nsec (for @c lock_hist, including those that never waited for a lock), 
+  bucket @c i counts calls that took from @c 2^i up to @c 2^(i+1) nsec, and 
+  the last bucket counts all longer calls as well.
+
+  Calls that do not return, such as @c Exit(), are not counted.
+ */
+typedef struct syscall_stats {
+	char name[24];               /**< @brief The name of the system call */
+	unsigned long calls;         /**< @brief Calls that returned */
+	unsigned long service_time;  /**< @brief Total service time */
+	unsigned long lock_time;     /**< @brief Total lock time */
+	unsigned long lock_waits;    /**< @brief Times a call was parked on a busy mutex */
+	unsigned long sleeps;        /**< @brief Times a call slept for anything else, e.g., I/O or a child */
+	unsigned long service_hist[SYSCALL_HIST_BUCKETS];  /**< @brief Histogram of service times */
+	unsigned long lock_hist[SYSCALL_HIST_BUCKETS];     /**< @brief Histogram of lock times */
+} syscall_stats;
+
+/**
+  @brief Get the counters of a system call, over all cores.
+
+  System calls are numbered from 0, in an unspecified order. The counters
+  cover the calls made since boot. As with @ref GetCoreStats, they may be 
+  slightly out of date.
+
+  @param sysno the system call number
+  @param stats the counters are stored here
+  @returns 0 on success and -1 on error. Possible reasons for error are:
+    - @c sysno is not smaller than the number of system calls.
+  */
+int GetSyscallStats(unsigned int sysno, syscall_stats* stats);
+
+
+
 /*******************************************
  *
  * System boot
@@ -781,6 +1419,29 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Reserve cores for the processes of a task, at the next boot.
+
+   This call must be made before @c boot(). It partitions the cores of the
+   VM: the main thread of each process executing @c task (and, unless they
+   change it, its threads and descendants) has @c cores as its affinity
+   (see @c SetAffinity()). Other threads do not run on reserved cores.
+
+   If @c task is NULL, the cores are reserved for interrupt handling: no
+   thread runs on them, and device interrupts are sent to the first of
+   them, unless the thread waiting for a device has a restricted affinity,
+   in which case they are sent to a core that thread may run on.
+
+   Cores that do not exist in the VM are ignored. If all the cores are
+   reserved, the other threads may run on any core. The reservations
+   are dropped when @c boot() returns.
+
+   @param task the main task of the processes, or NULL
+   @param cores the reserved cores
+   @returns 0 on success, or -1 if too many reservations were made.
+   */
+int boot_reserve_cores(Task task, core_mask cores);
+
+
 /** @} */
 
 #endif
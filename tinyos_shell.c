@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int SyscallInfo(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -28,6 +29,7 @@ int More(size_t,const char**);
 int WordCount(size_t,const char**);
 int Symposium_proc(size_t,const char**);
 int Symposium_thr(size_t,const char**);
+int Symposium_shard(size_t,const char**);
 int RemoteServer(size_t,const char**);
 int RemoteClient(size_t,const char**);
 int Echo(size_t,const char**);
@@ -39,6 +41,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"sysstat", SyscallInfo, 0, "Print the counters and latencies of the system calls made since boot."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -50,6 +53,7 @@ COMMANDS[]  =
 	{"more", More, 0, "more [<n>] (default: <n>=20). Read the input <n> lines at a time."},	
 	{"symposium", Symposium_proc, 2, "Dining Philosophers(processes): symposium  <philosophers> <bites>"},
 	{"symp_thr", Symposium_thr, 2, "Dining Philosophers(threads): symp_thr  <philosophers> <bites>"},
+	{"symp_shard", Symposium_shard, 2, "Dining Philosophers(threads, per-fork locks, quiet): symp_shard  <philosophers> <bites>"},
 	{"hanoi", Hanoi, 1, "The towers of Hanoi."},
 	{"rserver", RemoteServer, 0, "A server for remote execution."},
 	{"rcli", RemoteClient, 1, "Remote client: rcli <cmd> [<args...>]."},
@@ -84,6 +88,7 @@ static void __symp_argproc(size_t argc, const char** argv, symposium_t* symp)
 {
 	symp->N = getint(1);
 	symp->bites = getint(2);
+	symp->flags = 0;
 
 	int dBASE = 0;
 	int dGAP = 0;
@@ -103,6 +108,15 @@ int Symposium_thr(size_t argc, const char** argv)
 	return SymposiumOfThreads(sizeof(symp), &symp);
 }
 
+int Symposium_shard(size_t argc, const char** argv)
+{
+	checkargs(2);
+	symposium_t symp;
+	__symp_argproc(argc, argv, &symp);
+	symp.flags = SYMP_SHARDED | SYMP_QUIET;
+	return SymposiumOfThreads(sizeof(symp), &symp);
+}
+
 int Symposium_proc(size_t argc, const char** argv)
 {
 	checkargs(2);
@@ -172,8 +186,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %10s %9s %20s\n",
+			"PID", "PPID", "State", "Threads", "CPU(msec)", "Switches", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,11 +203,13 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %10lu %9lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.run_time/1000,
+				info.voluntary+info.involuntary,
 				pname
 				);
 		}
@@ -203,6 +219,40 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+/* The upper bound of the histogram bucket holding the given fraction of the calls */
+static unsigned long hist_percentile(const unsigned long* hist, unsigned long calls, double frac)
+{
+	unsigned long count = 0;
+	for(int b=0; b<SYSCALL_HIST_BUCKETS; b++) {
+		count += hist[b];
+		if(count >= frac*calls) return 2ul << b;
+	}
+	return 2ul << (SYSCALL_HIST_BUCKETS-1);
+}
+
+int SyscallInfo(size_t argc, const char** argv)
+{
+	syscall_stats st;
+	printf("%-18s %9s %10s %10s %10s %6s %9s %9s\n",
+		"Syscall", "Calls", "Avg(ns)", "p50(ns)", "p99(ns)", "Lock%", "LockWaits", "Sleeps");
+	for(unsigned int sysno=0; GetSyscallStats(sysno, &st)==0; sysno++) {
+		if(st.calls == 0) continue;
+		printf("%-18s %9lu %10lu %10lu %10lu %6.1f %9lu %9lu\n",
+			st.name,
+			st.calls,
+			st.service_time/st.calls,
+			hist_percentile(st.service_hist, st.calls, 0.5),
+			hist_percentile(st.service_hist, st.calls, 0.99),
+			st.service_time ? 100.0*st.lock_time/st.service_time : 0.0,
+			st.lock_waits,
+			st.sleeps
+			);
+	}
+	printf("\n");
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -401,6 +451,34 @@ int ListPrograms(size_t argc, const char** argv)
 
 #define REMOTE_SERVER_DEFAULT_PORT 20
 
+/* The maximum number of connections waiting to send their request */
+#define RS_MAX_PENDING 8
+
+/* The maximum size of a request */
+#define RS_MAX_ARGL 2048
+
+/*
+  A connection whose request is still being received.
+ */
+struct rs_pending
+{
+	Fid_t sock;
+	size_t ID;
+	int argl;       /* the request header */
+	size_t count;   /* bytes of the request received so far */
+	char args[RS_MAX_ARGL];
+};
+
+/*
+  Sent by each remote process to the server, when it is done.
+ */
+struct rs_done
+{
+	size_t ID;
+	Pid_t pid;
+	int exitstatus;
+};
+
 /*
   The server's "global variables".
  */
@@ -411,9 +489,16 @@ struct __rs_globals
 
 	/* server related */
 	port_t port;
-	Tid_t listener;
 	Fid_t listener_socket;
 
+	/* Connections waiting to send their request */
+	struct rs_pending pending[RS_MAX_PENDING];
+	size_t npending;
+
+	/* Remote processes report to the server through this pipe */
+	pipe_t done;
+	size_t running;
+
 	/* Statistics */
 	size_t active_conn;
 	size_t total_conn;
@@ -425,52 +510,35 @@ struct __rs_globals
 	rlnode log;
 	size_t logcount;
 	
-	/* Synchronize with active threads */
+	/* protects the log */
 	Mutex mx;
-	CondVar conn_done;
+
+	/* console input */
+	char line[256];
+	size_t linelen;
 };
 
 #define GS(name) (((struct __rs_globals*) __globals)->name)
 
 /* forward decl */
-static int rsrv_client(int sock, void* __globals);
 static void log_message(void* __globals, const char* msg, ...)
 	__attribute__((format(printf,2,3)));
 static void log_init(void* __globals);
 static void log_print(void* __globals);
 static void log_truncate(void* __globals);
 
-static int rsrv_listener_thread(int port, void* __globals);
+static void rsrv_accept(void* __globals);
+static void rsrv_receive(void* __globals, size_t i);
+static void rsrv_reap(void* __globals);
+static int rsrv_command(void* __globals, const char* cmd);
 
-/* the thread that accepts new connections */
-static int rsrv_listener_thread(int port, void* __globals)
-{
-	Fid_t lsock = Socket(port);
-	if(Listen(lsock) == -1) {
-		printf("Cannot listen to the given port: %d\n", port);
-		return -1;
-	}
-	GS(listener_socket) = lsock;
-
-	/* Accept loop */
-	while(1) {
-		Fid_t sock = Accept(lsock);
-		if(sock==NOFILE) {
-			/* We failed! Check if we should quit */
-			if(GS(quit)) return 0;
-			log_message(__globals, "listener(port=%d): failed to accept!\n", port);
-		} else {
-			GS(active_conn)++;
-			GS(total_conn)++;
-			Tid_t t = CreateThread(rsrv_client, sock, __globals);
-			ThreadDetach(t);
-		}
-	}
-	return 0;
-}
 
+/*  
+  The main server process. 
 
-/*  The main server process */
+  A single thread serves the console, the listening socket and all
+  connections, by polling them.
+ */
 int RemoteServer(size_t argc, const char** argv)
 {
 	/* Create the globals */
@@ -478,79 +546,269 @@ int RemoteServer(size_t argc, const char** argv)
 	struct __rs_globals *__globals = &__global_obj;
 
 	GS(mx) = MUTEX_INIT;
-	GS(conn_done) = COND_INIT;
 	
 	GS(quit) = 0;
 	GS(port) = REMOTE_SERVER_DEFAULT_PORT;
+	GS(npending) = 0;
+	GS(running) = 0;
 	GS(active_conn) = 0;
 	GS(total_conn) = 0;
 	GS(conn_id_counter) = 0;
+	GS(linelen) = 0;
 
 	log_init(__globals);
 
-	/* Start a thread to listen on */
-	GS(listener) = CreateThread(rsrv_listener_thread, GS(port), __globals);
-	
-	/* Enter the server console */
-	char* linebuff = NULL;
-	size_t lineblen = 0;
-	FILE* fin = fidopen(0,"r");
-
-	while(1) {
-		printf("Type h for help, or a command: ");
-		int rc;
-		again:
-		rc = getline(&linebuff, &lineblen, fin);
-		if(rc==-1 && ferror(fin) && errno==EINTR) { 
-			clearerr(fin); 
-			goto again; 
-		}
-		if(rc==-1 && feof(fin)) {
+	GS(listener_socket) = Socket(GS(port));
+	if(Listen(GS(listener_socket)) == -1) {
+		printf("Cannot listen to the given port: %d\n", GS(port));
+		return -1;
+	}
+	if(Pipe(& GS(done)) == -1) {
+		printf("Cannot create a pipe\n");
+		return -1;
+	}
+
+	printf("Type h for help, or a command: ");
+	while(! GS(quit) || GS(running) > 0) {
+		pollfd_t fds[3+RS_MAX_PENDING];
+		int quit = GS(quit);
+		fds[0] = (pollfd_t) { .fid = quit ? -1 : 0, .events = POLL_READ };
+		fds[1] = (pollfd_t) { .fid = quit ? -1 : GS(listener_socket), .events = POLL_READ };
+		fds[2] = (pollfd_t) { .fid = GS(done).read, .events = POLL_READ };
+		for(size_t i=0; i<GS(npending); i++)
+			fds[3+i] = (pollfd_t) { .fid = GS(pending)[i].sock, .events = POLL_READ };
+		size_t npending = GS(npending);
+
+		if(Poll(fds, 3+npending, (timeout_t)-1) == -1)
 			break;
-		}
 
-		assert(linebuff!=NULL);
+		/* Connections, starting from the last, since they may be removed */
+		for(size_t i=npending; i>0; i--)
+			if(fds[2+i].revents)
+				rsrv_receive(__globals, i-1);
+
+		if(fds[2].revents)
+			rsrv_reap(__globals);
 
-		if(strcmp(linebuff, "q\n")==0) {
-			/* Quit */
-			GS(quit) = 1;
-			printf("Quitting\n");
-			Close(GS(listener_socket));
-			ThreadJoin(GS(listener), NULL);
+		if(fds[1].revents)
+			rsrv_accept(__globals);
 
-			Mutex_Lock(&GS(mx));
-			while(GS(active_conn)>0) {
-				printf("Waiting %zu connections ...\n", GS(active_conn));
-				Cond_Wait(&GS(mx), &GS(conn_done));
+		if(fds[0].revents) {
+			/* Read console input, and execute each complete line */
+			int rc = Read(0, GS(line)+GS(linelen), sizeof(GS(line))-1-GS(linelen));
+			if(rc <= 0) {
+				rsrv_command(__globals, "q");
+				continue;
+			}
+			GS(linelen) += rc;
+			GS(line)[GS(linelen)] = 0;
+
+			char* nl;
+			while(!GS(quit) && (nl = strchr(GS(line), '\n')) != NULL) {
+				*nl = 0;
+				rsrv_command(__globals, GS(line));
+				GS(linelen) -= (nl+1) - GS(line);
+				memmove(GS(line), nl+1, GS(linelen)+1);
+				if(!GS(quit)) printf("Type h for help, or a command: ");
+			}
+			if(GS(linelen) == sizeof(GS(line))-1) {
+				printf("Line too long\n");
+				GS(linelen) = 0;
 			}
-			Mutex_Unlock(&GS(mx));
-			
-			
-			log_truncate(__globals);
-			break;
-		} else if(strcmp(linebuff, "s\n")==0) {
-			/* Show statistics */
-			printf("Connections: active=%4zd total=%4zd\n", 
-				GS(active_conn), GS(total_conn));
-		} else if(strcmp(linebuff, "h\n")==0) {
-			printf("Commands: \n"
-			       "q: quit the server\n"
-			       "h: print this help\n"
-			       "s: show statistics\n"
-			       "l: show the log\n");
-		} else if(strcmp(linebuff, "l\n")==0) {
-			log_print(__globals);
-		} else if(strcmp(linebuff, "\n")==0) {
-		} else {
-			printf("Unknown command: '%s'\n", linebuff);
 		}
+
+		if(GS(quit) && GS(running) > 0)
+			printf("Waiting %zu connections ...\n", GS(running));
 	}
 
-	fclose(fin);
-	free(linebuff);
+	Close(GS(done).read);
+	Close(GS(done).write);
+	log_truncate(__globals);
 	return 0;
 }
 
+
+/* Execute a console command. Return 1 if the server should quit. */
+static int rsrv_command(void* __globals, const char* cmd)
+{
+	if(strcmp(cmd, "q")==0) {
+		/* Quit */
+		GS(quit) = 1;
+		printf("Quitting\n");
+		Close(GS(listener_socket));
+
+		/* Drop the connections that have not sent a request */
+		for(size_t i=0; i<GS(npending); i++)
+			Close(GS(pending)[i].sock);
+		GS(active_conn) -= GS(npending);
+		GS(npending) = 0;
+	} else if(strcmp(cmd, "s")==0) {
+		/* Show statistics */
+		printf("Connections: active=%4zd total=%4zd\n", 
+			GS(active_conn), GS(total_conn));
+	} else if(strcmp(cmd, "h")==0) {
+		printf("Commands: \n"
+		       "q: quit the server\n"
+		       "h: print this help\n"
+		       "s: show statistics\n"
+		       "l: show the log\n");
+	} else if(strcmp(cmd, "l")==0) {
+		log_print(__globals);
+	} else if(strcmp(cmd, "")==0) {
+	} else {
+		printf("Unknown command: '%s'\n", cmd);
+	}
+	return GS(quit);
+}
+
+
+/* Accept a new connection */
+static void rsrv_accept(void* __globals)
+{
+	Fid_t sock = Accept(GS(listener_socket));
+	if(sock==NOFILE) {
+		log_message(__globals, "listener(port=%d): failed to accept!", GS(port));
+		return;
+	}
+	if(GS(npending) == RS_MAX_PENDING) {
+		log_message(__globals, "listener(port=%d): too many connections, refusing", GS(port));
+		Close(sock);
+		return;
+	}
+
+	struct rs_pending* conn = & GS(pending)[GS(npending)++];
+	conn->sock = sock;
+	conn->ID = ++GS(conn_id_counter);
+	conn->count = 0;
+	GS(active_conn)++;
+	GS(total_conn)++;
+	log_message(__globals, "Client[%6zu]: started", conn->ID);
+}
+
+
+/* Remove a connection from the pending array, closing its socket */
+static void rsrv_drop(void* __globals, size_t i)
+{
+	Close(GS(pending)[i].sock);
+	GS(pending)[i] = GS(pending)[--GS(npending)];
+}
+
+
+/* Helper to execute a remote process */
+static int rsrv_process(size_t argc, const char** argv)
+{
+	checkargs(4);
+	Fid_t sock = atoi(argv[1]);
+	Fid_t done = atoi(argv[2]);
+	size_t ID = atol(argv[3]);
+
+	/* Fix the streams */
+	assert(sock!=0 && sock!=1 && done!=0 && done!=1);
+	Dup2(sock, 0);
+	Dup2(sock, 1);
+	for(Fid_t f=2; f<MAX_FILEID_LIMIT; f++)
+		if(f!=done) Close(f);
+
+	/* (a) find the command */
+	int exitstatus = -1;
+	int c = getprog(4);
+	if(c==-1) {
+		/* This will appear in the rcli console */
+		printf("Error in remote process: Command %s is not found\n", argv[4]);
+	} else {
+		/* Execute */
+		Program proc = COMMANDS[c].prog;
+		WaitChild(Execute(proc, argc-4, argv+4), &exitstatus);
+	}
+
+	/* Report to the server */
+	struct rs_done rec = { .ID = ID, .pid = GetPid(), .exitstatus = exitstatus };
+	Write(done, (char*)&rec, sizeof(rec));
+	return exitstatus;
+}
+
+
+/*
+  Receive more of the request of a connection. The protocol is 
+  [int argl, void* args] where argl is the length of the subsequent 
+  message args. When the request is complete, execute it.
+ */
+static void rsrv_receive(void* __globals, size_t i)
+{
+	struct rs_pending* conn = & GS(pending)[i];
+
+	/* Read the rest of the header, or the rest of the args */
+	char* buf;
+	size_t len;
+	if(conn->count < sizeof(conn->argl)) {
+		buf = (char*)&conn->argl + conn->count;
+		len = sizeof(conn->argl) - conn->count;
+	} else {
+		buf = conn->args + (conn->count - sizeof(conn->argl));
+		len = conn->argl - (conn->count - sizeof(conn->argl));
+	}
+
+	int rc = Read(conn->sock, buf, len);
+	if(rc < 1) {
+		log_message(__globals,
+			    "Client[%6zu]: error in receiving request, aborting", conn->ID);
+		GS(active_conn)--;
+		rsrv_drop(__globals, i);
+		return;
+	}
+	conn->count += rc;
+
+	if(conn->count == sizeof(conn->argl) 
+		&& (conn->argl <= 0 || conn->argl > RS_MAX_ARGL)) {
+		log_message(__globals,
+			    "Client[%6zu]: bad request size %d, aborting", conn->ID, conn->argl);
+		GS(active_conn)--;
+		rsrv_drop(__globals, i);
+		return;
+	}
+	if(conn->count < sizeof(conn->argl) + conn->argl)
+		return;
+
+	/* Prepare to execute subprocess */
+	int argl = conn->argl;
+	size_t argc = argscount(argl, conn->args);
+	const char* argv[argc+4];
+	argv[0] = "rsrv_process";
+	char sock_value[32], done_value[32], id_value[32];
+	sprintf(sock_value, "%d", conn->sock);
+	sprintf(done_value, "%d", GS(done).write);
+	sprintf(id_value, "%zu", conn->ID);
+	argv[1] = sock_value;
+	argv[2] = done_value;
+	argv[3] = id_value;
+	argvunpack(argc, argv+4, argl, conn->args);
+
+	/* Now, execute the message in a new process */
+	if(Execute(rsrv_process, argc+4, argv) == NOPROC) {
+		log_message(__globals, "Client[%6zu]: cannot execute", conn->ID);
+		GS(active_conn)--;
+	}
+	else
+		GS(running)++;
+	rsrv_drop(__globals, i);
+}
+
+
+/* A remote process has finished */
+static void rsrv_reap(void* __globals)
+{
+	struct rs_done rec;
+	if(Read(GS(done).read, (char*)&rec, sizeof(rec)) != sizeof(rec))
+		return;
+
+	WaitChild(rec.pid, NULL);
+	GS(running)--;
+	GS(active_conn)--;
+	log_message(__globals, "Client[%6zu]: finished with status %d",
+		    rec.ID, rec.exitstatus);
+}
+
+
 typedef struct {
 	rlnode node;
 	char message[0];
@@ -620,114 +878,31 @@ static void log_truncate(void* __globals)
 
 
 
-/* Helper to receive a message */
-static int recv_message(Fid_t sock, void* buf, size_t len)
-{
-	size_t count = 0;
-	while(count<len) {
-		int rc = Read(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or end of stream */
-		count += rc;
-	}
-	return count==len;
-}
-
-/* Helper to execute a remote process */
-static int rsrv_process(size_t argc, const char** argv)
-{
-	checkargs(2);
-	Fid_t sock = atoi(argv[1]);
-
-	/* Fix the streams */
-	assert(sock!=0 && sock!=1);	
-	Dup2(sock, 0);
-	Dup2(sock, 1);
-	Close(sock);
-
-	/* (a) find the command */
-	int c = getprog(2);
-	if(c==-1) {
-		/* This will appear in the rcli console */
-		printf("Error in remote process: Command %s is not found\n", argv[2]);
-		return -1;
-	}
-	Program proc = COMMANDS[c].prog;
-
-	/* Execute */
-	int exitstatus;
-	WaitChild(Execute(proc, argc-2, argv+2), &exitstatus);
-	return exitstatus;
-}
-
-/* this server thread serves a remote cliend */
-static int rsrv_client(int sock, void* __globals)
-{
-	/* Get your client id */
-	Mutex_Lock(&GS(mx));
-	size_t ID = ++GS(conn_id_counter);
-	Mutex_Unlock(&GS(mx));
-
-	log_message(__globals, "Client[%6zu]: started", ID);
-	
-        /* Get the command from the client. The protocol is
-	   [int argl, void* args] where argl is the length of
-	   the subsequent message args.
-	 */
-	int argl;
-	if(! recv_message(sock, &argl, sizeof(argl))) {
-		log_message(__globals,
-			    "Cliend[%6zu]: error in receiving request, aborting", ID);
-		goto finish;
-	}
-		
-	assert(argl>0 && argl <= 2048);
-	{
-		char args[argl];
-		if(! recv_message(sock, args, argl)) {
-			log_message(__globals,
-				    "Cliend[%6zu]: error in receiving request, aborting", ID);
-			goto finish;		
-		}
-		
-		/* Prepare to execute subprocess */
-		size_t argc = argscount(argl, args);	
-		const char* argv[argc+2];
-		argv[0] = "rsrv_process";
-		char sock_value[32];
-		sprintf(sock_value, "%d", sock);
-		argv[1] = sock_value;
-		argvunpack(argc, argv+2, argl, args);
-	
-		/* Now, execute the message in a new process */
-		int exitstatus;
-		Pid_t pid = Execute(rsrv_process, argc+2, argv);
-		Close(sock);
-		WaitChild(pid, &exitstatus);
-	
-		log_message(__globals, "Client[%6zu]: finished with status %d",
-			    ID, exitstatus);
-	}
-
-finish:
-	Mutex_Lock(&GS(mx));
-	GS(active_conn)--;
-	Cond_Broadcast(& GS(conn_done));
-	Mutex_Unlock(&GS(mx));
-	return 0;
-}
-
 /*********************
    the client program
 ************************/
 
 /* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+static void send_message(Fid_t sock, iovec_t* iov, unsigned int iovcnt)
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
+	size_t len = 0, count = 0;
+	for(unsigned int i=0; i<iovcnt; i++)
+		len += iov[i].len;
+
+	while(iovcnt>0) {
+		int rc = WriteV(sock, iov, iovcnt);
 		if(rc<1) break;  /* Error or End of stream */
 		count += rc;
+
+		/* Skip what was written */
+		while(iovcnt>0 && (unsigned int)rc >= iov->len) {
+			rc -= iov->len;
+			iov++; iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->base += rc;
+			iov->len -= rc;
+		}
 	}
 	if(count!=len) {
 		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
@@ -754,20 +929,18 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send the header and the message together */
+	iovec_t iov[2] = {
+		{ .base = (char*) &argl, .len = sizeof(argl) },
+		{ .base = args, .len = argl }
+	};
+	send_message(sock, iov, 2);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	/* Relay the server data to the output */
+	while(Splice(sock, 1, 16384) > 0)
+		;
+	Close(sock);
 	return 0;
 }
 
@@ -790,15 +963,6 @@ int process_builtin(int argc, const char** argv)
 }
 
 
-static inline Fid_t savefid(Fid_t fsaved)
-{
-	Fid_t savior = OpenNull();
-	assert(savior!=NOFILE);
-	Dup2(fsaved, savior);
-	return savior;
-}
-
-
 int process_line(int argc, const char** argv)
 {
 	/* Split up into pipeline fragments */
@@ -836,36 +1000,33 @@ int process_line(int argc, const char** argv)
 		comd[i] = c;
 	}
 
-	/* Construct pipeline */
+	/* Construct pipeline. The parent's 0 and 1 are left alone. */
 	int child[frag];
-	int savein, saveout;
-
-	savein = savefid(0);
-	saveout = savefid(1);
+	Fid_t in = NOFILE;	/* the read end of the previous pipe */
 
-	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
+		fd_action act[5];
+		unsigned int nact = 0;
+		pipe_t pipe;
+
+		if(in!=NOFILE) {
+			act[nact++] = (fd_action){ SPAWN_DUP2, in, 0 };
+			act[nact++] = (fd_action){ SPAWN_CLOSE, in, 0 };
+		}
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
 			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			act[nact++] = (fd_action){ SPAWN_DUP2, pipe.write, 1 };
+			act[nact++] = (fd_action){ SPAWN_CLOSE, pipe.write, 0 };
+			act[nact++] = (fd_action){ SPAWN_CLOSE, pipe.read, 0 };
 		}
 
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
+		child[i] = SpawnProgram(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i], act, nact);
 
+		if(in!=NOFILE) Close(in);
 		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
+			Close(pipe.write);
+			in = pipe.read;
 		}
 	}
 
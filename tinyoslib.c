@@ -11,20 +11,146 @@
 
 
 
+/*
+	C streams on file ids.
+
+	A stream opened by fidopen() for writing is buffered by stdio. It is
+	line-buffered on a terminal and fully buffered on pipes, sockets and
+	other streams. Streams opened only for reading are unbuffered, so
+	that a process does not read ahead input meant for its children.
+
+	All processes share the host stdio. Therefore, the buffered streams
+	of each process are listed in a proc_streams record, looked up by pid.
+	The global stdout installed by tinyos_replace_stdio() is unbuffered
+	and forwards each write to a buffered stream of the calling process.
+
+	The line-buffered streams of a process are flushed before it reads,
+	all its streams are flushed before it spawns a program, and they are
+	flushed again when it exits, by a hook registered with AtExit().
+ */
+
+typedef struct proc_streams proc_streams;
+
+/* The cookie of a stream */
+typedef struct fid_stream {
+	Fid_t fid;
+	FILE* file;                 /* The stream, if it is buffered */
+	int line;                   /* Set if the stream is line-buffered */
+	proc_streams* proc;         /* The list holding the stream, or NULL */
+	struct fid_stream* next;
+} fid_stream;
+
+/* The buffered streams of a process */
+struct proc_streams {
+	Mutex mx;                   /* Protects the fields below */
+	fid_stream* list;           /* The streams opened by fidopen() */
+	fid_stream* out;            /* The stream behind the global stdout, or NULL */
+};
+
+static proc_streams* streams_by_pid[MAX_PROC];
+
+
+static void proc_streams_exit();
+
+/* Return the record of the current process, creating it if asked to. */
+static proc_streams* proc_streams_get(int create)
+{
+	Pid_t pid = GetPid();
+	proc_streams* ps = __atomic_load_n(&streams_by_pid[pid], __ATOMIC_ACQUIRE);
+	if(ps != NULL || !create) return ps;
+
+	proc_streams* newps = xmalloc(sizeof(proc_streams));
+	newps->mx = MUTEX_INIT;
+	newps->list = NULL;
+	newps->out = NULL;
+
+	/* Another thread of the process may have won the race */
+	if(! __atomic_compare_exchange_n(&streams_by_pid[pid], &ps, newps, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(newps);
+		return ps;
+	}
+
+	/* Without the exit hook, the record would outlive the process; 
+	   in this case the process stays unbuffered. */
+	if(AtExit(proc_streams_exit) != 0) {
+		__atomic_store_n(&streams_by_pid[pid], NULL, __ATOMIC_RELEASE);
+		free(newps);
+		return NULL;
+	}
+	return newps;
+}
+
+
+/* Flush a stream of the list, unless some thread is using it now. */
+static void flush_listed(fid_stream* s)
+{
+	if(ftrylockfile(s->file) == 0) {
+		fflush_unlocked(s->file);
+		funlockfile(s->file);
+	}
+}
+
+
+/* Flush the (line-buffered) output of the current process */
+static void proc_streams_flush(int line_only)
+{
+	proc_streams* ps = proc_streams_get(0);
+	if(ps == NULL) return;
+
+	Mutex_Lock(&ps->mx);
+	if(ps->out && (ps->out->line || !line_only))
+		fflush_unlocked(ps->out->file);
+	for(fid_stream* s = ps->list; s != NULL; s = s->next)
+		if(s->line || !line_only)
+			flush_listed(s);
+	Mutex_Unlock(&ps->mx);
+}
+
+
+static void proc_streams_exit()
+{
+	Pid_t pid = GetPid();
+	proc_streams* ps = streams_by_pid[pid];
+
+	Mutex_Lock(&ps->mx);
+	if(ps->out)
+		fclose(ps->out->file);
+	for(fid_stream* s = ps->list; s != NULL; s = s->next) {
+		flush_listed(s);
+		s->proc = NULL;
+	}
+	Mutex_Unlock(&ps->mx);
+
+	__atomic_store_n(&streams_by_pid[pid], NULL, __ATOMIC_RELEASE);
+	free(ps);
+}
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	/* Show any pending prompt before waiting for input */
+	proc_streams_flush(1);
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	int ret = Write(((fid_stream*)cookie)->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* s = cookie;
+	proc_streams* ps = s->proc;
+	if(ps != NULL) {
+		Mutex_Lock(&ps->mx);
+		for(fid_stream** p = &ps->list; *p != NULL; p = &(*p)->next)
+			if(*p == s) { *p = s->next; break; }
+		Mutex_Unlock(&ps->mx);
+	}
+	free(s);
 	return 0;
 }
 
@@ -36,25 +162,88 @@ static cookie_io_functions_t  tinyos_fid_functions =
 	tinyos_fid_close
 };
 
+
+static fid_stream* fid_stream_open(Fid_t fid, const char* mode, cookie_io_functions_t funcs)
+{
+	fid_stream* s = xmalloc(sizeof(fid_stream));
+	s->fid = fid;
+	s->line = 0;
+	s->proc = NULL;
+	s->next = NULL;
+	s->file = fopencookie(s, mode, funcs);
+	if(s->file == NULL) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+static void fid_stream_setbuf(fid_stream* s)
+{
+	s->line = (IsTerminal(s->fid) == 1);
+	CHECKRC(setvbuf(s->file, NULL, s->line ? _IOLBF : _IOFBF, BUFSIZ));
+}
+
+
+/* The write function of the global stdout */
+static ssize_t tinyos_stdout_write(void *cookie, const char *buf, size_t size)
+{
+	proc_streams* ps = proc_streams_get(1);
+	if(ps == NULL)
+		return tinyos_fid_write(cookie, buf, size);
+
+	Mutex_Lock(&ps->mx);
+	if(ps->out == NULL) {
+		ps->out = fid_stream_open(((fid_stream*)cookie)->fid, "w", tinyos_fid_functions);
+		assert(ps->out);
+		/* The stream is only used under ps->mx */
+		__fsetlocking(ps->out->file, FSETLOCKING_BYCALLER);
+		fid_stream_setbuf(ps->out);
+	}
+	size_t ret = fwrite_unlocked(buf, 1, size, ps->out->file);
+	Mutex_Unlock(&ps->mx);
+	return ret;
+}
+
+static cookie_io_functions_t  tinyos_stdout_functions =
+{
+	tinyos_fid_read,
+	tinyos_stdout_write,
+	NULL,
+	tinyos_fid_close
+};
+
+
 static FILE* get_std_stream(int fid, const char* mode)
 {
-	FILE* term = fidopen(fid, mode);
-	assert(term);
+	fid_stream* s = fid_stream_open(fid, mode, tinyos_stdout_functions);
+	assert(s);
+	CHECKRC(setvbuf(s->file, NULL, _IONBF, 0));
 	/* This is glibc-specific and tunrs off fstream locking */
-	__fsetlocking(term, FSETLOCKING_BYCALLER);	
-	return term;
+	__fsetlocking(s->file, FSETLOCKING_BYCALLER);	
+	return s->file;
 }
 
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	fid_stream* s = fid_stream_open(fid, mode, tinyos_fid_functions);
+	if(s == NULL) return NULL;
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
+	proc_streams* ps = (strpbrk(mode, "wa+") != NULL) ? proc_streams_get(1) : NULL;
+	if(ps == NULL) {
+		CHECKRC(setvbuf(s->file, NULL, _IONBF, 0));
+		return s->file;
+	}
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
-	return f;
+	fid_stream_setbuf(s);
+	s->proc = ps;
+	Mutex_Lock(&ps->mx);
+	s->next = ps->list;
+	ps->list = s;
+	Mutex_Unlock(&ps->mx);
+	return s->file;
 }
 
 FILE *saved_in = NULL, *saved_out = NULL;
@@ -81,6 +270,7 @@ void tinyos_restore_stdio()
 {
 	if(saved_out == NULL)  return;	
 
+	proc_streams_flush(0);
 	fclose(stdin);
 	fclose(stdout);
 
@@ -146,6 +336,13 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 
 
 int Execute(Program prog, size_t argc, const char** argv)
+{
+	return SpawnProgram(prog, argc, argv, NULL, 0);
+}
+
+
+int SpawnProgram(Program prog, size_t argc, const char** argv, 
+	const fd_action* actions, unsigned int n)
 {
 	/* We will pack the prog pointer and the arguments to 
 	  an argument buffer.
@@ -163,8 +360,11 @@ int Execute(Program prog, size_t argc, const char** argv)
 	/* add the string vector */
 	argvpack(args+sizeof(prog), argc, argv);
 
+	/* Output written so far must precede the output of the child */
+	proc_streams_flush(0);
+
 	/* Execute the process */
-	return Exec(exec_wrapper, argl, args);
+	return Spawn(exec_wrapper, argl, args, actions, n);
 }
 
 
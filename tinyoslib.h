@@ -18,6 +18,15 @@
 
 	This call returns a new FILE pointer on success and NULL
 	on failure.
+
+	A stream opened for writing is line-buffered if @c fid is a terminal
+	(see @ref IsTerminal) and fully buffered otherwise; this can be changed
+	by @c setvbuf. A stream opened only for reading is unbuffered, so that
+	input is not taken away from other processes reading the same file.
+
+	The line-buffered output of a process is flushed before it reads 
+	from a stream, and all of its output is flushed before it spawns a 
+	program by @ref SpawnProgram and when it exits.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
@@ -43,6 +52,16 @@ typedef int (*Program)(size_t argc, const char** argv);
   */
 int Execute(Program prog, size_t argc, const char** argv);
 
+/**
+	@brief Execute a new process as @ref Execute, with file id actions.
+
+	The underlying implementation uses the Spawn system call, so that
+	the file ids of the new process are arranged by the @c n actions
+	of @c actions, without affecting the current process.
+  */
+int SpawnProgram(Program prog, size_t argc, const char** argv, 
+	const fd_action* actions, unsigned int n);
+
 
 /**
 	@brief Try to reclaim the arguments of a process.
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <sched.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -70,6 +71,51 @@ BARE_TEST(test_boot,
 
 
 
+/*
+	test_vm_affinity
+
+	Test that the cores of a VM with VM_AFFINITY_AUTO run on their host CPUs.
+ */
+
+static volatile int affinity_errors;
+
+static void affinity_bootfunc()
+{
+	int cpu = cpu_core_host_cpu(cpu_core_id);
+	if(cpu < 0 || sched_getcpu() != cpu)
+		__atomic_fetch_add(&affinity_errors, 1, __ATOMIC_RELAXED);
+	if(cpu_core_distance(cpu_core_id, cpu_core_id) != 0)
+		__atomic_fetch_add(&affinity_errors, 1, __ATOMIC_RELAXED);
+	for(uint c=0; c<cpu_cores(); c++) {
+		int d = cpu_core_distance(cpu_core_id, c);
+		if(d != cpu_core_distance(c, cpu_core_id) || (c!=cpu_core_id && d==0))
+			__atomic_fetch_add(&affinity_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+BARE_TEST(test_vm_affinity,
+	"Test that the core threads of a VM configured with VM_AFFINITY_AUTO run\n"
+	"on the host CPUs reported by cpu_core_host_cpu(), and that the affinity\n"
+	"of the calling thread is restored."
+	)
+{
+	cpu_set_t before, after;
+	ASSERT(sched_getaffinity(0, sizeof(before), &before)==0);
+
+	vm_config vmc;
+	vm_configure(&vmc, affinity_bootfunc, 4, 0);
+	vmc.affinity = VM_AFFINITY_AUTO;
+	affinity_errors = 0;
+	vm_run(&vmc);
+	ASSERT(affinity_errors == 0);
+
+	ASSERT(sched_getaffinity(0, sizeof(after), &after)==0);
+	ASSERT(CPU_EQUAL(&before, &after));
+	ASSERT(cpu_core_host_cpu(0) == -1);
+}
+
+
+
 
 /*********************************************
  *
@@ -271,6 +317,30 @@ BOOT_TEST(test_wait_for_any_child,
 }
 
 
+BOOT_TEST(test_exec_many_live_children,
+	"Test that many processes can be alive at once, and that the pids\n"
+	"of processes that have been waited for are reused."
+	)
+{
+#define NCHILDREN 1000
+	static Pid_t pids[NCHILDREN];
+	for(int i=0; i<NCHILDREN; i++) {
+		pids[i] = Exec(void_child, 0, NULL);
+		ASSERT(pids[i] != NOPROC);
+		if(i>0) ASSERT(pids[i] != pids[i-1]);
+	}
+	for(int i=0; i<NCHILDREN; i++)
+		ASSERT(WaitChild(pids[i], NULL)==pids[i]);
+
+	/* The table did not grow past the children */
+	Pid_t cpid = Exec(void_child, 0, NULL);
+	ASSERT(cpid > 1 && cpid < NCHILDREN+2);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+	return 0;
+#undef NCHILDREN
+}
+
+
 int exiting_child(int arg, void* args) {
 	Exit(GetPid());
 	ASSERT(0);
@@ -356,6 +426,40 @@ BOOT_TEST(test_orphans_adopted_by_init,
 }
 
 
+static int blocked_orphan(int argl, void* args)
+{
+	char c;
+	ASSERT(Read(argl, &c, 1)==1);
+	return GetPPid();
+}
+static int orphaning_child(int argl, void* args)
+{
+	return Exec(blocked_orphan, argl, NULL);
+}
+
+
+BOOT_TEST(test_live_orphans_adopted_by_init,
+	"Test that init can wait for a specific live orphan, and that the\n"
+	"orphan sees init as its parent."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	Pid_t cpid = Exec(orphaning_child, p.read, NULL);
+	Pid_t gpid;
+	ASSERT(WaitChild(cpid, &gpid)==cpid);
+	ASSERT(gpid != NOPROC);
+
+	ASSERT(Write(p.write, "x", 1)==1);
+	int status;
+	ASSERT(WaitChild(gpid, &status)==gpid);
+	ASSERT(status==1);
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -510,6 +614,234 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+BOOT_TEST(test_cond_broadcast_unlocked,
+	"Test that a broadcast made without holding the mutex wakes up all waiters."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar pcv = COND_INIT;
+	int flag=0;
+
+	const int N=100;
+	struct long_blocking_args A = {.m=&m, .cv=&cv, .pcv=&pcv, .flag=&flag };
+
+	for(int i=0; i<N; i++) Exec(long_blocking2, sizeof(A), &A);
+
+	Mutex_Lock(&m);
+	while(flag!=N) Cond_Wait(&m, &pcv);
+	Mutex_Unlock(&m);
+
+	/* The children are all sleeping on cv */
+	Cond_Broadcast(&cv);
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_timedwait_many,
+	"Test that many timed waits, registered in arbitrary order and mixed with\n"
+	"timed waits cancelled by broadcast, terminate after their own timeout."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar pcv = COND_INIT;
+	int flag=0;
+
+	const int N=50;
+	struct long_blocking_args A = {.m=&m, .cv=&cv, .pcv=&pcv, .flag=&flag };
+
+	for(int i=0; i<N; i++) {
+		/* visit the timeouts 300..790 in a scrambled order */
+		timeout_t t = 300 + 10*((i*17) % N);
+		Exec(do_timeout, sizeof(t), &t);
+		Exec(long_blocking2, sizeof(A), &A);
+	}
+
+	Mutex_Lock(&m);
+	while(flag!=N) Cond_Wait(&m, &pcv);
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&m);
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+struct mutex_contention_args {
+	Mutex* m;
+	volatile int* counter;
+};
+
+static int mutex_contention_child(int argl, void* args)
+{
+	struct mutex_contention_args A = *(struct mutex_contention_args*)args;
+	CondVar cv = COND_INIT;
+	for(int i=0; i<20000; i++) {
+		Mutex_Lock(A.m);
+		/* Now and then, release the mutex by sleeping */
+		if(i % 1000 == 0) 
+			Cond_TimedWait(A.m, &cv, 1);
+		int c = *A.counter;
+		*A.counter = c+1;
+		Mutex_Unlock(A.m);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a contended mutex provides mutual exclusion, when waiters\n"
+	"are parked and the mutex is handed over to them."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	volatile int counter = 0;
+	struct mutex_contention_args A = { .m=&m, .counter=&counter };
+
+	const int N = 8;
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(mutex_contention_child, sizeof(A), &A) != NOPROC);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(counter == N*20000);
+	ASSERT(m == MUTEX_INIT);
+	return 0;
+}
+
+
+BOOT_TEST(test_scheduler_stats,
+	"Test that GetThreadStats() and GetCoreStats() account for the run time\n"
+	"of the current thread and the switches caused by a timed wait."
+	)
+{
+	thread_stats ts;
+	core_stats cs;
+
+	ASSERT(GetThreadStats((Tid_t)&ts, &ts)==-1);
+	ASSERT(GetCoreStats(cpu_cores(), &cs)==-1);
+
+	/* Run for a while */
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+	} while(tspec2msec(t2)-tspec2msec(t1) < 20);
+
+	/* Block for a while */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+
+	ASSERT(GetThreadStats(NOTHREAD, &ts)==0);
+	ASSERT(ts.run_time >= 10000);
+	ASSERT(ts.switches[SWITCH_USER] >= 1);
+	ASSERT(ts.voluntary >= ts.switches[SWITCH_USER]);
+	ASSERT(ts.voluntary + ts.involuntary >= 1);
+
+	unsigned long busy = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		ASSERT(GetCoreStats(c, &cs)==0);
+		busy += cs.busy_time;
+	}
+	ASSERT(busy >= 10000);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_get_time,
+	"Test that the clocks of GetTime() are monotonic, and measure a timed wait\n"
+	"to within a few msec."
+	)
+{
+	unsigned long t0, t1, f0, f1;
+	ASSERT(GetTime(TIME_MONOTONIC, &t0)==0);
+	ASSERT(GetTime(TIME_FAST, &f0)==0);
+	ASSERT(GetTime((time_clock)7, &t1)==-1);
+
+	for(int i=0; i<1000; i++) {
+		ASSERT(GetTime(TIME_MONOTONIC, &t1)==0 && t1 >= t0);
+		ASSERT(GetTime(TIME_FAST, &f1)==0 && f1 >= f0);
+		t0 = t1;  f0 = f1;
+	}
+
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	ASSERT(GetTime(TIME_MONOTONIC, &t0)==0);
+	ASSERT(GetTime(TIME_FAST, &f0)==0);
+	Cond_TimedWait(&m, &cv, 20);
+	ASSERT(GetTime(TIME_MONOTONIC, &t1)==0);
+	ASSERT(GetTime(TIME_FAST, &f1)==0);
+	Mutex_Unlock(&m);
+
+	ASSERT(t1-t0 >= 20000 && t1-t0 < 100000);
+	ASSERT(f1-f0 >= 19000 && f1-f0 < 100000);
+	return 0;
+}
+
+
+static int find_syscall(const char* name, syscall_stats* st)
+{
+	for(unsigned int sysno=0; GetSyscallStats(sysno, st)==0; sysno++)
+		if(strcmp(st->name, name)==0) return sysno;
+	return -1;
+}
+
+static int sleep_a_while(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, argl);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+BOOT_TEST(test_syscall_stats,
+	"Test that GetSyscallStats() counts the calls and the sleeps of system calls,\n"
+	"and that the latency histograms agree with the counts."
+	)
+{
+	syscall_stats st;
+
+	int getpid = find_syscall("GetPid", &st);
+	int waitchild = find_syscall("WaitChild", &st);
+	ASSERT(getpid >= 0 && waitchild >= 0);
+
+	ASSERT(GetSyscallStats(getpid, &st)==0);
+	unsigned long calls = st.calls;
+	for(int i=0; i<1000; i++)
+		GetPid();
+	ASSERT(GetSyscallStats(getpid, &st)==0);
+	ASSERT(st.calls==calls+1000);
+	ASSERT(st.lock_time <= st.service_time);
+
+	unsigned long service = 0, lock = 0;
+	for(int b=0; b<SYSCALL_HIST_BUCKETS; b++) {
+		service += st.service_hist[b];
+		lock += st.lock_hist[b];
+	}
+	ASSERT(service==st.calls && lock==st.calls);
+
+	/* A WaitChild for a sleeping child sleeps, for about as long as the child */
+	ASSERT(GetSyscallStats(waitchild, &st)==0);
+	syscall_stats before = st;
+	ASSERT(Exec(sleep_a_while, 20, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	ASSERT(GetSyscallStats(waitchild, &st)==0);
+	ASSERT(st.calls == before.calls+1);
+	ASSERT(st.sleeps >= before.sleeps+1);
+	ASSERT(st.service_time - before.service_time >= 10000000);
+
+	return 0;
+}
+
+
 /*********************************************
  *
  *
@@ -549,7 +881,7 @@ BOOT_TEST(test_dup2_error_on_invalid_fid,
 	Fid_t fid = OpenNull(0);
 	assert(fid!=NOFILE);
 	ASSERT(Dup2(fid, NOFILE)==-1);
-	ASSERT(Dup2(fid, MAX_FILEID)==-1);		
+	ASSERT(Dup2(fid, MAX_FILEID_LIMIT)==-1);		
 	return 0;
 }
 
@@ -572,7 +904,7 @@ BOOT_TEST(test_close_error_on_invalid_fid,
 	)
 {
 	ASSERT(Close(NOFILE)==-1);
-	ASSERT(Close(MAX_FILEID)==-1);
+	ASSERT(Close(MAX_FILEID_LIMIT)==-1);
 	return 0;
 }
 
@@ -583,6 +915,46 @@ BOOT_TEST(test_close_success_on_valid_nonfile_fid,
 {
 	for(Fid_t i=0; i<MAX_FILEID; i++)
 		ASSERT(Close(i)==0);
+	/* Also beyond the size of the table */
+	ASSERT(Close(MAX_FILEID)==0);
+	ASSERT(Close(MAX_FILEID_LIMIT-1)==0);
+	return 0;
+}
+
+static int check_inherited_fid(int argl, void* args)
+{
+	ASSERT(Dup2(argl, 0)==0);
+	ASSERT(Close(argl)==0);
+	ASSERT(Close(MAX_FILEID_LIMIT)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_fid_table_grows,
+	"Test that more than MAX_FILEID files can be opened, that the lowest free\n"
+	"fid is always returned, and that children inherit the whole table."
+	)
+{
+	for(Fid_t i=0; i<2*MAX_FILEID; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(Close(MAX_FILEID+1)==0);
+	ASSERT(Close(3)==0);
+	ASSERT(OpenNull()==3);
+	ASSERT(OpenNull()==MAX_FILEID+1);
+	ASSERT(Dup2(0, MAX_FILEID_LIMIT)==-1);
+
+	Fid_t last = 2*MAX_FILEID-1;
+	Pid_t pid = Exec(check_inherited_fid, last, NULL);
+	int status = -1;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==0);
+
+	/* The child has not closed our copy */
+	ASSERT(Dup2(last, 0)==0);
+
+	/* Dup2 grows the table, as a SPAWN_DUP2 action does */
+	ASSERT(Dup2(0, 4*MAX_FILEID)==0);
+	ASSERT(Close(4*MAX_FILEID)==0);
+	ASSERT(OpenNull()==2*MAX_FILEID);
 	return 0;
 }
 
@@ -760,6 +1132,249 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+struct spawn_test_args {
+	Fid_t closed;
+	char text[1000];
+};
+
+static int spawned_writer(int argl, void* args)
+{
+	ASSERT(argl==sizeof(struct spawn_test_args));
+	struct spawn_test_args* a = args;
+	ASSERT(Close(a->closed)==0);
+	ASSERT(Dup2(a->closed, 5)==-1);
+	ASSERT(Write(1, a->text, sizeof(a->text))==sizeof(a->text));
+	return 0;
+}
+
+static int bad_spawner(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	fd_action bad[] = { { SPAWN_CLOSE, fid, 0 }, { SPAWN_DUP2, fid, 3 } };
+	for(int i=0; i<1000; i++)
+		ASSERT(Spawn(void_child, 0, NULL, bad, 2)==NOPROC);
+	return 0;
+}
+
+BOOT_TEST(test_spawn_fd_actions,
+	"Test that Spawn applies the file id actions to the child only, copies\n"
+	"long arguments, and fails without creating a process on a bad action."
+	)
+{
+	/* Keep the pipe away from fids 0 and 1 */
+	ASSERT(OpenNull()==0);
+	ASSERT(OpenNull()==1);
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	struct spawn_test_args a;
+	a.closed = p.read;
+	for(uint i=0; i<sizeof(a.text); i++) a.text[i] = 'a' + i%26;
+
+	fd_action act[] = {
+		{ SPAWN_DUP2, p.write, 1 },
+		{ SPAWN_CLOSE, p.write, 0 },
+		{ SPAWN_CLOSE, p.read, 0 }
+	};
+	Pid_t cpid = Spawn(spawned_writer, sizeof(a), &a, act, 3);
+	ASSERT(cpid!=NOPROC);
+
+	/* Our table is not affected */
+	ASSERT(Close(p.write)==0);
+	char buf[sizeof(a.text)];
+	uint got = 0;
+	int rc;
+	while((rc = Read(p.read, buf+got, sizeof(buf)-got)) > 0) got += rc;
+	ASSERT(rc==0 && got==sizeof(buf));
+	ASSERT(memcmp(buf, a.text, sizeof(buf))==0);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+
+	/* Bad actions */
+	fd_action bad1[] = { { SPAWN_CLOSE, p.read, 0 }, { SPAWN_DUP2, p.read, 3 } };
+	ASSERT(Spawn(void_child, 0, NULL, bad1, 2)==NOPROC);
+	fd_action bad2[] = { { SPAWN_DUP2, p.read, MAX_FILEID_LIMIT } };
+	ASSERT(Spawn(void_child, 0, NULL, bad2, 1)==NOPROC);
+	ASSERT(Spawn(void_child, 0, NULL, NULL, 1)==NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+
+	/* A failed Spawn is never seen as a child, even by a concurrent WaitChild */
+	Tid_t t = CreateThread(bad_spawner, sizeof(Fid_t), &p.read);
+	for(int i=0; i<1000; i++)
+		ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A target beyond the table size */
+	fd_action far[] = { { SPAWN_DUP2, p.read, 3*MAX_FILEID } };
+	cpid = Spawn(void_child, 0, NULL, far, 1);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+	return 0;
+}
+
+
+BOOT_TEST(test_open_info,
+	"Test that OpenInfo returns a record for each process, in pid order,\n"
+	"across several batches, and that the records are complete."
+	)
+{
+#define NCHILDREN 50
+	int arg = 42;
+	for(int i=0; i<NCHILDREN; i++)
+		ASSERT(Exec(exiting_child, sizeof(arg), &arg)!=NOPROC);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+
+	procinfo info;
+	Pid_t last = NOPROC;
+	int children = 0, found_self = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.pid > last);
+		last = info.pid;
+		if(info.pid == GetPid()) {
+			found_self = 1;
+			ASSERT(info.alive && info.thread_count==1);
+			ASSERT(info.run_time > 0 || info.voluntary+info.involuntary > 0);
+		}
+		if(info.ppid == GetPid()) {
+			children++;
+			ASSERT(info.alive || info.thread_count==0);
+			if(info.alive) {
+				ASSERT(info.main_task == exiting_child);
+				ASSERT(info.argl == sizeof(arg) && memcmp(info.args, &arg, sizeof(arg))==0);
+			}
+		}
+	}
+	ASSERT(found_self && children==NCHILDREN);
+	ASSERT(Read(finfo, (char*) &info, sizeof(info))==0);
+	ASSERT(Close(finfo)==0);
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+#undef NCHILDREN
+}
+
+
+BOOT_TEST(test_shm_segment,
+	"Test that a shared memory segment is zero-filled, that it can be attached\n"
+	"several times, and that it outlives its file id while attached."
+	)
+{
+	unsigned int size = 0;
+
+	ASSERT(ShmCreate(0)==NOFILE);
+	ASSERT(ShmCreate(SHM_MAX_SIZE+1)==NOFILE);
+	ASSERT(ShmAttach(NOFILE, NULL)==NULL);
+	ASSERT(ShmAttach(MAX_FILEID, NULL)==NULL);
+	ASSERT(ShmDetach(NULL)==-1);
+
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull!=NOFILE);
+	ASSERT(ShmAttach(fnull, NULL)==NULL);
+	ASSERT(Close(fnull)==0);
+
+	Fid_t fshm = ShmCreate(10000);
+	ASSERT(fshm!=NOFILE);
+	char* p = ShmAttach(fshm, &size);
+	ASSERT(p!=NULL && size==10000);
+	for(int i=0; i<10000; i++)
+		ASSERT(p[i]==0);
+
+	char buf[4];
+	ASSERT(Read(fshm, buf, sizeof(buf))==-1);
+	ASSERT(Write(fshm, buf, sizeof(buf))==-1);
+
+	/* A second attachment sees the same memory */
+	ASSERT(ShmAttach(fshm, NULL)==p);
+	strcpy(p, "shared");
+	ASSERT(ShmDetach(p)==0);
+
+	/* The segment survives the close of its file id */
+	ASSERT(Close(fshm)==0);
+	ASSERT(strcmp(p, "shared")==0);
+	ASSERT(ShmDetach(p)==0);
+	ASSERT(ShmDetach(p)==-1);
+
+	/* Segments left attached are detached at exit */
+	fshm = ShmCreate(1);
+	ASSERT(fshm!=NOFILE && ShmAttach(fshm, NULL)!=NULL);
+	return 0;
+}
+
+
+/* A bounded buffer of large blocks, as a monitor in a shared memory segment */
+#define SHM_BLOCK 4096
+#define SHM_SLOTS 4
+#define SHM_BLOCKS 64
+
+struct shm_channel {
+	Mutex mx;
+	CondVar not_empty, not_full;
+	unsigned int head, tail;
+	char block[SHM_SLOTS][SHM_BLOCK];
+};
+
+static int shm_consumer(int argl, void* args)
+{
+	Fid_t fshm = *(Fid_t*)args;
+	struct shm_channel* ch = ShmAttach(fshm, NULL);
+	ASSERT(ch!=NULL);
+	ASSERT(Close(fshm)==0);
+
+	for(int b=0; b<SHM_BLOCKS; b++) {
+		Mutex_Lock(&ch->mx);
+		while(ch->head == ch->tail)
+			Cond_Wait(&ch->mx, &ch->not_empty);
+		char* block = ch->block[ch->head % SHM_SLOTS];
+		for(int i=0; i<SHM_BLOCK; i++)
+			ASSERT(block[i]==(char)(b+i));
+		ch->head++;
+		Cond_Broadcast(&ch->not_full);
+		Mutex_Unlock(&ch->mx);
+	}
+
+	ASSERT(ShmDetach(ch)==0);
+	return 0;
+}
+
+BOOT_TEST(test_shm_monitor,
+	"Test a producer and a consumer process exchanging blocks through a\n"
+	"monitor in a shared memory segment, without copies through the kernel."
+	)
+{
+	Fid_t fshm = ShmCreate(sizeof(struct shm_channel));
+	ASSERT(fshm!=NOFILE);
+	struct shm_channel* ch = ShmAttach(fshm, NULL);
+	ASSERT(ch!=NULL);
+
+	Pid_t cpid = Exec(shm_consumer, sizeof(fshm), &fshm);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(Close(fshm)==0);
+
+	for(int b=0; b<SHM_BLOCKS; b++) {
+		Mutex_Lock(&ch->mx);
+		while(ch->tail - ch->head == SHM_SLOTS)
+			Cond_Wait(&ch->mx, &ch->not_full);
+		char* block = ch->block[ch->tail % SHM_SLOTS];
+		for(int i=0; i<SHM_BLOCK; i++)
+			block[i] = (char)(b+i);
+		ch->tail++;
+		Cond_Broadcast(&ch->not_empty);
+		Mutex_Unlock(&ch->mx);
+	}
+
+	int exitval;
+	ASSERT(WaitChild(cpid, &exitval)==cpid && exitval==0);
+	ASSERT(ch->head==SHM_BLOCKS);
+	ASSERT(ShmDetach(ch)==0);
+	return 0;
+}
+
+#undef SHM_BLOCK
+#undef SHM_SLOTS
+#undef SHM_BLOCKS
+
+
 BOOT_TEST(test_null_device,
 	"Test the null device."
 	)
@@ -902,12 +1517,79 @@ BOOT_TEST(test_write_to_many_terminals,
 
 
 
+BOOT_TEST(test_is_terminal,
+	"Test that IsTerminal tells terminals apart from other streams."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(IsTerminal(p.read)==0);
+	ASSERT(IsTerminal(p.write)==0);
+	Fid_t fnull = OpenNull();
+	ASSERT(IsTerminal(fnull)==0);
+	ASSERT(IsTerminal(NOFILE)==-1);
+	ASSERT(Close(fnull)==0);
+	ASSERT(IsTerminal(fnull)==-1);
+
+	if(GetTerminalDevices()>0) {
+		Fid_t fterm = OpenTerminal(0);
+		ASSERT(IsTerminal(fterm)==1);
+	}
+	return 0;
+}
+
+
+static Fid_t exit_hook_fid;
+static void exit_hook_noop() { }
+static void exit_hook_1() { Write(exit_hook_fid, "1", 1); }
+static void exit_hook_2() { Write(exit_hook_fid, "2", 1); }
+static void exit_hook_3() 
+{ 
+	Write(exit_hook_fid, "3", 1); 
+	/* Hooks may be registered while the hooks run */
+	ASSERT_MSG(AtExit(exit_hook_1)==0, "A hook could not re-register");
+}
+
+static int exit_hook_child(int argl, void* args)
+{
+	ASSERT(AtExit(NULL)==-1);
+	for(int i=0; i<MAX_EXIT_HOOKS-3; i++)
+		ASSERT(AtExit(exit_hook_noop)==0);
+	ASSERT(AtExit(exit_hook_1)==0);
+	ASSERT(AtExit(exit_hook_2)==0);
+	ASSERT(AtExit(exit_hook_3)==0);
+	ASSERT(AtExit(exit_hook_noop)==-1);
+	Exit(0);
+	return 0;
+}
+
+BOOT_TEST(test_atexit,
+	"Test that the exit hooks of a process run in reverse order of registration, before "
+	"its files are closed."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	exit_hook_fid = p.write;
+	ASSERT(Exec(exit_hook_child, 0, NULL)!=NOPROC);
+	ASSERT(Close(p.write)==0);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	char buf[8];
+	ASSERT(Read(p.read, buf, sizeof(buf))==4);
+	ASSERT(memcmp(buf, "3121", 4)==0);
+	ASSERT(Read(p.read, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
 TEST_SUITE(basic_tests, 
 	"A suite of basic tests, focusing on the functional behaviour of the\n"
 	"tinyos3 API, but not the operational (concurrency and I/O multiplexing)."
 	)
 {
 	&test_boot,
+	&test_vm_affinity,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
@@ -916,10 +1598,18 @@ TEST_SUITE(basic_tests,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
+	&test_exec_many_live_children,
 	&test_orphans_adopted_by_init,
+	&test_live_orphans_adopted_by_init,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_unlocked,
+	&test_cond_timedwait_many,
+	&test_mutex_contention,
+	&test_scheduler_stats,
+	&test_get_time,
+	&test_syscall_stats,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -928,6 +1618,7 @@ TEST_SUITE(basic_tests,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
+	&test_fid_table_grows,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
@@ -938,6 +1629,12 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_spawn_fd_actions,
+	&test_open_info,
+	&test_shm_segment,
+	&test_shm_monitor,
+	&test_is_terminal,
+	&test_atexit,
 	NULL
 };
 
@@ -1398,7 +2095,233 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
-TEST_SUITE(thread_tests, 
+static int tid_recycling_task(int argl, void* args) {
+	return argl;
+}
+
+BOOT_TEST(test_tid_recycling,
+	"Test that many threads can be created and joined, that detached threads\n"
+	"leave nothing behind, and that the tids of joined threads are not valid\n"
+	"for the threads that reuse their slots."
+	)
+{
+#define NTHREADS 100
+	Tid_t tids[NTHREADS];
+	for(int i=0; i<NTHREADS; i++) {
+		tids[i] = CreateThread(tid_recycling_task, i, NULL);
+		ASSERT(tids[i]!=NOTHREAD && tids[i]!=ThreadSelf());
+	}
+	for(int i=0; i<NTHREADS; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0 && exitval==i);
+	}
+
+	/* Detaching fails if the thread has already exited */
+	for(int round=0; round<10; round++)
+		for(int i=0; i<NTHREADS; i++)
+			ThreadDetach(CreateThread(tid_recycling_task, i, NULL));
+
+	for(int i=0; i<NTHREADS; i++) {
+		Tid_t t = CreateThread(tid_recycling_task, i, NULL);
+		ASSERT(t != tids[i]);
+		ASSERT(ThreadJoin(tids[i], NULL)==-1);
+		ASSERT(ThreadDetach(tids[i])==-1);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	return 0;
+#undef NTHREADS
+}
+
+
+static int symposium_stats_philosopher(int i, void* S)
+{
+	SymposiumTable_philosopher((SymposiumTable*) S, i);
+	return 0;
+}
+
+BOOT_TEST(test_symposium_stats,
+	"Test that the monitor and the sharded symposium feed each philosopher\n"
+	"all its bites, and account for them in the wait-time histograms."
+	)
+{
+	for(int sharded=0; sharded<2; sharded++) {
+		symposium_t symp = { .N = 200, .bites = 5, 
+			.flags = SYMP_QUIET | (sharded ? SYMP_SHARDED : 0) };
+		adjust_symposium(&symp, -10, 0);
+
+		SymposiumTable S;
+		SymposiumTable_init(&S, &symp);
+		Tid_t tids[symp.N];
+		for(int i=0; i<symp.N; i++)
+			ASSERT((tids[i] = CreateThread(symposium_stats_philosopher, i, &S)) != NOTHREAD);
+		for(int i=0; i<symp.N; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+		for(int i=0; i<symp.N; i++) {
+			philosopher_stats* st = &S.stats[i];
+			ASSERT(S.state[i] == NOTHERE);
+			ASSERT(st->bites == symp.bites);
+			unsigned long n = 0;
+			for(int k=0; k<SYMP_HIST_BUCKETS; k++) n += st->hist[k];
+			ASSERT(n == st->bites);
+			ASSERT(st->wait_max <= st->wait_total);
+		}
+		SymposiumTable_destroy(&S);
+	}
+	return 0;
+}
+
+
+/* The core of the current thread, read while it cannot move */
+static uint current_core()
+{
+	int pre = cpu_disable_interrupts();
+	uint core = cpu_core_id;
+	if(pre) cpu_enable_interrupts();
+	return core;
+}
+
+/* Check that the thread affinity is the mask in args, and that it is respected */
+static int affinity_check(int argl, void* args)
+{
+	core_mask expected, mask;
+	ASSERT(argl==sizeof(core_mask));
+	memcpy(&expected, args, argl);
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0 && mask==expected);
+	for(int i=0; i<1000; i++)
+		ASSERT((mask >> current_core()) & 1);
+	return 0;
+}
+
+static volatile int affinity_stop;
+static volatile int affinity_arrived;
+
+/* Spin until stopped. Return 1 if the thread left core argl after arriving there. */
+static int affinity_spinner(int argl, void* args)
+{
+	int strayed = 0;
+	while(! affinity_stop) {
+		uint core = current_core();
+		if(core == argl)
+			affinity_arrived = 1;
+		else if(affinity_arrived)
+			strayed = 1;
+	}
+	return strayed;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetAffinity restricts the cores a thread runs on, that the\n"
+	"affinity is inherited by new threads and processes, and that a running\n"
+	"thread moves when its affinity changes."
+	)
+{
+	uint ncores = cpu_cores();
+	core_mask all = (ncores == 32) ? ALL_CORES : (1u << ncores) - 1;
+	core_mask mask;
+
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0 && mask==all);
+	ASSERT(SetAffinity(NOTHREAD, 0)==-1);
+	if(ncores < 32)
+		ASSERT(SetAffinity(NOTHREAD, 1u << ncores)==-1);
+	ASSERT(SetAffinity(ThreadSelf()+1, all)==-1);
+	ASSERT(GetAffinity(ThreadSelf()+1, &mask)==-1);
+
+	/* Extra cores are dropped */
+	ASSERT(SetAffinity(NOTHREAD, ALL_CORES)==0);
+	ASSERT(GetAffinity(ThreadSelf(), &mask)==0 && mask==all);
+
+	/* The current thread moves at once */
+	for(uint c = 0; c < ncores; c++) {
+		ASSERT(SetAffinity(NOTHREAD, 1u << c)==0);
+		for(int i=0; i<1000; i++)
+			ASSERT(current_core()==c);
+	}
+
+	/* New threads and processes inherit the affinity */
+	mask = 1u << (ncores-1);
+	ASSERT(SetAffinity(NOTHREAD, mask)==0);
+	int exitval;
+	Tid_t t = CreateThread(affinity_check, sizeof(mask), &mask);
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+	Pid_t pid = Exec(affinity_check, sizeof(mask), &mask);
+	ASSERT(WaitChild(pid, &exitval)==pid && exitval==0);
+	ASSERT(SetAffinity(NOTHREAD, all)==0);
+
+	/* A running thread moves when its affinity changes */
+	affinity_stop = 0;
+	affinity_arrived = 0;
+	t = CreateThread(affinity_spinner, 0, NULL);
+	ASSERT(SetAffinity(t, 1u << 0)==0);
+	ASSERT(GetAffinity(t, &mask)==0 && mask==1);
+	while(! affinity_arrived)
+		sleep_a_while(1, NULL);
+	for(int i=0; i<10; i++)
+		sleep_a_while(1, NULL);
+	affinity_stop = 1;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+	ASSERT(SetAffinity(t, all)==-1);
+	return 0;
+}
+
+
+static int reserved_init_affinity;
+static int reserved_task_affinity;
+static int reserved_child_affinity;
+
+static int reserved_child(int argl, void* args)
+{
+	core_mask mask;
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0);
+	reserved_child_affinity = mask;
+	return 0;
+}
+
+static int reserved_task(int argl, void* args)
+{
+	core_mask mask;
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0);
+	reserved_task_affinity = mask;
+	for(int i=0; i<1000; i++)
+		ASSERT((mask >> current_core()) & 1);
+
+	/* Descendants stay in the reservation */
+	ASSERT(Exec(reserved_child, 0, NULL)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+static int reserved_init(int argl, void* args)
+{
+	core_mask mask;
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0);
+	reserved_init_affinity = mask;
+	ASSERT(Exec(reserved_task, 0, NULL)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+BARE_TEST(test_boot_reserve_cores,
+	"Test that boot_reserve_cores partitions the cores between the processes\n"
+	"of a task, the interrupts and the rest, for one boot."
+	)
+{
+	/* Core 0 for interrupts, core 2 for reserved_task, and cores 1 and 3 for the rest */
+	ASSERT(boot_reserve_cores(NULL, 1u << 0)==0);
+	ASSERT(boot_reserve_cores(reserved_task, 1u << 2)==0);
+	boot(4, 0, reserved_init, 0, NULL);
+	ASSERT(reserved_init_affinity == 0xA);
+	ASSERT(reserved_task_affinity == 0x4);
+	ASSERT(reserved_child_affinity == 0x4);
+
+	/* The reservations were dropped */
+	boot(4, 0, reserved_init, 0, NULL);
+	ASSERT(reserved_init_affinity == 0xF);
+	ASSERT(reserved_task_affinity == 0xF);
+}
+
+
+TEST_SUITE(thread_tests,
 	"A suite of tests for threads."
 	)
 {
@@ -1416,6 +2339,10 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_tid_recycling,
+	&test_symposium_stats,
+	&test_thread_affinity,
+	&test_boot_reserve_cores,
 	NULL
 };
 
@@ -1462,7 +2389,7 @@ BOOT_TEST(test_pipe_fails_on_exhausted_fid,
 	)
 {
 	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
+	for(uint i=0; i< (MAX_FILEID_LIMIT/2); i++ )
 		ASSERT(Pipe(&pipe)==0);
 	for(uint i=0; i< (MAX_FILEID/2); i++ )
 		ASSERT(Pipe(&pipe)==-1);	
@@ -1633,6 +2560,460 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+/* Writes a byte pattern to the pipe given in args, in chunks of
+   varying size. */
+static int pattern_producer(int argl, void* args)
+{
+	pipe_t pipe = *(pipe_t*)args;
+	Close(pipe.read);
+
+	char buffer[1000];
+	unsigned int pos = 0, chunk = 1;
+	while(pos < 100000) {
+		unsigned int n = (100000-pos < chunk) ? 100000-pos : chunk;
+		for(unsigned int i=0;i<n;i++) buffer[i] = (char)((pos+i) % 251);
+		unsigned int done = 0;
+		while(done < n) {
+			int rc = Write(pipe.write, buffer+done, n-done);
+			assert(rc>0);
+			done += rc;
+		}
+		pos += n;
+		chunk = (chunk*7 + 3) % 1000 + 1;
+	}
+	Close(pipe.write);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_sized,
+	"Test a pipe with a small buffer size, checking the data as it wraps around the buffer."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeSized(&pipe, 300)==0);
+
+	ASSERT(Exec(pattern_producer, sizeof(pipe), &pipe)!=NOPROC);
+	Close(pipe.write);
+
+	char buffer[777];
+	unsigned int pos = 0;
+	int rc;
+	while((rc = Read(pipe.read, buffer, sizeof(buffer))) > 0) {
+		ASSERT(rc <= 512);
+		for(int i=0;i<rc;i++)
+			ASSERT(buffer[i] == (char)((pos+i) % 251));
+		pos += rc;
+	}
+	ASSERT(rc==0);
+	ASSERT(pos == 100000);
+
+	WaitChild(NOPROC, NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice_tee,
+	"Test Splice and Tee between pipes, and their error cases."
+	)
+{
+	pipe_t a, b;
+	ASSERT(PipeSized(&a, 256)==0);
+	ASSERT(Pipe(&b)==0);
+
+	char buffer[512];
+
+	/* Tee leaves the data in a, Splice consumes it */
+	ASSERT(Write(a.write, "Hello world", 12)==12);
+	ASSERT(Tee(a.read, b.write, 100)==12);
+	ASSERT(Splice(a.read, b.write, 6)==6);
+	ASSERT(Splice(a.read, b.write, 100)==6);
+	ASSERT(Read(b.read, buffer, sizeof(buffer))==24);
+	ASSERT(memcmp(buffer, "Hello world\0Hello world", 24)==0);
+
+	/* Spans that wrap around the ring buffer */
+	for(int i=0;i<200;i++) buffer[i] = i;
+	ASSERT(Write(a.write, buffer, 200)==200);
+	ASSERT(Read(a.read, buffer, 200)==200);
+	for(int i=0;i<200;i++) buffer[i] = i;
+	ASSERT(Write(a.write, buffer, 200)==200);
+	ASSERT(Splice(a.read, b.write, 200)==200);
+	memset(buffer, 0, 200);
+	ASSERT(Read(b.read, buffer, sizeof(buffer))==200);
+	for(int i=0;i<200;i++) ASSERT(buffer[i] == (char)i);
+
+	/* Errors */
+	Fid_t fnull = OpenNull();
+	ASSERT(Splice(a.read, a.write, 10)==-1);
+	ASSERT(Splice(b.write, a.write, 10)==-1);
+	ASSERT(Splice(a.read, b.read, 10)==-1);
+	ASSERT(Splice(a.read, MAX_FILEID, 10)==-1);
+	ASSERT(Tee(fnull, b.write, 10)==-1);
+
+	/* Streams without a Splice method */
+	ASSERT(Splice(fnull, b.write, 10)==10);
+	ASSERT(Read(b.read, buffer, sizeof(buffer))==10);
+	ASSERT(Write(a.write, "abc", 3)==3);
+	ASSERT(Splice(a.read, fnull, 10)==3);
+
+	/* End of data */
+	Close(a.write);
+	ASSERT(Splice(a.read, b.write, 10)==0);
+	ASSERT(Tee(a.read, b.write, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_readv_writev,
+	"Test vectored I/O on a pipe, and on a stream without native vectored operations."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char hdr[4] = "abc", body[8] = "defghij", tail[2] = "k";
+	iovec_t out[4] = {
+		{ .base = hdr, .len = 3 },
+		{ .base = NULL, .len = 0 },
+		{ .base = body, .len = 7 },
+		{ .base = tail, .len = 2 }
+	};
+	ASSERT(WriteV(pipe.write, out, 4)==12);
+
+	char a[5], b[20];
+	iovec_t in[2] = { { .base = a, .len = 5 }, { .base = b, .len = 20 } };
+	ASSERT(ReadV(pipe.read, in, 2)==12);
+	ASSERT(memcmp(a, "abcde", 5)==0);
+	ASSERT(strcmp(b, "fghijk")==0);
+
+	/* The null device has no vectored operations */
+	Fid_t fnull = OpenNull();
+	ASSERT(WriteV(fnull, out, 4)==12);
+	memset(b, 1, sizeof(b));
+	ASSERT(ReadV(fnull, in, 2)==25);
+	ASSERT(b[19]==0);
+
+	/* Errors */
+	ASSERT(ReadV(pipe.write, in, 2)==-1);
+	ASSERT(WriteV(pipe.read, out, 4)==-1);
+	ASSERT(WriteV(MAX_FILEID, out, 4)==-1);
+	ASSERT(WriteV(pipe.write, out, MAX_IOVEC+1)==-1);
+
+	Close(pipe.write);
+	ASSERT(ReadV(pipe.read, in, 2)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_pipe,
+	"Test Poll, TimedRead and TimedWrite on the ends of a pipe."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeSized(&pipe, 256)==0);
+
+	pollfd_t fds[4] = {
+		{ .fid = pipe.read, .events = POLL_READ },
+		{ .fid = pipe.write, .events = POLL_WRITE },
+		{ .fid = -1, .events = POLL_READ },
+		{ .fid = MAX_FILEID-1, .events = POLL_READ }
+	};
+
+	ASSERT(Poll(fds, 4, 0)==2);
+	ASSERT(fds[0].revents==0);
+	ASSERT(fds[1].revents==POLL_WRITE);
+	ASSERT(fds[2].revents==0);
+	ASSERT(fds[3].revents==POLL_INVALID);
+	ASSERT(Poll(fds, MAX_FILEID_LIMIT+1, 0)==-1);
+
+	/* More entries than fit on the kernel stack */
+	pollfd_t many[2*MAX_FILEID];
+	for(int i=0; i<2*MAX_FILEID; i++)
+		many[i] = (pollfd_t){ .fid = (i%2) ? pipe.write : -1, .events = POLL_WRITE };
+	ASSERT(Poll(many, 2*MAX_FILEID, 0)==MAX_FILEID);
+
+	char buffer[256];
+	ASSERT(TimedRead(pipe.read, buffer, 10, 0)==-1);
+	ASSERT(TimedRead(pipe.read, buffer, 10, 20)==-1);
+
+	/* Fill the pipe */
+	memset(buffer, 'x', 256);
+	ASSERT(TimedWrite(pipe.write, buffer, 256, 0)==256);
+	ASSERT(TimedWrite(pipe.write, buffer, 1, 0)==-1);
+	ASSERT(Poll(fds, 2, 0)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+	ASSERT(fds[1].revents==0);
+
+	ASSERT(TimedRead(pipe.read, buffer, 100, 0)==100);
+	ASSERT(Poll(fds, 2, 0)==2);
+
+	/* Hangups */
+	Close(pipe.write);
+	ASSERT(Poll(fds, 1, 0)==1);
+	ASSERT(fds[0].revents==(POLL_READ|POLL_HANGUP));
+	ASSERT(TimedRead(pipe.read, buffer, 256, 0)==156);
+	ASSERT(TimedRead(pipe.read, buffer, 256, 0)==0);
+	return 0;
+}
+
+
+/* Read one byte from the pipe whose read end is given */
+static int one_byte_reader(int argl, void* args)
+{
+	char c;
+	ASSERT(Read(argl, &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_timed_read_deadline,
+	"Test that TimedRead gives up at its deadline, when another reader takes the data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeSized(&pipe, 256)==0);
+
+	/* Let the reader block on the empty pipe, while we wait */
+	char buffer[10];
+	Tid_t t = CreateThread(one_byte_reader, pipe.read, NULL);
+	ASSERT(TimedRead(pipe.read, buffer, 10, 50)==-1);
+
+	/* The byte goes to the blocked reader, not to us */
+	ASSERT(Write(pipe.write, "a", 1)==1);
+	ASSERT(TimedRead(pipe.read, buffer, 10, 0)==-1);
+	ASSERT(TimedRead(pipe.read, buffer, 10, 20)==-1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	ASSERT(Write(pipe.write, "b", 1)==1);
+	ASSERT(TimedRead(pipe.read, buffer, 10, 0)==1);
+	ASSERT(buffer[0]=='b');
+	return 0;
+}
+
+
+/* Wait a little, then write to the pipe whose write end is given */
+static int delayed_writer(int argl, void* args)
+{
+	fibo(25);
+	ASSERT(Write(argl, "z", 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_poll_wakeup,
+	"Test that Poll on several pipes wakes up when one of them becomes ready."
+	)
+{
+	pipe_t p[3];
+	pollfd_t fds[3];
+	for(int i=0;i<3;i++) {
+		ASSERT(Pipe(p+i)==0);
+		fds[i].fid = p[i].read;
+		fds[i].events = POLL_READ;
+	}
+
+	ASSERT(Exec(delayed_writer, p[1].write, NULL)!=NOPROC);
+	ASSERT(Poll(fds, 3, (timeout_t)-1)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==POLL_READ && fds[2].revents==0);
+
+	char c;
+	ASSERT(Read(p[1].read, &c, 1)==1 && c=='z');
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Now, wake up by a hangup */
+	Close(p[1].write);
+	ASSERT(Poll(fds, 3, 1000)==1);
+	ASSERT(fds[1].revents==(POLL_READ|POLL_HANGUP));
+	return 0;
+}
+
+
+#define RING_ENTRIES 8
+
+/* Queue a request on the submission ring */
+static void ring_queue(io_ring* ring, io_opcode op, Fid_t fd, char* buf, unsigned int size, unsigned long data)
+{
+	io_sqe* sqe = &ring->sq[ring->sq_tail & (ring->entries-1)];
+	sqe->op = op;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->size = size;
+	sqe->user_data = data;
+	ring->sq_tail++;
+}
+
+/* Take a completion off the completion ring, returning 0 if there is none */
+static int ring_reap(io_ring* ring, io_cqe* cqe)
+{
+	if(__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) == ring->cq_head)
+		return 0;
+	*cqe = ring->cq[ring->cq_head & (ring->entries-1)];
+	__atomic_store_n(&ring->cq_head, ring->cq_head+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Leave a read on an empty pipe in progress, and exit */
+static int ring_exit_pending(int argl, void* args)
+{
+	io_sqe sq[RING_ENTRIES];
+	io_cqe cq[RING_ENTRIES];
+	io_ring ring = { .entries = RING_ENTRIES, .sq = sq, .cq = cq };
+	pipe_t p;
+	char buf[16];
+
+	ASSERT(RingSetup(&ring)==0);
+	ASSERT(Pipe(&p)==0);
+	ring_queue(&ring, IO_READ, p.read, buf, sizeof(buf), 1);
+	ASSERT(Submit(1, 0)==1);
+	ASSERT(RingSetup(NULL)==-1);
+	return 0;
+}
+
+static int ring_submitter(int argl, void* args)
+{
+	ASSERT(Submit(1, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_ring_pipe,
+	"Test that I/O ring requests on pipes complete, inline or by a worker thread,\n"
+	"that submission stops when the completion ring is full, that the ring is\n"
+	"not used or replaced during another thread's Submit, and that a process\n"
+	"can exit with requests in progress."
+	)
+{
+	io_sqe sq[RING_ENTRIES];
+	io_cqe cq[RING_ENTRIES];
+	io_ring ring = { .entries = 3, .sq = sq, .cq = cq };
+	io_cqe cqe = {0};
+	pipe_t p;
+	char buf[16];
+
+	ASSERT(Submit(1, 0)==-1);
+	ASSERT(RingSetup(&ring)==-1);
+	ring.entries = RING_ENTRIES;
+	ASSERT(RingSetup(&ring)==0);
+	ASSERT(Pipe(&p)==0);
+
+	/* The read blocks, so it is completed by a worker */
+	ring_queue(&ring, IO_READ, p.read, buf, sizeof(buf), 1);
+	ring_queue(&ring, IO_WRITE, p.write, "hello", 5, 2);
+	ASSERT(Submit(RING_ENTRIES, 2)==2);
+	unsigned long seen = 0;
+	for(int i=0; i<2; i++) {
+		ASSERT(ring_reap(&ring, &cqe) && cqe.result==5);
+		seen |= 1ul << cqe.user_data;
+	}
+	ASSERT(seen == 6);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(! ring_reap(&ring, &cqe));
+
+	/* A close is seen by the rest of the batch */
+	ring_queue(&ring, IO_CLOSE, p.write, NULL, 0, 3);
+	ring_queue(&ring, IO_WRITE, p.write, "x", 1, 4);
+	ring_queue(&ring, IO_READ, p.read, buf, sizeof(buf), 5);
+	ASSERT(Submit(3, 3)==3);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==3 && cqe.result==0);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==4 && cqe.result==-1);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==5 && cqe.result==0);
+
+	/* Fill the completion ring */
+	for(int i=0; i<RING_ENTRIES; i++)
+		ring_queue(&ring, IO_NOP, NOFILE, NULL, 0, 10+i);
+	ASSERT(Submit(RING_ENTRIES, 0)==RING_ENTRIES);
+	ring_queue(&ring, IO_NOP, NOFILE, NULL, 0, 100);
+	ASSERT(Submit(1, 0)==0);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==10);
+	ASSERT(Submit(1, 0)==1);
+	for(int i=1; i<RING_ENTRIES; i++)
+		ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==10+i);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==100 && cqe.result==0);
+
+	/* More blocked requests than worker threads, made ready in reverse */
+	pipe_t pp[RING_ENTRIES];
+	char pbuf[RING_ENTRIES];
+	for(int i=0; i<RING_ENTRIES; i++) {
+		ASSERT(Pipe(&pp[i])==0);
+		ring_queue(&ring, IO_READ, pp[i].read, &pbuf[i], 1, 20+i);
+	}
+	ASSERT(Submit(RING_ENTRIES, 0)==RING_ENTRIES);
+	for(int i=RING_ENTRIES-1; i>=0; i--)
+		ASSERT(Write(pp[i].write, "0123456789"+i, 1)==1);
+	ASSERT(Submit(0, RING_ENTRIES)==0);
+	seen = 0;
+	for(int i=0; i<RING_ENTRIES; i++) {
+		ASSERT(ring_reap(&ring, &cqe) && cqe.result==1);
+		seen |= 1ul << (cqe.user_data-20);
+	}
+	ASSERT(seen == (1ul<<RING_ENTRIES)-1);
+	ASSERT(memcmp(pbuf, "01234567", RING_ENTRIES)==0);
+	for(int i=0; i<RING_ENTRIES; i++) {
+		Close(pp[i].read);
+		Close(pp[i].write);
+	}
+
+	/* While a thread is in Submit, the ring cannot be used or replaced */
+	pipe_t q;
+	ASSERT(Pipe(&q)==0);
+	ring_queue(&ring, IO_READ, q.read, buf, sizeof(buf), 6);
+	Tid_t t = CreateThread(ring_submitter, 0, NULL);
+	while(Submit(0, 0)==0)
+		Poll(NULL, 0, 1);
+	ASSERT(RingSetup(NULL)==-1);
+	ASSERT(RingSetup(&ring)==-1);
+	ASSERT(Write(q.write, "y", 1)==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ring_reap(&ring, &cqe) && cqe.user_data==6 && cqe.result==1);
+
+	ASSERT(RingSetup(NULL)==0);
+	ASSERT(Submit(1, 0)==-1);
+
+	ASSERT(Exec(ring_exit_pending, 0, NULL)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+static int buffered_child(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	FILE* fout = fidopen(fid, "w");
+	fprintf(fout, "Hello ");
+	fprintf(fout, "world\n");
+	/* The stream is not closed; it is flushed at exit */
+	return 0;
+}
+
+BOOT_TEST(test_fidopen_buffering,
+	"Test that a stream opened by fidopen on a pipe is fully buffered, and that a process's "
+	"buffered output is flushed when it exits."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	pollfd_t fd = { .fid = p.read, .events = POLL_READ };
+
+	FILE* fout = fidopen(p.write, "w");
+	ASSERT(fout != NULL);
+	ASSERT(fputs("buffered\n", fout) >= 0);
+	ASSERT(Poll(&fd, 1, 0)==0);
+	ASSERT(fflush(fout)==0);
+	ASSERT(Poll(&fd, 1, 0)==1);
+
+	char buf[32];
+	ASSERT(Read(p.read, buf, sizeof(buf))==9);
+	ASSERT(memcmp(buf, "buffered\n", 9)==0);
+
+	/* The output of a child that does not close its stream */
+	ASSERT(Exec(buffered_child, sizeof(Fid_t), &p.write)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(Read(p.read, buf, sizeof(buf))==12);
+	ASSERT(memcmp(buf, "Hello world\n", 12)==0);
+
+	ASSERT(fclose(fout)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1643,6 +3024,14 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_sized,
+	&test_pipe_splice_tee,
+	&test_readv_writev,
+	&test_poll_pipe,
+	&test_timed_read_deadline,
+	&test_poll_wakeup,
+	&test_ring_pipe,
+	&test_fidopen_buffering,
 	NULL
 };
 
@@ -1714,7 +3103,7 @@ BOOT_TEST(test_socket_constructor_out_of_fids,
 	"Test that the socket constructor fails on running out of Fids"
 	)
 {
-	for(int i=0;i<MAX_FILEID;i++)
+	for(int i=0;i<MAX_FILEID_LIMIT;i++)
 		ASSERT(Socket(100)!=NOFILE);
 	for(int i=0;i<MAX_FILEID;i++)
 		ASSERT(Socket(100)==NOFILE);	
@@ -1879,11 +3268,11 @@ BOOT_TEST(test_accept_fails_on_exhausted_fid,
 	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
 
-	/* If MAX_FILEID is odd, allocate an extra fid */
-	if( (MAX_FILEID & 1) == 1 )  OpenNull();
+	/* If MAX_FILEID_LIMIT is odd, allocate an extra fid */
+	if( (MAX_FILEID_LIMIT & 1) == 1 )  OpenNull();
 
 	/* Allocate pairs of fids */
-	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
+	for(uint i=0;i< (MAX_FILEID_LIMIT-1)/2 ; i++) {		
 		Fid_t cli = Socket(NOPORT);
 		Fid_t srv;
 		ASSERT(cli != NOFILE);
@@ -2112,6 +3501,93 @@ BOOT_TEST(test_socket_multi_producer,
 
 
 
+static int connect_and_send_id(int argl, void* args)
+{
+	int id = argl;
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(sock!=NOFILE);
+	ASSERT(Connect(sock, 100, 10000)==0);
+	ASSERT(Write(sock, (char*)&id, sizeof(id))==sizeof(id));
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(test_accept_backlog,
+	"Test that many concurrent Connect calls, more than the accept backlog, are all served by Accept."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	const int N = 100;
+	char seen[N];
+	memset(seen, 0, N);
+	for(int i=0;i<N;i++)
+		ASSERT(Exec(connect_and_send_id, i, NULL)!=NOPROC);
+
+	for(int i=0;i<N;i++) {
+		Fid_t srv = Accept(lsock);
+		ASSERT(srv!=NOFILE);
+		int id;
+		ASSERT(Read(srv, (char*)&id, sizeof(id))==sizeof(id));
+		ASSERT(id>=0 && id<N && !seen[id]);
+		seen[id] = 1;
+		ASSERT(Read(srv, (char*)&id, sizeof(id))==0);
+		Close(srv);
+	}
+
+	for(int i=0;i<N;i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+static int connect_and_hang_up(int argl, void* args)
+{
+	fibo(25);
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 100, 1000)==0);
+	ASSERT(Write(sock, "Hello", 6)==6);
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(test_poll_socket,
+	"Test Poll on a listening socket and on a connected socket."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	pollfd_t fd = { .fid = lsock, .events = POLL_READ };
+	ASSERT(Poll(&fd, 1, 0)==0);
+
+	ASSERT(Exec(connect_and_hang_up, 0, NULL)!=NOPROC);
+	ASSERT(Poll(&fd, 1, (timeout_t)-1)==1);
+	ASSERT(fd.revents==POLL_READ);
+
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+
+	pollfd_t sfd = { .fid = srv, .events = POLL_READ };
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(Poll(&sfd, 1, 1000)==1);
+	ASSERT(sfd.revents==(POLL_READ|POLL_HANGUP));
+
+	char buffer[6];
+	ASSERT(Read(srv, buffer, 6)==6);
+	ASSERT(Read(srv, buffer, 6)==0);
+
+	/* An unconnected socket */
+	sfd.fid = Socket(NOPORT);
+	sfd.events = POLL_READ|POLL_WRITE;
+	ASSERT(Poll(&sfd, 1, 0)==1);
+	ASSERT(sfd.revents==POLL_ERROR);
+	return 0;
+}
+
+
 BOOT_TEST(test_shudown_read,
 	"Test that ShutDown with SHUTDOWN_READ blocks Write"
 	)
@@ -2210,6 +3686,8 @@ TEST_SUITE(socket_tests,
 	&test_accept_fails_on_unbound_socket,
 	&test_accept_fails_on_connected_socket,
 	&test_accept_reusable,
+	&test_accept_backlog,
+	&test_poll_socket,
 	&test_accept_fails_on_exhausted_fid,
 	&test_accept_unblocks_on_close,
 